@@ -0,0 +1,485 @@
+/*************************************************************
+  Benchmark of the correlation kernels on synthetic inputs
+  Makes Gaussian or lognormal boxes and bins of triangles in
+  memory (no .dat or verts files), times run_correlation over a
+  sweep of settings and prints one tab-separated row per run
+    make bench
+    ./bench -N 32,64 --bins 4,8 --ntri 200 -s 0.05,1 -j 1,27
+            --threads 1,2,4 -k halo,shared,wrap -o bench.tsv
+  The sweep options take comma-separated lists, swept in full
+*************************************************************/
+
+#include "corr3.hpp"
+#include "globals.hpp"
+#include "gather.hpp"
+#include "sampling.hpp"
+#include "jackknife.hpp"
+#include "quantise.hpp"
+#include "calibrate.hpp"
+#include "numa.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+long int jackknife_N = 1;
+int jk_layout = JK_CUBES;
+int jk_accumulation = JK_AUTO;
+double sample_fraction = 1.0;
+unsigned long int sample_seed = 1;
+int global_nthreads = 1;
+int kernel_mode = KERNEL_HALO;
+int simd_level = SIMD_SCALAR;
+int traversal_mode = TRAVERSE_FLAT;
+int tile_size = 0;
+int precision_mode = PRECISION_DOUBLE;
+int storage_mode = STORAGE_FLOAT;
+int batch_size = 1;
+int shell_block = 0;
+int numa_mode = NUMA_OFF;
+double progress_interval = 0.0;
+
+// Comma-separated values of an option, or its default
+static vector<string> option_list(ArgumentParser& parser, string name, string default_st){
+    string st = parser.retrieve<string>(name);
+    vector<string> values = split_string(st.length()>0 ? st : default_st, ',');
+    if (values.size()==0){
+        cout << "  ERROR: empty list for " << name << "\n";
+        exit(1);
+    }
+    return values;
+}
+
+static vector<int> int_list(ArgumentParser& parser, string name, string default_st){
+    vector<string> values = option_list(parser, name, default_st);
+    vector<int> ints;
+    for (size_t i=0; i<values.size(); i++) ints.push_back(atoi(values[i].c_str()));
+    return ints;
+}
+
+static vector<double> double_list(ArgumentParser& parser, string name, string default_st){
+    vector<string> values = option_list(parser, name, default_st);
+    vector<double> doubles;
+    for (size_t i=0; i<values.size(); i++) doubles.push_back(atof(values[i].c_str()));
+    return doubles;
+}
+
+// Unit normal deviate of voxel i (Box-Muller on two counter hashes)
+static inline double normal_deviate(uint64_t seed, long int i){
+    const double u1 = (double(splitmix64(seed, 2*i) >> 11) + 0.5) / 9007199254740992.0;
+    const double u2 = double(splitmix64(seed, 2*i + 1) >> 11) / 9007199254740992.0;
+    return sqrt(-2.0*log(u1)) * cos(2.0*M_PI*u2);
+}
+
+// Synthetic box of white noise, normalised to T/<T> as the driver does
+//   gaussian:  1 + sigma*g
+//   lognormal: exp(sigma*g - sigma^2/2)
+// The values change the sums, not the work, so no clustering is needed
+static float* synthetic_box(string fieldSt, int Nres, double sigma, uint64_t seed){
+    const long int Nres3 = long(Nres)*Nres*Nres;
+    const bool lognormal = (fieldSt=="lognormal");
+    float* box = new float[Nres3];
+    long double sum = 0;
+    #pragma omp parallel for reduction(+:sum)
+    for (long int i=0; i<Nres3; i++){
+        const double g = normal_deviate(seed, i);
+        box[i] = lognormal ? exp(sigma*g - 0.5*sigma*sigma) : 1.0 + sigma*g;
+        sum += box[i];
+    }
+    const float ave = sum / Nres3;
+    #pragma omp parallel for
+    for (long int i=0; i<Nres3; i++) box[i] /= ave;
+    return box;
+}
+
+// Square of the side of a triangle
+static inline double side_sq(const point& a, const point& b){
+    const double dx = a.x-b.x, dy = a.y-b.y, dz = a.z-b.z;
+    return dx*dx + dy*dy + dz*dz;
+}
+
+// Bins of bin_width pixels from 2 pixels, as make_verts.py (cell size 1):
+// up to n_tri triangles per bin with all three sides in [rmin, rmax),
+// drawn without replacement from every such triangle and grouped by ptB
+static vector<triangle_configs>* synthetic_bins(int n_bins, double bin_width, int n_tri, uint64_t seed){
+
+    vector<triangle_configs>* all_configs = new vector<triangle_configs>();
+    for (int bin_i=0; bin_i<n_bins; bin_i++){
+        const double rmin = 2.0 + bin_i*bin_width;
+        const double rmax = rmin + bin_width;
+        const double rmin_sq = rmin*rmin, rmax_sq = rmax*rmax;
+        const int r = int(ceil(rmax));
+
+        // Points in the shell, then every (ptB, ptC) pair of them
+        // closing a triangle in the bin
+        vector<point> shell;
+        const point origin(0, 0, 0);
+        for (int x=-r; x<=r; x++){
+            for (int y=-r; y<=r; y++){
+                for (int z=-r; z<=r; z++){
+                    const point p(x, y, z);
+                    const double d_sq = side_sq(p, origin);
+                    if (d_sq>=rmin_sq and d_sq<rmax_sq) shell.push_back(p);
+                }
+            }
+        }
+        vector< pair<int,int> > triangles;
+        for (int b=0; b<(int)shell.size(); b++){
+            for (int c=0; c<(int)shell.size(); c++){
+                const double d_sq = side_sq(shell[b], shell[c]);
+                if (d_sq>=rmin_sq and d_sq<rmax_sq) triangles.push_back(std::make_pair(b, c));
+            }
+        }
+
+        // Partial Fisher-Yates shuffle picks n_tri of them
+        const size_t n_keep = std::min(triangles.size(), size_t(n_tri));
+        for (size_t i=0; i<n_keep; i++){
+            const size_t j = i + splitmix64(seed + bin_i, i) % (triangles.size() - i);
+            std::swap(triangles[i], triangles[j]);
+        }
+        triangles.resize(n_keep);
+        std::sort(triangles.begin(), triangles.end());
+
+        // One set per ptB, and the average sides
+        triangle_configs this_bin_configs;
+        this_bin_configs.rmin = rmin;
+        this_bin_configs.rmax = rmax;
+        double R1_sum = 0, R2_sum = 0, R3_sum = 0;
+        for (size_t i=0; i<n_keep; i++){
+            point& ptB = shell[triangles[i].first];
+            point& ptC = shell[triangles[i].second];
+            if (i==0 or triangles[i].first!=triangles[i-1].first){
+                this_bin_configs.add_set(triangle_set(ptB));
+            }
+            this_bin_configs.sets.back().ptsC.push_back(ptC);
+            R1_sum += mag(ptB);
+            R2_sum += mag(ptC);
+            R3_sum += sqrt(distSq(ptB, ptC));
+        }
+        this_bin_configs.r1avg = R1_sum / std::max(n_keep, size_t(1));
+        this_bin_configs.r2avg = R2_sum / std::max(n_keep, size_t(1));
+        this_bin_configs.r3avg = R3_sum / std::max(n_keep, size_t(1));
+        all_configs->push_back(this_bin_configs);
+    }
+    return all_configs;
+}
+
+// Kernel settings from their command line names, as the driver
+static void set_kernel(string kernelSt){
+    if (kernelSt=="halo"){
+        kernel_mode = KERNEL_HALO;
+    } else if (kernelSt=="shared"){
+        kernel_mode = KERNEL_SHARED;
+    } else if (kernelSt=="wrap"){
+        kernel_mode = KERNEL_WRAP;
+    } else {
+        cout << "  ERROR: unrecognised kernel: '" << kernelSt << "'\n";
+        exit(1);
+    }
+}
+
+static void set_precision(string precisionSt){
+    if (precisionSt=="double"){
+        precision_mode = PRECISION_DOUBLE;
+    } else if (precisionSt=="mixed"){
+        precision_mode = PRECISION_MIXED;
+    } else {
+        cout << "  ERROR: unrecognised precision: '" << precisionSt << "'\n";
+        exit(1);
+    }
+}
+
+static void set_storage(string storageSt){
+    if (storageSt=="float"){
+        storage_mode = STORAGE_FLOAT;
+    } else if (storageSt=="int16"){
+        storage_mode = STORAGE_INT16;
+    } else if (storageSt=="int8"){
+        storage_mode = STORAGE_INT8;
+    } else {
+        cout << "  ERROR: unrecognised storage: '" << storageSt << "'\n";
+        exit(1);
+    }
+}
+
+// Jackknife regions: cubes if jackknife_N is a cube number, else slabs
+static void set_jackknife(int jk){
+    if (jk<1){
+        cout << "  ERROR: invalid jackknife " << jk << "\n";
+        exit(1);
+    }
+    jackknife_N = jk;
+    long int jk_per_side = lround(cbrt(double(jackknife_N)));
+    jk_layout = (jk_per_side*jk_per_side*jk_per_side==jackknife_N) ? JK_CUBES : JK_SLABS;
+}
+
+// Field values the kernel reads for one primary: the primary, each ptB
+// and each ptC of every bin (the gather traffic, which the caches
+// partly serve, not the DRAM traffic)
+static double values_per_primary(vector<triangle_configs>* selectionFunction){
+    double values = 1.0;
+    for (size_t bin_i=0; bin_i<selectionFunction->size(); bin_i++){
+        triangle_configs& this_bin = selectionFunction->at(bin_i);
+        values += this_bin.sets.size() + this_bin.size();
+    }
+    return values;
+}
+
+// Kernel output (cout and printf) to /dev/null, until restore_stdout
+static int silence_stdout(){
+    fflush(stdout);
+    const int saved = dup(STDOUT_FILENO);
+    const int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    return saved;
+}
+
+static void restore_stdout(int saved){
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+// Best of n_repeats timings of run_correlation, with the DDD sum over
+// the bins (the same for every kernel, to catch wrong results)
+static double time_correlation(const float* box, vector<triangle_configs>* selectionFunction,
+                int Nres, const vector<long int>* primaries, int n_repeats, double& DDD_sum){
+    double best = 0.0;
+    for (int repeat=0; repeat<n_repeats; repeat++){
+        const double start = omp_get_wtime();
+        vector<statistics_with_jk>* results = run_correlation(box, box, box, selectionFunction, Nres, primaries);
+        const double seconds = omp_get_wtime() - start;
+        if (repeat==0 or seconds<best) best = seconds;
+        DDD_sum = 0.0;
+        for (size_t bin_i=0; bin_i<results->size(); bin_i++) DDD_sum += results->at(bin_i).stats.DDD;
+        delete results;
+    }
+    return best;
+}
+
+// Lists swept over, every combination of them
+struct bench_sweep{
+    vector<string> fields;
+    vector<int> resolutions, bin_counts, ntris;
+    vector<double> fractions;
+    vector<int> jackknifes;
+    vector<string> kernels, precisions, storages;
+    vector<int> threads;            // ascending
+    int n_repeats;
+    int pin_mode;                   // re-applied for each thread count
+};
+
+// Rows for one box, bins and sample fraction over the kernel settings
+// and thread counts; inputs holds the first columns (field to ntri)
+static void bench_settings(FILE* table, const char* inputs, const float* box,
+                vector<triangle_configs>* selectionFunction, int Nres, const bench_sweep& sweep){
+
+    const long int Nres3 = long(Nres)*Nres*Nres;
+    vector<long int>* primaries = (sample_fraction<1.0) ? sample_primaries(Nres3, sample_fraction, sample_seed) : NULL;
+    const long int n_primaries = primaries ? primaries->size() : Nres3;
+    const double pairs = triangles_per_primary(selectionFunction);
+    const double values = values_per_primary(selectionFunction);
+
+    for (size_t jk_i=0; jk_i<sweep.jackknifes.size(); jk_i++){
+        set_jackknife(sweep.jackknifes[jk_i]);
+        for (size_t kernel_i=0; kernel_i<sweep.kernels.size(); kernel_i++){
+            set_kernel(sweep.kernels[kernel_i]);
+            for (size_t precision_i=0; precision_i<sweep.precisions.size(); precision_i++){
+                set_precision(sweep.precisions[precision_i]);
+                for (size_t storage_i=0; storage_i<sweep.storages.size(); storage_i++){
+                    set_storage(sweep.storages[storage_i]);
+
+                    // The wrap kernel reads floats into double sums, whatever is asked
+                    const bool wrap = (kernel_mode==KERNEL_WRAP);
+                    if (wrap and (precision_i>0 or storage_i>0)) continue;
+                    const string precisionSt = wrap ? "double" : sweep.precisions[precision_i];
+                    const string storageSt = wrap ? "float" : sweep.storages[storage_i];
+                    const int bytes = wrap ? sizeof(float) : storage_bytes(storage_mode);
+
+                    // Scaling efficiency against the fewest threads of the sweep
+                    double base_speed = 0.0;
+                    for (size_t threads_i=0; threads_i<sweep.threads.size(); threads_i++){
+                        global_nthreads = sweep.threads[threads_i];
+                        omp_set_num_threads(global_nthreads);
+                        pin_threads(sweep.pin_mode);
+
+                        // Kernel output is not wanted in the table
+                        double DDD_sum = 0.0;
+                        const int saved_stdout = silence_stdout();
+                        const double seconds = std::max(time_correlation(box, selectionFunction, Nres, primaries, sweep.n_repeats, DDD_sum), 1e-9);
+                        restore_stdout(saved_stdout);
+
+                        const double speed = n_primaries * pairs / seconds;
+                        const double GB_per_s = n_primaries * values * bytes / seconds / 1e9;
+                        if (threads_i==0) base_speed = speed;
+                        const double efficiency = speed / base_speed * sweep.threads[0] / global_nthreads;
+                        fprintf(table, "%s\t%.0f\t%g\t%ld\t%s\t%s\t%s\t%s\t%d\t%ld\t%.4g\t%.4g\t%.4g\t%.3f\t%.10e\n",
+                                inputs, pairs, sample_fraction, jackknife_N, sweep.kernels[kernel_i].c_str(),
+                                precisionSt.c_str(), storageSt.c_str(),
+                                simd_level_name(simd_level), global_nthreads, n_primaries, seconds, speed,
+                                GB_per_s, efficiency, DDD_sum);
+                        fflush(table);
+                    }
+                }
+            }
+        }
+    }
+    delete primaries;
+}
+
+//  Main Method
+int main(int argc, const char * argv[]){
+
+    cout << "\n ------------------------------------------------------------------\n";
+    cout << " Benchmark of the correlation kernels at " << pretty_time() << "\n";
+
+    ArgumentParser parser;
+    parser.addArgument("-N", "--resolution", 1, true);
+    parser.addArgument("--field", 1, true);
+    parser.addArgument("--sigma", 1, true);
+    parser.addArgument("--bins", 1, true);
+    parser.addArgument("--bin_width", 1, true);
+    parser.addArgument("--ntri", 1, true);
+    parser.addArgument("-s", "--sample_fraction", 1, true);
+    parser.addArgument("-j", "--jackknife", 1, true);
+    parser.addArgument("--threads", 1, true);
+    parser.addArgument("-k", "--kernel", 1, true);
+    parser.addArgument("--precision", 1, true);
+    parser.addArgument("--storage", 1, true);
+    parser.addArgument("-v", "--simd", 1, true);
+    parser.addArgument("--symmetry", 1, true);
+    parser.addArgument("--numa", 1, true);
+    parser.addArgument("--pin", 1, true);
+    parser.addArgument("--repeats", 1, true);
+    parser.addArgument("--seed", 1, true);
+    parser.addArgument("-o", "--outputfilename", 1, true);
+    parser.parse(argc, argv);
+
+    // Sweep, every combination of these
+    char default_threads[32];
+    sprintf(default_threads, "1,%d", omp_get_max_threads());
+    bench_sweep sweep;
+    sweep.fields = option_list(parser, "field", "gaussian,lognormal");
+    sweep.resolutions = int_list(parser, "resolution", "32");
+    sweep.bin_counts = int_list(parser, "bins", "4");
+    sweep.ntris = int_list(parser, "ntri", "200");
+    sweep.fractions = double_list(parser, "sample_fraction", "1");
+    sweep.jackknifes = int_list(parser, "jackknife", "1");
+    sweep.kernels = option_list(parser, "kernel", "halo,shared,wrap");
+    sweep.precisions = option_list(parser, "precision", "double");
+    sweep.storages = option_list(parser, "storage", "float");
+    sweep.threads = int_list(parser, "threads", default_threads);
+    std::sort(sweep.threads.begin(), sweep.threads.end());
+    sweep.threads.erase(std::unique(sweep.threads.begin(), sweep.threads.end()), sweep.threads.end());
+    if (sweep.threads[0]<1 or *std::min_element(sweep.resolutions.begin(), sweep.resolutions.end())<1){
+        cout << "  ERROR: threads and N must be positive\n";
+        exit(1);
+    }
+    for (size_t i=0; i<sweep.fields.size(); i++){
+        if (sweep.fields[i]!="gaussian" and sweep.fields[i]!="lognormal"){
+            cout << "  ERROR: unrecognised field: '" << sweep.fields[i] << "'\n";
+            exit(1);
+        }
+    }
+
+    // Settings held for the whole sweep
+    string sigma_st = parser.retrieve<string>("sigma");
+    const double sigma = (sigma_st.length()>0) ? atof(sigma_st.c_str()) : 0.5;
+    string bin_width_st = parser.retrieve<string>("bin_width");
+    const double bin_width = (bin_width_st.length()>0) ? atof(bin_width_st.c_str()) : 1.0;
+    string repeats_st = parser.retrieve<string>("repeats");
+    sweep.n_repeats = std::max((repeats_st.length()>0) ? atoi(repeats_st.c_str()) : 3, 1);
+    string seed_st = parser.retrieve<string>("seed");
+    if (seed_st.length()>0) sample_seed = strtoul(seed_st.c_str(), NULL, 10);
+
+    string simdSt = parser.retrieve<string>("simd");
+    if (simdSt=="" || simdSt=="auto"){
+        simd_level = detect_simd_level();
+    } else if (simdSt=="avx512"){
+        simd_level = SIMD_AVX512;
+    } else if (simdSt=="avx2"){
+        simd_level = SIMD_AVX2;
+    } else if (simdSt=="scalar"){
+        simd_level = SIMD_SCALAR;
+    } else {
+        cout << "  ERROR: unrecognised simd: '" << simdSt << "'\n";
+        exit(1);
+    }
+    simd_level = std::min(simd_level, detect_simd_level());
+
+    string symmetrySt = parser.retrieve<string>("symmetry");
+    bool use_symmetry = false;
+    if (symmetrySt=="" || symmetrySt=="off"){
+        use_symmetry = false;
+    } else if (symmetrySt=="on"){
+        use_symmetry = true;
+    } else {
+        cout << "  ERROR: unrecognised symmetry: '" << symmetrySt << "'\n";
+        exit(1);
+    }
+
+    // NUMA replication and pinning, as the driver
+    string numaSt = parser.retrieve<string>("numa");
+    if (numaSt=="" || numaSt=="off"){
+        numa_mode = NUMA_OFF;
+    } else if (numaSt=="replicate"){
+        numa_mode = NUMA_REPLICATE;
+    } else {
+        cout << "  ERROR: unrecognised numa: '" << numaSt << "'\n";
+        exit(1);
+    }
+    string pinSt = parser.retrieve<string>("pin");
+    if (pinSt==""){
+        sweep.pin_mode = (numa_mode==NUMA_REPLICATE and getenv("OMP_PROC_BIND")==NULL) ? PIN_SPREAD : PIN_OFF;
+    } else if (pinSt=="off"){
+        sweep.pin_mode = PIN_OFF;
+    } else if (pinSt=="compact"){
+        sweep.pin_mode = PIN_COMPACT;
+    } else if (pinSt=="spread"){
+        sweep.pin_mode = PIN_SPREAD;
+    } else {
+        cout << "  ERROR: unrecognised pin: '" << pinSt << "'\n";
+        exit(1);
+    }
+
+    // Table to the output file, or stdout
+    string outputfilename = parser.retrieve<string>("outputfilename");
+    FILE* table = stdout;
+    if (outputfilename.length()>0){
+        table = fopen(outputfilename.c_str(), "w");
+        if (table==NULL){
+            cout << "  ERROR: could not open " << outputfilename << "\n";
+            exit(1);
+        }
+        cout << "  Writing the table to " << outputfilename << "\n";
+    }
+    cout << " ------------------------------------------------------------------\n\n";
+    fprintf(table, "field\tN\tbins\tntri\tpairs\tsample\tjk\tkernel\tprecision\tstorage\tsimd\tthreads\t"
+                   "primaries\tseconds\ttriangles_per_s\tGB_per_s\tefficiency\tDDD_sum\n");
+
+    for (size_t field_i=0; field_i<sweep.fields.size(); field_i++){
+        for (size_t N_i=0; N_i<sweep.resolutions.size(); N_i++){
+            const int Nres = sweep.resolutions[N_i];
+            float* box = synthetic_box(sweep.fields[field_i], Nres, sigma, sample_seed);
+            for (size_t bins_i=0; bins_i<sweep.bin_counts.size(); bins_i++){
+                for (size_t ntri_i=0; ntri_i<sweep.ntris.size(); ntri_i++){
+                    vector<triangle_configs>* selectionFunction = synthetic_bins(sweep.bin_counts[bins_i], bin_width, sweep.ntris[ntri_i], sample_seed);
+                    if (use_symmetry) canonicalise_triangle_configs(selectionFunction);
+                    char inputs[200];
+                    sprintf(inputs, "%s\t%d\t%d\t%d", sweep.fields[field_i].c_str(), Nres, sweep.bin_counts[bins_i], sweep.ntris[ntri_i]);
+                    for (size_t sample_i=0; sample_i<sweep.fractions.size(); sample_i++){
+                        sample_fraction = std::min(sweep.fractions[sample_i], 1.0);
+                        bench_settings(table, inputs, box, selectionFunction, Nres, sweep);
+                    }
+                    delete selectionFunction;
+                }
+            }
+            delete[] box;
+        }
+    }
+
+    if (table!=stdout) fclose(table);
+    cout << "\n Finished at " << pretty_time() << "\n";
+    cout << " ------------------------------------------------------------------\n";
+    return 0;
+}
@@ -154,9 +154,163 @@ vector<triangle_configs>* load_triangle_configs(const char *vertsfilename, float
 }
 
 
+// Ordered key of a point, to pick one of the two orderings of a triangle
+typedef std::pair< int, std::pair<int,int> > point_key;
+static point_key key_of(const point& a){
+    return std::make_pair(a.x, std::make_pair(a.y, a.z));
+}
+
+// For an auto-correlation, triangle (ptB, ptC) and its swap (ptC, ptB)
+// from the same primary have the same DDD, DRR and RRR, and their DDR
+// terms are data1*data2 and data1*data3. So each swapped pair stored in
+// a bin is kept once, under the smaller point, with mult_BC / mult_CB
+// counting the two orderings, and the kernels weight by them (exact,
+// for any sampling of primaries and for the jackknife regions)
+// Triangles whose swap isn't stored are left as they are
+void canonicalise_triangle_configs(vector<triangle_configs>* selectionFunction){
+
+    size_t n_stored = 0, n_canonical = 0;
+
+    for (size_t bin_index=0; bin_index<selectionFunction->size(); bin_index++){
+        triangle_configs& this_bin = selectionFunction->at(bin_index);
+
+        // Count each ordering of each distinct pair, in order of first appearance
+        std::map< std::pair<point_key,point_key>, size_t > index_of_pair;
+        vector< std::pair<point,point> > pairs;
+        vector< std::pair<int,int> > counts;
+        for (size_t set_index=0; set_index<this_bin.sets.size(); set_index++){
+            triangle_set& this_set = this_bin.sets.at(set_index);
+            for (size_t ptC_i=0; ptC_i<this_set.ptsC.size(); ptC_i++){
+                const point& ptB = this_set.ptB;
+                const point& ptC = this_set.ptsC.at(ptC_i);
+                const bool swapped = key_of(ptC) < key_of(ptB);
+                const point& first = swapped ? ptC : ptB;
+                const point& second = swapped ? ptB : ptC;
+                std::pair<point_key,point_key> key(key_of(first), key_of(second));
+                std::map< std::pair<point_key,point_key>, size_t >::iterator found = index_of_pair.find(key);
+                if (found==index_of_pair.end()){
+                    found = index_of_pair.insert(std::make_pair(key, pairs.size())).first;
+                    pairs.push_back(std::make_pair(first, second));
+                    counts.push_back(std::make_pair(0, 0));
+                }
+                if (swapped) counts.at(found->second).second++;
+                else         counts.at(found->second).first++;
+                n_stored++;
+            }
+        }
+
+        // One set per (ptB, mult_BC, mult_CB), in order of first appearance
+        typedef std::pair< std::pair<point_key,int>, int > set_key;
+        std::map< set_key, size_t > index_of_set;
+        vector<triangle_set> canonical_sets;
+        for (size_t pair_i=0; pair_i<pairs.size(); pair_i++){
+            point ptB = pairs.at(pair_i).first;
+            point ptC = pairs.at(pair_i).second;
+            int mult_BC = counts.at(pair_i).first;
+            int mult_CB = counts.at(pair_i).second;
+
+            // Only the swapped ordering stored: keep it as stored
+            if (mult_BC==0){
+                std::swap(ptB, ptC);
+                std::swap(mult_BC, mult_CB);
+            }
+
+            set_key key(std::make_pair(key_of(ptB), mult_BC), mult_CB);
+            std::map< set_key, size_t >::iterator found = index_of_set.find(key);
+            if (found==index_of_set.end()){
+                found = index_of_set.insert(std::make_pair(key, canonical_sets.size())).first;
+                triangle_set new_set(ptB);
+                new_set.mult_BC = mult_BC;
+                new_set.mult_CB = mult_CB;
+                canonical_sets.push_back(new_set);
+            }
+            canonical_sets.at(found->second).ptsC.push_back(ptC);
+            n_canonical++;
+        }
+
+        this_bin.sets = canonical_sets;
+        this_bin.Npad = 0;
+    }
+
+    printf("  Triangle symmetry: %ld stored triangles evaluated as %ld\n", (long int)n_stored, (long int)n_canonical);
+}
+
+// Largest absolute offset along any axis, over all ptB and ptC
+// A box padded by this many cells on each side never needs wrapping
+int max_offset(vector<triangle_configs>* selectionFunction){
+    int halo = 0;
+    for (size_t bin_index=0; bin_index<selectionFunction->size(); bin_index++){
+        triangle_configs& this_bin = selectionFunction->at(bin_index);
+        for (size_t set_index=0; set_index<this_bin.sets.size(); set_index++){
+            triangle_set& this_set = this_bin.sets.at(set_index);
+            point& ptB = this_set.ptB;
+            halo = std::max(halo, std::max(abs(ptB.x), std::max(abs(ptB.y), abs(ptB.z))));
+            for (size_t ptC_i=0; ptC_i<this_set.ptsC.size(); ptC_i++){
+                point& ptC = this_set.ptsC.at(ptC_i);
+                halo = std::max(halo, std::max(abs(ptC.x), std::max(abs(ptC.y), abs(ptC.z))));
+            }
+        }
+    }
+    return halo;
+}
+
+// Convert every ptB and ptC into one signed linear offset
+//  offset = (x*Npad*Npad) + (y*Npad) + z
+// for a box of Npad cells per side (Nres plus halo on both sides)
+void set_linear_offsets(vector<triangle_configs>* selectionFunction, int Npad){
+
+    // Offsets are stored as int, so make sure the largest one fits
+    int halo = max_offset(selectionFunction);
+    if ( double(halo) * (double(Npad)*Npad + Npad + 1) > 2147483647.0 ){
+        printf("  ERROR: linear offsets overflow int (halo %d, Npad %d)\n", halo, Npad);
+        exit(1);
+    }
+
+    for (size_t bin_index=0; bin_index<selectionFunction->size(); bin_index++){
+        triangle_configs& this_bin = selectionFunction->at(bin_index);
+        for (size_t set_index=0; set_index<this_bin.sets.size(); set_index++){
+            triangle_set& this_set = this_bin.sets.at(set_index);
+            point& ptB = this_set.ptB;
+            this_set.offB = (ptB.x*Npad + ptB.y)*Npad + ptB.z;
+            this_set.offsC.resize(this_set.ptsC.size());
+            for (size_t ptC_i=0; ptC_i<this_set.ptsC.size(); ptC_i++){
+                point& ptC = this_set.ptsC.at(ptC_i);
+                this_set.offsC.at(ptC_i) = (ptC.x*Npad + ptC.y)*Npad + ptC.z;
+            }
+        }
+        this_bin.Npad = Npad;
+    }
+}
+
+// Collect the distinct ptB offsets over all bins into one table
+// The same ptB turns up in many bins, as the r1 shells overlap,
+// so data2 and data1*data2 only need computing once per entry
+vector<shared_ptB>* share_ptB_offsets(vector<triangle_configs>* selectionFunction){
+
+    vector<shared_ptB>* shared = new vector<shared_ptB>();
+    std::map<int,size_t> index_of_offset;
+
+    for (size_t bin_index=0; bin_index<selectionFunction->size(); bin_index++){
+        triangle_configs& this_bin = selectionFunction->at(bin_index);
+        for (size_t set_index=0; set_index<this_bin.sets.size(); set_index++){
+            triangle_set& this_set = this_bin.sets.at(set_index);
+
+            // New offset: add an entry to the table
+            std::map<int,size_t>::iterator found = index_of_offset.find(this_set.offB);
+            if (found==index_of_offset.end()){
+                found = index_of_offset.insert(std::make_pair(this_set.offB, shared->size())).first;
+                shared->push_back(shared_ptB(this_set.ptB, this_set.offB));
+            }
+            shared->at(found->second).uses.push_back(std::make_pair((int)bin_index, (int)set_index));
+        }
+    }
+    return shared;
+}
+
+
 // Measured running speeds on different architectures
 // Get likely node from the number of threads
-// Can update these easily
+// (only a fallback: --calibrate measures the speed, see calibrate.hpp)
 double runSpeed(){
            if (global_nthreads==24){ return 7.50E+7; // donatello
     } else if (global_nthreads==16){ return 3.00E+7; // cores16
@@ -165,18 +319,20 @@ double runSpeed(){
     }
 }
 
-double summary_and_time_per_file(vector<triangle_configs>* selectionFunction, int Nres3, bool verbose){
+double summary_and_time_per_file(vector<triangle_configs>* selectionFunction, long int Nres3, bool verbose, double speed){
 
-    // Keep track of TOTAL number of configs to run
-    size_t total_configs = 0;
+    // Keep track of TOTAL number of triangles, and of the (ptB, ptC)
+    // pairs the kernel evaluates for them (fewer if canonicalised)
+    size_t total_triangles = 0, total_configs = 0;
 
     // Print summary of each bin 
     for (int bin_index=0; bin_index<(int)selectionFunction->size(); bin_index++){
 
         // Add all matches for this bin
         triangle_configs& this_bin = selectionFunction->at(bin_index);
-        size_t matches_in_bin = this_bin.size();
-        total_configs += matches_in_bin;
+        size_t matches_in_bin = this_bin.triangles();
+        total_triangles += matches_in_bin;
+        total_configs += this_bin.size();
 
         // Extract r values for bin (average and requested range )
         // And number of matches in bin (struct sums all matches)
@@ -197,12 +353,21 @@ double summary_and_time_per_file(vector<triangle_configs>* selectionFunction, in
     if (verbose) {
         printf("\n");    
     }
-    printf("   %ld triangles per sampled lattice point\n",total_configs);
+    printf("   %ld triangles per sampled lattice point",total_triangles);
+    if (total_configs!=total_triangles){
+        printf(" (%ld pairs evaluated)",total_configs);
+    }
+    printf("\n");
 
-    // How many actual calculations
-    double n_calculations = sample_fraction * total_configs * Nres3;
-    double time_per_file = n_calculations/runSpeed();
-    time_per_file /= sqrt(float(global_nthreads));
+    // How many actual calculations: pairs evaluated at the calibrated
+    // speed, or triangles at the fixed guess (timed on every triangle)
+    double time_per_file;
+    if (speed>0){
+        time_per_file = sample_fraction * total_configs * Nres3 / speed;
+    } else {
+        time_per_file = sample_fraction * total_triangles * Nres3 / runSpeed();
+        time_per_file /= sqrt(float(global_nthreads));
+    }
 
     printf("   Expected time : %.0f seconds for each file\n",time_per_file);
     if (time_per_file>60) {     printf("                = %.2f mins\n",time_per_file/60.0); } 
@@ -8,6 +8,10 @@
 #include <vector>
 using std::vector;
 
+#include <algorithm>
+#include <map>
+#include <utility>
+
 #include <iostream>
 using std::cout;
 
@@ -19,7 +23,17 @@ using std::cout;
 struct triangle_set{
 	point ptB;
 	vector<point> ptsC;
-	triangle_set(point _ptB) : ptB(_ptB) {}
+
+	// Same points as signed linear offsets into a halo-padded box
+	// (filled by set_linear_offsets)
+	int offB;
+	vector<int> offsC;
+
+	// How many stored triangles each (ptB, ptC) stands for: mult_BC as
+	// is, mult_CB with ptB and ptC swapped (see canonicalise_triangle_configs)
+	int mult_BC, mult_CB;
+
+	triangle_set(point _ptB) : ptB(_ptB), offB(0), mult_BC(1), mult_CB(0) {}
     size_t size(){ return ptsC.size(); }
 };
 
@@ -30,6 +44,12 @@ struct triangle_configs{
 	float r1avg, r2avg, r3avg;
 	vector <triangle_set> sets;
 
+	// Side of the padded box the linear offsets refer to (0 if unset)
+	int Npad;
+
+	triangle_configs() : Npad(0) {}
+
+    // (ptB, ptC) pairs stored, i.e. evaluated by the kernels
     size_t size(){ 
     	size_t total_size = 0;
     	for (size_t index=0; index<sets.size(); index++){
@@ -38,6 +58,16 @@ struct triangle_configs{
     	return total_size;
     }
 
+    // Triangles of the bin: each stored pair stands for mult_BC + mult_CB
+    // (more than size() once canonicalised)
+    size_t triangles(){ 
+    	size_t total_triangles = 0;
+    	for (size_t index=0; index<sets.size(); index++){
+    		total_triangles += sets.at(index).size() * (sets.at(index).mult_BC + sets.at(index).mult_CB);
+    	}
+    	return total_triangles;
+    }
+
     triangle_set& at(size_t index){ 
     	return sets.at(index); 
     }
@@ -48,11 +78,36 @@ struct triangle_configs{
 };
 
 
+// One distinct ptB offset, shared by every bin that uses it
+// uses = list of (bin index, set index) with this ptB
+struct shared_ptB{
+	point ptB;
+	int offB;
+	vector< std::pair<int,int> > uses;
+	shared_ptB(point _ptB, int _offB) : ptB(_ptB), offB(_offB) {}
+};
+
 // Method to load all triangle vertices from store .verts file
 vector<triangle_configs>* load_triangle_configs(const char *vertsfilename, float cell_size);
 
+// Merge each triangle with its ptB<->ptC swap (auto-correlations only,
+// where box2==box3), so each distinct pair is evaluated once
+void canonicalise_triangle_configs(vector<triangle_configs>* selectionFunction);
+
+// Largest |offset| along any axis over all ptB and ptC
+// = halo width needed so a padded box never wraps
+int max_offset(vector<triangle_configs>* selectionFunction);
+
+// Convert every ptB / ptC into a linear offset for a box of side Npad
+void set_linear_offsets(vector<triangle_configs>* selectionFunction, int Npad);
+
+// Table of distinct ptB offsets across all bins (after set_linear_offsets)
+vector<shared_ptB>* share_ptB_offsets(vector<triangle_configs>* selectionFunction);
+
 // Print number of configuations and likely run time
-double summary_and_time_per_file(vector<triangle_configs>* selectionFunction, int Nres3, bool verbose);
+// speed: calibrated (ptB, ptC) pairs per second (see calibrate.hpp), or
+// 0 to guess triangles per second from the thread count
+double summary_and_time_per_file(vector<triangle_configs>* selectionFunction, long int Nres3, bool verbose, double speed = 0.0);
 
 
 #endif
@@ -0,0 +1,177 @@
+/************************************************************
+  FFT bispectrum (shell-filtered FFT products)
+*************************************************************/
+
+#include "bispectrum.hpp"
+#include "globals.hpp"
+#include <iomanip>
+
+// Load triangle bins from a text file
+vector<kbin_triangle>* load_kbin_triangles(const char *kbinsfilename){
+    vector<kbin_triangle>* kbins = new vector<kbin_triangle>();
+    ifstream kbins_file(kbinsfilename);
+    if (!kbins_file){
+        printf("File does not exist: '%s'\n", kbinsfilename);
+        exit(1);
+    }
+    string line;
+    while (getline(kbins_file, line)){
+        if (line.length()==0 or line.at(0)=='#') continue;
+        kbin_triangle bin;
+        if (sscanf(line.c_str(), "%f %f %f %f %f %f",
+                   &bin.kmin[0], &bin.kmax[0], &bin.kmin[1], &bin.kmax[1],
+                   &bin.kmin[2], &bin.kmax[2]) != 6){
+            printf("  Failed to read k bin: '%s'\n", line.c_str());
+            exit(1);
+        }
+        kbins->push_back(bin);
+    }
+    return kbins;
+}
+
+// Wavenumber (in units of the fundamental mode) of grid index i
+static inline int wavenumber(int i, int Nres){
+    return (i < Nres/2) ? i : i - Nres;
+}
+
+// Keep only the modes of ftransform inside the shell [kmin, kmax)
+// (in fundamental units), inverse transform, and store the real part
+static void shell_filter(const fftwf_complex* ftransform, fftwf_complex* work, float* filtered,
+                         int Nres, double kmin, double kmax, fftwf_plan backward){
+    const long int Nres3 = long(Nres)*Nres*Nres;
+    #pragma omp parallel for
+    for (int x=0; x<Nres; x++){
+        const int kx = wavenumber(x, Nres);
+        for (int y=0; y<Nres; y++){
+            const int ky = wavenumber(y, Nres);
+            for (int z=0; z<Nres; z++){
+                const int kz = wavenumber(z, Nres);
+                const double k = sqrt(double(kx*kx + ky*ky + kz*kz));
+                const long int i = (long(x)*Nres + y)*Nres + z;
+                const bool in_shell = (k>=kmin and k<kmax);
+                work[i][0] = in_shell ? ftransform[i][0] : 0;
+                work[i][1] = in_shell ? ftransform[i][1] : 0;
+            }
+        }
+    }
+    fftwf_execute_dft(backward, work, work);
+    #pragma omp parallel for
+    for (long int i=0; i<Nres3; i++){
+        filtered[i] = work[i][0] / Nres3;
+    }
+}
+
+// Main bispectrum method
+void run_bispectrum(const float* box, vector<kbin_triangle> *kbins,
+                    int Nres, float L, const char *bispectrumfilename){
+
+    const long int Nres3 = long(Nres)*Nres*Nres;
+    const double kf = 2.0*M_PI / L;
+
+    // Distinct k shells over all triangle bins
+    vector< pair<float,float> > shells;
+    vector< vector<int> > shell_of_side(kbins->size(), vector<int>(3));
+    for (size_t bin_i=0; bin_i<kbins->size(); bin_i++){
+        for (int side=0; side<3; side++){
+            pair<float,float> range(kbins->at(bin_i).kmin[side], kbins->at(bin_i).kmax[side]);
+            size_t shell_i = std::find(shells.begin(), shells.end(), range) - shells.begin();
+            if (shell_i==shells.size()) shells.push_back(range);
+            shell_of_side.at(bin_i).at(side) = shell_i;
+        }
+    }
+    int n_shells = shells.size();
+    cout << "      " << kbins->size() << " triangle bins from " << n_shells << " k shells\n";
+
+    // Transform of the field, and all-ones in k space for the indicators
+    fftwf_complex* dhat = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex)*Nres3);
+    fftwf_complex* onehat = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex)*Nres3);
+    fftwf_complex* work = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex)*Nres3);
+    fftwf_plan_with_nthreads(global_nthreads);
+    fftwf_plan forward = fftwf_plan_dft_3d(Nres, Nres, Nres, work, work, FFTW_FORWARD, FFTW_ESTIMATE);
+    fftwf_plan backward = fftwf_plan_dft_3d(Nres, Nres, Nres, work, work, FFTW_BACKWARD, FFTW_ESTIMATE);
+    for (long int i=0; i<Nres3; i++){
+        dhat[i][0] = box[i];    dhat[i][1] = 0;
+        onehat[i][0] = 1.0;     onehat[i][1] = 0;
+    }
+    fftwf_execute_dft(forward, dhat, dhat);
+
+    // Filtered field and indicator for every shell, and mean |k|
+    vector<float*> d_shell(n_shells), I_shell(n_shells);
+    vector<double> k_mean(n_shells, 0.0);
+    for (int shell_i=0; shell_i<n_shells; shell_i++){
+        const double kmin = shells.at(shell_i).first / kf;
+        const double kmax = shells.at(shell_i).second / kf;
+        d_shell.at(shell_i) = new float[Nres3];
+        I_shell.at(shell_i) = new float[Nres3];
+        shell_filter(dhat, work, d_shell.at(shell_i), Nres, kmin, kmax, backward);
+        shell_filter(onehat, work, I_shell.at(shell_i), Nres, kmin, kmax, backward);
+
+        long int n_modes = 0;
+        for (int x=0; x<Nres; x++){
+            for (int y=0; y<Nres; y++){
+                for (int z=0; z<Nres; z++){
+                    const int kx = wavenumber(x, Nres), ky = wavenumber(y, Nres), kz = wavenumber(z, Nres);
+                    const double k = sqrt(double(kx*kx + ky*ky + kz*kz));
+                    if (k>=kmin and k<kmax){ k_mean.at(shell_i) += k; n_modes++; }
+                }
+            }
+        }
+        if (n_modes>0) k_mean.at(shell_i) *= kf / n_modes;
+    }
+
+    // Sum the products over the grid for every triangle bin
+    ofstream save_file_id(bispectrumfilename);
+    if (save_file_id){ 
+        save_file_id.fill(' ');
+        save_file_id << setw(22) << left << "# k1_avg";
+        save_file_id << '\t' << setw(23) << left << "k2_avg";
+        save_file_id << '\t' << setw(23) << left << "k3_avg";
+        save_file_id << '\t' << setw(23) << left << "B";
+        save_file_id << '\t' << setw(23) << left << "N_triangles";
+        save_file_id << "\n";
+        save_file_id.precision(16);
+        save_file_id.setf(ios_base::scientific);
+
+        for (size_t bin_i=0; bin_i<kbins->size(); bin_i++){
+            const float* d1 = d_shell.at(shell_of_side.at(bin_i).at(0));
+            const float* d2 = d_shell.at(shell_of_side.at(bin_i).at(1));
+            const float* d3 = d_shell.at(shell_of_side.at(bin_i).at(2));
+            const float* I1 = I_shell.at(shell_of_side.at(bin_i).at(0));
+            const float* I2 = I_shell.at(shell_of_side.at(bin_i).at(1));
+            const float* I3 = I_shell.at(shell_of_side.at(bin_i).at(2));
+
+            double sum_ddd = 0, sum_III = 0;
+            #pragma omp parallel for reduction(+:sum_ddd,sum_III)
+            for (long int i=0; i<Nres3; i++){
+                sum_ddd += double(d1[i])*d2[i]*d3[i];
+                sum_III += double(I1[i])*I2[i]*I3[i];
+            }
+
+            // Closed triangles = N^6 sum_x I1 I2 I3, and
+            // B = (V^2/N^9) <d(k1)d(k2)d(k3)> = (V^2/N^9) sum_ddd / sum_III
+            const double n_triangles = sum_III * double(Nres3) * double(Nres3);
+            const double V = double(L)*L*L;
+            const double B = (n_triangles>0.5) ? (V*V / (double(Nres3)*Nres3*Nres3)) * sum_ddd / sum_III : 0.0;
+
+            save_file_id << setw(23) << k_mean.at(shell_of_side.at(bin_i).at(0));
+            save_file_id << '\t' << setw(23) << k_mean.at(shell_of_side.at(bin_i).at(1));
+            save_file_id << '\t' << setw(23) << k_mean.at(shell_of_side.at(bin_i).at(2));
+            save_file_id << '\t' << setw(23) << B;
+            save_file_id << '\t' << setw(23) << n_triangles;
+            save_file_id << '\n';
+        }
+        save_file_id.close();
+    } else {
+       printf("Could not open save file '%s'\n",bispectrumfilename);                
+    }
+
+    for (int shell_i=0; shell_i<n_shells; shell_i++){
+        delete[] d_shell.at(shell_i);
+        delete[] I_shell.at(shell_i);
+    }
+    fftwf_destroy_plan(forward);
+    fftwf_destroy_plan(backward);
+    fftwf_free(dhat);
+    fftwf_free(onehat);
+    fftwf_free(work);
+}
@@ -0,0 +1,35 @@
+/*************************************************************
+  Interface for FFT bispectrum (shell-filtered FFT products)
+*************************************************************/
+
+#ifndef __BISPECTRUM_HPP__
+#define __BISPECTRUM_HPP__
+
+#include "corr3.hpp"
+
+#include <fftw3.h>
+
+// One triangle bin in Fourier space: a k range for each side
+// (same units as 2pi/L, i.e. h/Mpc for L in Mpc/h)
+struct kbin_triangle{
+	float kmin[3], kmax[3];
+};
+
+// Load triangle bins from a text file, one bin per line:
+//   k1min k1max k2min k2max k3min k3max
+vector<kbin_triangle>* load_kbin_triangles(const char *kbinsfilename);
+
+// Bispectrum B(k1,k2,k3) of box for every triangle bin
+//
+//  Each distinct k shell S is filtered once:
+//      d_S(x) = IFFT[ d(k) 1(|k| in S) ]
+//  and the same for a field of ones (I_S). Then
+//      B = (V^2/N^9) sum_x d_1 d_2 d_3 / sum_x I_1 I_2 I_3
+//  i.e. the mean of d(k1)d(k2)d(k3) over closed triangles in the bin
+//
+//  Saves k1, k2, k3 (mean |k| in each shell), B and the number of
+//  closed triangles to bispectrumfilename
+void run_bispectrum(const float* box, vector<kbin_triangle> *kbins,
+                    int Nres, float L, const char *bispectrumfilename);
+
+#endif
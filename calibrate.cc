@@ -0,0 +1,145 @@
+/*************************************************************
+  Startup calibration of the correlation speed
+*************************************************************/
+
+#include "calibrate.hpp"
+#include "globals.hpp"
+#include "gather.hpp"
+#include "sampling.hpp"
+#include "quantise.hpp"
+
+#include <unistd.h>
+
+// (ptB, ptC) pairs evaluated for each primary
+double triangles_per_primary(vector< triangle_configs > *selectionFunction){
+    double per_primary = 0;
+    for (int bin_i=0; bin_i<(int)selectionFunction->size(); bin_i++){
+        per_primary += selectionFunction->at(bin_i).size();
+    }
+    return per_primary;
+}
+
+// Seconds for run_correlation over up to n_primaries sampled primaries
+// from a quarter into the box (n_done of them found)
+static double time_window(const float* box, vector< triangle_configs > *selectionFunction,
+                int Nres, long int n_primaries, long int& n_done){
+    const long int Nres3 = long(Nres)*Nres*Nres;
+    const uint64_t threshold = sample_threshold(sample_fraction);
+    vector<long int> window;
+    for (long int i=Nres3/4; i<Nres3 and (long int)window.size()<n_primaries; i++){
+        if (accept_primary(sample_seed, i, threshold)) window.push_back(i);
+    }
+    n_done = window.size();
+
+    const double start = omp_get_wtime();
+    vector<statistics_with_jk> *results = run_correlation(box, box, box, selectionFunction, Nres, &window, true);
+    const double seconds = omp_get_wtime() - start;
+    delete results;
+    return seconds;
+}
+
+// Measured speed, 0 if there were no primaries to time
+double measure_speed(vector< triangle_configs > *selectionFunction, int Nres, double seconds){
+
+    const long int Nres3 = long(Nres)*Nres*Nres;
+    const double per_primary = triangles_per_primary(selectionFunction);
+
+    // Synthetic field: the values change the sums, not the work
+    float* box = new float[Nres3];
+    #pragma omp parallel for
+    for (long int i=0; i<Nres3; i++){
+        box[i] = 0.5f + float(splitmix64(1, i) >> 40) / float(1 << 24);
+    }
+
+    // Kernel output and progress lines are not wanted here
+    const double saved_interval = progress_interval;
+    progress_interval = 0.0;
+    cout.setstate(std::ios::failbit);
+
+    // Padding and maps cost the same for any number of primaries, so
+    // are timed once without primaries and taken off; the window grows
+    // until the kernel runs for about half the requested time
+    long int n_done = 0;
+    const double overhead = time_window(box, selectionFunction, Nres, 0, n_done);
+    long int n_primaries = 64L*global_nthreads;
+    double speed = 0.0;
+    for (int round=0; round<8; round++){
+        const double kernel_seconds = std::max(time_window(box, selectionFunction, Nres, n_primaries, n_done) - overhead, 1e-6);
+        speed = n_done * per_primary / kernel_seconds;
+        if (kernel_seconds>=0.5*seconds or n_done<n_primaries) break;
+        n_primaries = long(n_primaries * std::min(std::max(seconds/kernel_seconds, 2.0), 64.0));
+    }
+
+    cout.clear();
+    progress_interval = saved_interval;
+    delete[] box;
+    return speed;
+}
+
+// File of cached speeds, one "speed<TAB>key" per line (latest wins)
+static string cache_filename(){
+    const char* home = getenv("HOME");
+    return home ? string(home) + "/.corr3_speed" : "";
+}
+
+// CPU model from /proc/cpuinfo
+static string cpu_model(){
+    ifstream cpuinfo("/proc/cpuinfo");
+    string line;
+    while (std::getline(cpuinfo, line)){
+        if (line.compare(0, 10, "model name")==0 and line.find(':')!=string::npos){
+            return line.substr(line.find(':') + 2);
+        }
+    }
+    return "unknown";
+}
+
+// Everything the speed depends on: host, CPU, threads, kernel
+// settings and the work of the bins at this Nres
+static string speed_key(vector< triangle_configs > *selectionFunction, int Nres){
+    char host[256] = "unknown";
+    gethostname(host, sizeof(host)-1);
+    char key[1024];
+    snprintf(key, sizeof(key), "host=%s;cpu=%s;threads=%d;kernel=%d;simd=%s;storage=%s;precision=%d;"
+             "traversal=%d;jk=%ld/%d;sample=%.3g;N=%d;bins=%d;pairs=%.0f;halo=%d",
+             host, cpu_model().c_str(), global_nthreads, kernel_mode, simd_level_name(simd_level),
+             storage_name(storage_mode), precision_mode, traversal_mode, jackknife_N, jk_layout,
+             sample_fraction, Nres, (int)selectionFunction->size(),
+             triangles_per_primary(selectionFunction), max_offset(selectionFunction));
+    return key;
+}
+
+// Cached or measured speed
+double calibrated_speed(vector< triangle_configs > *selectionFunction, int Nres,
+                        int calibrate_mode, double seconds){
+
+    if (calibrate_mode==CALIBRATE_OFF) return 0.0;
+    const string key = speed_key(selectionFunction, Nres);
+    const string cachefilename = cache_filename();
+
+    double speed = 0.0;
+    if (calibrate_mode==CALIBRATE_AUTO and cachefilename.length()>0){
+        ifstream cache(cachefilename.c_str());
+        string line;
+        while (std::getline(cache, line)){
+            const size_t tab = line.find('\t');
+            if (tab!=string::npos and line.substr(tab + 1)==key){
+                speed = atof(line.substr(0, tab).c_str());
+            }
+        }
+        if (speed>0){
+            printf("  Speed %.3g triangles/s (cached in %s)\n", speed, cachefilename.c_str());
+            return speed;
+        }
+    }
+
+    printf("  Calibrating speed... ");
+    fflush(stdout);
+    speed = measure_speed(selectionFunction, Nres, seconds);
+    printf("%.3g triangles/s at %s\n", speed, currentTimeTaken().c_str());
+    if (speed>0 and cachefilename.length()>0){
+        ofstream cache(cachefilename.c_str(), std::ios::app);
+        cache << speed << '\t' << key << '\n';
+    }
+    return speed;
+}
@@ -0,0 +1,30 @@
+/*************************************************************
+  Startup calibration of the correlation speed
+  Times the real kernel (with the loaded bins and the current
+  settings and threads) on a window of primaries of a synthetic
+  box, cached per host, CPU model and settings
+*************************************************************/
+
+#ifndef __CALIBRATE_HPP__
+#define __CALIBRATE_HPP__
+
+#include "corr3.hpp"
+
+// When to calibrate
+//   CALIBRATE_AUTO:  use the cached speed, else measure and cache it
+//   CALIBRATE_FORCE: measure again and update the cache
+//   CALIBRATE_OFF:   fixed guess from the thread count (runSpeed)
+enum calibrate_modes { CALIBRATE_AUTO, CALIBRATE_FORCE, CALIBRATE_OFF };
+
+// Triangles ((ptB, ptC) pairs) per second of the direct kernel at
+// Nres, from the cache or measured over about seconds of kernel time
+double calibrated_speed(vector< triangle_configs > *selectionFunction, int Nres,
+                        int calibrate_mode, double seconds = 2.0);
+
+// (ptB, ptC) pairs evaluated for each primary, over all bins
+double triangles_per_primary(vector< triangle_configs > *selectionFunction);
+
+// Measure the speed, without the cache
+double measure_speed(vector< triangle_configs > *selectionFunction, int Nres, double seconds);
+
+#endif
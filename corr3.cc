@@ -4,7 +4,15 @@
 
 #include "corr3.hpp"                
 #include "globals.hpp"
+#include "gather.hpp"
+#include "sampling.hpp"
+#include "jackknife.hpp"
+#include "quantise.hpp"
+#include "progress.hpp"
+#include "numa.hpp"
 #include <iomanip>
+#include <unistd.h>
+#include <new>
 
 // Periodic condition for integer
 int wrap_int(int value, int Nres){
@@ -17,25 +25,12 @@ int wrap_int(int value, int Nres){
     }
 }
 
-// Structure for corr3 statistics
-// DDD, DDR, DRR, RRR
-struct statistics{ 
-    double DDD, DDR, DRR, RRR; 
-
-    statistics() : DDD(0.0), DDR(0.0), DRR(0.0), RRR(0.0) {};
-
-    statistics(double _DDD, double _DDR, double _DRR, double _RRR) : 
-                DDD(_DDD), DDR(_DDR), DRR(_DRR), RRR(_RRR) { };
-
-};
-
-// corr3 statistics with jackknifed values
-struct statistics_with_jk{
-    statistics stats;
-    vector<statistics> stats_JK;
-    statistics_with_jk() : stats_JK(jackknife_N) {}
-};
-
+// Periodic condition, by masking if Nres is a power of two
+// (offsets never exceed one box length)
+template <bool POW2>
+static inline int wrap_coord(int value, int Nres){
+    return POW2 ? (value & (Nres-1)) : wrap_int(value, Nres);
+}
 
 // statistics struct addition assignment operator
 statistics& operator+=(statistics& sa, statistics& sb){ 
@@ -79,236 +74,1765 @@ double estimatorLS(statistics& s) {
     return ((s.DDD-(3*s.DDR)+(3*s.DRR))/s.RRR) - 1.0; 
 }
 
-// Main correlation method
-vector<statistics_with_jk>* 
-run_correlation(const float* box1, const float* box2, const float* box3, 
-                vector< triangle_configs > *selectionFunction, 
-                int Nres){
+// All the stats_JK are subtracted from the total stats values
+// (each thread summed only the contributions inside each region)
+void jackknife_complement(vector<statistics_with_jk> *results){
+    for (int bin_i=0; bin_i<(int)results->size(); bin_i++ ){
+        for (int jk_index=0; jk_index<jackknife_N; jk_index++){
+            results->at(bin_i).stats_JK.at(jk_index) = results->at(bin_i).stats - results->at(bin_i).stats_JK.at(jk_index);
+        }
+    } // endfor over bins, for storing jackknifed results
+}
 
-    // How many bins are there?
-    int n_bins = selectionFunction->size();
+// Without jackknife the kernels skip the region sums; the single
+// region holds everything (so its complement is empty, as before)
+static void single_region(vector<statistics_with_jk> *results){
+    for (int bin_i=0; bin_i<(int)results->size(); bin_i++ ){
+        results->at(bin_i).stats_JK.at(0) = results->at(bin_i).stats;
+    }
+}
 
-    // Powers of Nres
-    int Nres2 = Nres*Nres;
-    int Nres3 = Nres*Nres*Nres;
+// Per-thread accumulators: one contiguous, cache-line aligned block
+// of n_rows*n_bins, the n_bins totals first, then (dense jackknife)
+// jackknife_N*n_bins in [jk][bin] order
+// (rounded up to whole cache lines so threads never share a line)
+static statistics* new_accumulators(int n_bins, long int n_rows){
+    const size_t n = size_t(n_bins) * n_rows;
+    const size_t bytes = ((n*sizeof(statistics) + 63) / 64) * 64;
+    void* block = NULL;
+    if (posix_memalign(&block, 64, bytes)!=0){
+        printf("  ERROR: could not allocate %ld bytes of accumulators\n", (long int)bytes);
+        exit(1);
+    }
+    statistics* accumulators = (statistics*)block;
+    for (size_t j=0; j<n; j++) new (accumulators + j) statistics();
+    return accumulators;
+}
 
-    // Seed random number from time
-    srand (time(NULL));
-    // cout << " Test random number is " << (rand()%Nres3) << '\n';
+// Sparse jackknife: rows held by a thread before they are flushed
+static const size_t jk_row_budget = 64;
+
+// Jackknife accumulators of one thread, a row of n_bins per region
+//   dense:  every region, in the thread's block after the totals
+//   sparse: a row only for the regions this thread has touched,
+//           added into the results once more than jk_row_budget
+//           are held, so memory doesn't grow with threads x regions
+struct jk_accumulators{
+    int n_bins;
+    statistics* dense;
+    vector<statistics*> rows;       // row of each region, or NULL
+    vector<int> touched;            // regions with a row
+    vector<statistics*> spare;      // flushed rows, zeroed for reuse
+    vector<statistics_with_jk> *results;
+
+    jk_accumulators(int _n_bins, statistics* _dense, vector<statistics_with_jk> *_results) :
+        n_bins(_n_bins), dense(_dense), rows(_dense ? 0 : jackknife_N, (statistics*)NULL), results(_results) {};
+
+    // Row of region jk_index (allocated on first touch if sparse)
+    inline statistics* row(int jk_index){
+        if (dense) return dense + size_t(jk_index)*n_bins;
+        statistics* this_row = rows[jk_index];
+        return this_row ? this_row : new_row(jk_index);
+    }
 
-    // Subsampling integer 
-    int sample_fraction_int = int(sample_fraction * Nres3);
+    statistics* new_row(int jk_index){
+        statistics* this_row;
+        if (spare.empty()){
+            this_row = new_accumulators(n_bins, 1);
+        } else {
+            this_row = spare.back();
+            spare.pop_back();
+        }
+        rows[jk_index] = this_row;
+        touched.push_back(jk_index);
+        return this_row;
+    }
 
-    // Make the results, vector of the statistics for each radial bin
-    vector<statistics_with_jk> *results = new vector<statistics_with_jk>(n_bins);   
+    // Add the held rows into the results, keeping them for reuse
+    void flush(){
+        #pragma omp critical (jk_flush)
+        {
+            for (size_t touched_i=0; touched_i<touched.size(); touched_i++){
+                const int jk_index = touched[touched_i];
+                for (int bin_i=0; bin_i<n_bins; bin_i++ ){
+                    results->at(bin_i).stats_JK.at(jk_index) += rows[jk_index][bin_i];
+                }
+            }
+        } // end omp critical
+        for (size_t touched_i=0; touched_i<touched.size(); touched_i++){
+            statistics* this_row = rows[touched[touched_i]];
+            std::fill(this_row, this_row + n_bins, statistics());
+            spare.push_back(this_row);
+            rows[touched[touched_i]] = NULL;
+        }
+        touched.clear();
+    }
 
-    // Get spread of data -- if no spread, return zeros results
-    long double min = *std::min_element(box1,box1+Nres3);
-    long double max = *std::max_element(box1,box1+Nres3);
-    long double range = max - min;
-    cout << "      Data min is " << min << "\n";
-    cout << "      Data max is " << max << "\n";
-    cout << "      Data range is " << range << "\n";
-    if (range==0.0){
-        cout << "      Zero spread in data, returning zeros results\n";
-        return results;
+    // Called between primaries, so no row is in use
+    inline void flush_if_full(){
+        if (!dense and touched.size()>jk_row_budget) flush();
     }
 
-    // Make sure we have defined the number of threads
-    omp_set_num_threads(global_nthreads);    
+    // Last flush, and free the rows
+    void finish(){
+        if (dense) return;
+        flush();
+        for (size_t spare_i=0; spare_i<spare.size(); spare_i++) free(spare[spare_i]);
+        spare.clear();
+    }
+};
 
-    // Split the data vector into jackknife_N parts
-    // Traces z first, then y, then x, 
-    // So not split into regular pieces
-    // (e.g. jackknife_N=8 does NOT split into octants)
-    signed long int jk_length = (Nres*Nres*Nres) / jackknife_N;
+// Bytes of the dense jackknife rows of every thread
+static double dense_jackknife_bytes(int n_bins){
+    return double(n_bins) * jackknife_N * sizeof(statistics) * omp_get_max_threads();
+}
 
-    // Start threading section
-    // printf("\n    Starting at %s..",currentTimeTaken().c_str());
-    // printf("\n    with %d threads..",global_nthreads);
+// Whether sparse jackknife rows are held, rather than every region
+// in every thread (jk_accumulation, or by memory if JK_AUTO)
+static bool sparse_jackknife(int n_bins){
+    if (jackknife_N==1 or jk_accumulation==JK_DENSE) return false;
+    return jk_accumulation==JK_SPARSE or dense_jackknife_bytes(n_bins) > 256.0*1024*1024;
+}
 
-    #pragma omp parallel
+static bool use_sparse_jackknife(int n_bins){
+    if (!sparse_jackknife(n_bins)) return false;
+    cout << "      Sparse jackknife accumulators (dense would be " << dense_jackknife_bytes(n_bins)/(1024*1024) << " MB)\n";
+    return true;
+}
+
+// Every thread's block (totals, then the dense rows or at most
+// jk_row_budget+1 sparse rows and their table), and the results
+double accumulator_bytes(int n_bins){
+    const double row = double(n_bins) * sizeof(statistics);
+    const int n_threads = omp_get_max_threads();
+    const double results = row * (1 + jackknife_N);
+    if (jackknife_N==1) return n_threads*row + results;
+    if (sparse_jackknife(n_bins)){
+        return n_threads*(row*(jk_row_budget + 2) + jackknife_N*sizeof(statistics*)) + results;
+    }
+    return n_threads*row + dense_jackknife_bytes(n_bins) + results;
+}
+
+// Pairwise (tree) reduction of every thread's block into block 0
+// log2(threads) rounds, each pair summed by its own thread
+// Must be called by all threads of the parallel region
+static void reduce_accumulators(vector<statistics*>& blocks, int n_bins, long int n_rows){
+    const size_t n = size_t(n_bins) * n_rows;
+    const int thread_i = omp_get_thread_num();
+    const int n_threads = omp_get_num_threads();
+    for (int stride=1; stride<n_threads; stride*=2){
+        #pragma omp barrier
+        if (thread_i % (2*stride)==0 and thread_i+stride<n_threads){
+            statistics* into = blocks[thread_i];
+            statistics* from = blocks[thread_i+stride];
+            for (size_t j=0; j<n; j++) into[j] += from[j];
+        }
+    }
+    #pragma omp barrier
+}
+
+// Copy the reduced block into the results, then free every block
+// (only the totals for sparse jackknife, whose rows were flushed)
+// Must be called by all threads of the parallel region
+static void store_accumulators(vector<statistics*>& blocks, int n_bins, long int n_rows,
+                               vector<statistics_with_jk> *results){
+    #pragma omp single
     {
+        const statistics* totals = blocks[0];
+        const statistics* totals_jk = blocks[0] + n_bins;
+        for (int bin_i=0; bin_i<n_bins; bin_i++ ){
+            results->at(bin_i).stats = totals[bin_i];
+            if (n_rows==1) continue;
+            for (int jk_i=0; jk_i<jackknife_N; jk_i++){
+                results->at(bin_i).stats_JK.at(jk_i) = totals_jk[jk_i*n_bins + bin_i];
+            }
+        }
+    } // end omp single (implicit barrier)
+    free(blocks[omp_get_thread_num()]);
+}
 
-        // Each thread gets its own private statistics and statistics_JK array
-        // JK vector goes in .at(JK_index).at(bin_i) order, so that jk index can be got outside of the bins
-        vector< statistics > results_pvt(n_bins);
-        vector< vector< statistics > >  results_jk_pvt(jackknife_N, vector<statistics>(n_bins));
+// Neumaier-compensated sum += value, the lost low-order part of each
+// addition kept in compensation (added back once at the end)
+static inline void compensated_add(double& sum, double& compensation, double value){
+    const double t = sum + value;
+    if (fabs(sum) >= fabs(value)){
+        compensation += (sum - t) + value;
+    } else {
+        compensation += (value - t) + sum;
+    }
+    sum = t;
+}
+
+// Add one primary's sums for a bin into a thread's totals, compensated
+// if given a compensation (mixed precision), otherwise plain doubles
+static inline void add_to_totals(statistics& totals, statistics* compensation,
+                double DDD, double DDR, double DRR, double RRR){
+    if (!compensation){
+        totals.DDD += DDD;
+        totals.DDR += DDR;
+        totals.DRR += DRR;
+        totals.RRR += RRR;
+        return;
+    }
+    compensated_add(totals.DDD, compensation->DDD, DDD);
+    compensated_add(totals.DDR, compensation->DDR, DDR);
+    compensated_add(totals.DRR, compensation->DRR, DRR);
+    compensated_add(totals.RRR, compensation->RRR, RRR);
+}
+
+// Copy box into a periodically padded box of (Nres+2*halo)^3
+// Cell (x,y,z) of box sits at (x+halo, y+halo, z+halo)
+// width: fields interleaved in box (width floats per cell, kept together)
+float* halo_pad(const float* box, int Nres, int halo, int width){
+    const int Npad = Nres + 2*halo;
+    const long int Npad2 = long(Npad)*Npad;
+    float* padded = new float[Npad2*Npad*width];
+
+    // Parallel so each thread first-touches the slabs it fills
+    #pragma omp parallel for
+    for (int xp=0; xp<Npad; xp++){
+        const long int x = wrap_int(xp - halo, Nres);
+        for (int yp=0; yp<Npad; yp++){
+            const long int y = wrap_int(yp - halo, Nres);
+            const float* row = box + (x*Nres + y)*Nres*width;
+            float* padded_row = padded + (xp*Npad2 + long(yp)*Npad)*width;
+            for (int zp=0; zp<Npad; zp++){
+                const float* cell = row + long(wrap_int(zp - halo, Nres))*width;
+                for (int b=0; b<width; b++){
+                    padded_row[long(zp)*width + b] = cell[b];
+                }
+            }
+        }
+    }
+    return padded;
+}
+
+// Pad a slab of planes in y and z only: the slab already holds its
+// halo planes in x, so plane j of the slab is plane j of the result
+float* slab_pad(const float* slab, int Nres, int halo, int n_planes){
+    const int Npad = Nres + 2*halo;
+    const long int Npad2 = long(Npad)*Npad;
+    float* padded = new float[Npad2*n_planes];
+
+    #pragma omp parallel for
+    for (int xp=0; xp<n_planes; xp++){
+        for (int yp=0; yp<Npad; yp++){
+            const long int y = wrap_int(yp - halo, Nres);
+            const float* row = slab + (long(xp)*Nres + y)*Nres;
+            float* padded_row = padded + xp*Npad2 + long(yp)*Npad;
+            for (int zp=0; zp<Npad; zp++){
+                padded_row[zp] = row[wrap_int(zp - halo, Nres)];
+            }
+        }
+    }
+    return padded;
+}
+
+// Interleave K boxes of Nres^3, voxel-major (field b of voxel i at i*K + b)
+float* interleave_boxes(const vector<float*>& boxes, int Nres){
+    const long int Nres3 = long(Nres)*Nres*Nres;
+    const int K = boxes.size();
+    float* interleaved = new float[Nres3*K];
+    #pragma omp parallel for
+    for (long int i=0; i<Nres3; i++){
+        for (int b=0; b<K; b++){
+            interleaved[i*K + b] = boxes[b][i];
+        }
+    }
+    return interleaved;
+}
+
+// Everything the halo kernel needs to correlate one primary point
+struct halo_kernel{
+    int n_bins;
+    int Nres;
+    long int Nres2;
+    int log2_Nres;          // if Nres is a power of two
+    int halo, Npad;
+    long int Npad2;
+    int x0;                 // first plane of the padded box (slab of a rank)
+    const float *box1;
+    const float *pad1, *pad2, *pad3;
+    const void *stored1, *stored2, *stored3;    // pads as read: floats or codes
+    quantisation quant1, quant2, quant3;
+    const jk_region* jk_pad;
+    const jk_regions* regions;
+    int batch;              // fields interleaved in pad1 (batch kernel)
+    bool compensated;       // mixed precision: compensated totals
+    gatherSumType gather_sum;
+    gatherInt16Type gather_int16;
+    gatherInt8Type gather_int8;
+    gatherBatchType gather_batch;
+    progress_reporter* progress;
+    vector< triangle_configs > *selectionFunction;
+    vector< shared_ptB > *shared;
+};
+
+// Compile-time variants of the halo kernel, so that a run pays for
+// no branches it never takes (picked at runtime by halo_variant)
+//   JK:       jackknife bookkeeping (jackknife_N>1)
+//   SAMPLED:  reject-sample every voxel (sample_fraction<1, no list)
+//   POW2:     Nres is a power of two, primary located by shift/mask
+//   N_FIELDS: 1 for an auto-correlation (every vertex from pad1), else 3
+//   STORE:    float, or int16_t / int8_t codes (storage_mode)
+
+// Location (x,y,z) and padded index of primary i
+template <bool POW2>
+static inline long int padded_primary(const halo_kernel& k, signed long int i,
+                long int& x, long int& y, long int& z){
+    if (POW2){
+        x = i >> (2*k.log2_Nres);
+        y = (i >> k.log2_Nres) & (k.Nres-1);
+        z = i & (k.Nres-1);
+    } else {
+        x = (i/k.Nres2);
+        y = ( (i % k.Nres2) / k.Nres);
+        z = (i % k.Nres);
+    }
+    return (x-k.x0+k.halo)*k.Npad2 + (y+k.halo)*k.Npad + (z+k.halo);
+}
+
+// Value of a stored field at padded index i
+static inline float field_value(const float* pad, long int i, const quantisation&){
+    return pad[i];
+}
+
+template <typename Q>
+static inline float field_value(const Q* pad, long int i, const quantisation& quant){
+    return quant.offset + quant.scale * pad[i];
+}
+
+// Integer sum of the codes at the ptsC
+static inline long int gather_codes(const halo_kernel& k, const int16_t* base, const int* offs, int n){
+    return k.gather_int16(base, offs, n);
+}
+
+static inline long int gather_codes(const halo_kernel& k, const int8_t* base, const int* offs, int n){
+    return k.gather_int8(base, offs, n);
+}
+
+// DDD and (for swapped triangles) the sum of data3 over the ptsC as a
+// gather-sum, from floats or from codes dequantised once per set
+static inline void ptC_gather(const halo_kernel& k, const float* base, const int* offsC, int n_ptsC,
+                const quantisation&, double mult12, int mult_BC, int mult_CB,
+                double& DDD_fromPixel2, double& sum_data3){
+    if (mult_CB==0){
+        DDD_fromPixel2 = mult_BC * k.gather_sum(base, offsC, n_ptsC, mult12);
+    } else {
+        sum_data3 = k.gather_sum(base, offsC, n_ptsC, 1.0);
+        DDD_fromPixel2 = (mult_BC + mult_CB) * mult12 * sum_data3;
+    }
+}
+
+template <typename Q>
+static inline void ptC_gather(const halo_kernel& k, const Q* base, const int* offsC, int n_ptsC,
+                const quantisation& quant, double mult12, int mult_BC, int mult_CB,
+                double& DDD_fromPixel2, double& sum_data3){
+    sum_data3 = n_ptsC * double(quant.offset) + quant.scale * double(gather_codes(k, base, offsC, n_ptsC));
+    DDD_fromPixel2 = (mult_BC + mult_CB) * mult12 * sum_data3;
+}
+
+// Sums over the ptsC of one set, from the primary at padded index p:
+// DDD, DDR and the number of triangles, each (ptB, ptC) weighted by
+// mult_BC as stored plus mult_CB swapped (whose DDR is data1*data3)
+// With jackknife regions (jk_pad), each triangle whose ptC lies in a
+// third region is also added to that region
+template <typename STORE>
+static inline void ptC_sums(const halo_kernel& k, const triangle_set& this_set, long int p,
+                const STORE* pad3, const quantisation& quant3, const jk_region* jk_pad,
+                float data1, double mult12, int jk_index1, int jk_index2, int bin_i,
+                jk_accumulators& jk, double& DDD_fromPixel2, double& DDR_fromPixel2,
+                int& radial_bin_single_matchsUsedByPixels12){
+
+    const int* offsC = this_set.offsC.data();
+    const int n_ptsC = (int)this_set.offsC.size();
+    const int mult_BC = this_set.mult_BC, mult_CB = this_set.mult_CB;
+    const int mult = mult_BC + mult_CB;
+
+    // Sum of data3, for the DDR of swapped triangles
+    double sum_data3 = 0;
+
+    // Without jackknife regions the ptC loop is a plain gather-sum
+    if (!jk_pad){
+        ptC_gather(k, pad3 + p, offsC, n_ptsC, quant3, mult12, mult_BC, mult_CB,
+                   DDD_fromPixel2, sum_data3);
+        radial_bin_single_matchsUsedByPixels12 = mult * n_ptsC;
+    } else {
+
+        for (int ptC_it=0; ptC_it<n_ptsC; ptC_it++){ 
+
+            // Third point straight from the padded box
+            const long int i3 = p + offsC[ptC_it];
+            const float data3 = field_value(pad3, i3, quant3);
+
+            double mult123 = mult12*data3;
+            DDD_fromPixel2 += mult * mult123;
+            sum_data3 += data3;
+            radial_bin_single_matchsUsedByPixels12 += mult;
+
+            const int jk_index3 = jk_pad[i3];
+            if (jk_index3!=jk_index2 and jk_index3!=jk_index1){
+                statistics& statistics_for_bin_JK3 = jk.row(jk_index3)[bin_i];
+                statistics_for_bin_JK3.DDD += mult * mult123;
+                statistics_for_bin_JK3.DDR += mult_BC * mult12 + mult_CB * double(data1*data3);
+                statistics_for_bin_JK3.DRR += mult * data1;
+                statistics_for_bin_JK3.RRR += mult;
+            }
+
+        } // endfor ptC_it (secondary point)
+    }
+
+    DDR_fromPixel2 = (mult_BC * n_ptsC) * mult12 + mult_CB * data1 * sum_data3;
+}
+
+// Halo kernel: identical sums to the wrap kernel in run_correlation,
+// but every vertex is read as padded[p + offset] with p the padded
+// index of the primary, so there is no wrapping or index arithmetic
+// inside the triangle loops
+template <bool JK, bool POW2, int N_FIELDS, typename STORE>
+static void correlate_primary(const halo_kernel& k, signed long int i,
+                statistics* results_pvt, jk_accumulators& jk, statistics* compensation){
+
+    const int n_bins = k.n_bins;
+    const STORE* pad1 = (const STORE*)k.stored1;
+    const STORE* pad2 = (N_FIELDS==1) ? pad1 : (const STORE*)k.stored2;
+    const STORE* pad3 = (N_FIELDS==1) ? pad1 : (const STORE*)k.stored3;
+    const quantisation& quant2 = (N_FIELDS==1) ? k.quant1 : k.quant2;
+    const quantisation& quant3 = (N_FIELDS==1) ? k.quant1 : k.quant3;
+    const jk_region* jk_pad = JK ? k.jk_pad : NULL;
+    if (JK) jk.flush_if_full();
+
+    // Padded index of the primary point
+    long int x, y, z;
+    const long int p = padded_primary<POW2>(k, i, x, y, z);
+    const float data1 = field_value(pad1, p, k.quant1);
+
+    // Jackknife region from the map; an interior primary has every
+    // vertex in its own region, so it takes the no-jackknife path
+    const int jk_index1 = JK ? jk_pad[p] : 0;
+    if (JK and k.regions->is_interior(x, y, z)) jk_pad = NULL;
+    statistics* statistics_for_bins_jk = JK ? jk.row(jk_index1) : NULL;
+
+    for (int bin_i = 0; bin_i < k.n_bins; bin_i++){
+
+        statistics& statistics_for_bin       = results_pvt[bin_i];
+
+        int radial_bin_single_matchsUsedByPixel1 = 0;
+        double DDD_fromPixel1 = 0, DDR_fromPixel1 = 0; 
+
+        triangle_configs &triangles_in_bin = k.selectionFunction->at(bin_i);
+
+        for (int ptB_i=0; ptB_i<(int)triangles_in_bin.sets.size(); ptB_i++){
+
+            const triangle_set& this_set = triangles_in_bin.sets[ptB_i];
+
+            // Second point straight from the padded box
+            const long int i2 = p + this_set.offB;
+            const float data2 = field_value(pad2, i2, quant2);
+            const int jk_index2 = jk_pad ? jk_pad[i2] : jk_index1;
+
+            const double mult12 = data1 * data2;
+
+            int radial_bin_single_matchsUsedByPixels12 = 0;
+            double DDD_fromPixel2 = 0, DDR_fromPixel2 = 0;
+            ptC_sums(k, this_set, p, pad3, quant3, jk_pad, data1, mult12, jk_index1, jk_index2, bin_i, jk,
+                     DDD_fromPixel2, DDR_fromPixel2, radial_bin_single_matchsUsedByPixels12);
+
+            DDD_fromPixel1 += DDD_fromPixel2;
+            DDR_fromPixel1 += DDR_fromPixel2;
+
+            if ( jk_index2 != jk_index1 ){
+                statistics& statistics_for_bin_JK2 = jk.row(jk_index2)[bin_i];
+                statistics_for_bin_JK2.DDD += DDD_fromPixel2;
+                statistics_for_bin_JK2.DDR += DDR_fromPixel2;
+                statistics_for_bin_JK2.DRR += radial_bin_single_matchsUsedByPixels12 * data1;
+                statistics_for_bin_JK2.RRR += radial_bin_single_matchsUsedByPixels12 * 1.0;
+            }
+
+            radial_bin_single_matchsUsedByPixel1 += radial_bin_single_matchsUsedByPixels12;
+
+        } // endfor second point
+
+        double DRR_inPixel1 = radial_bin_single_matchsUsedByPixel1 * data1;
+        double RRR_inPixel1 = radial_bin_single_matchsUsedByPixel1 * 1.0;
+
+        add_to_totals(statistics_for_bin, compensation ? compensation + bin_i : NULL,
+                      DDD_fromPixel1, DDR_fromPixel1, DRR_inPixel1, RRR_inPixel1);
+
+        if (JK){
+            statistics& statistics_for_bin_JK1   = statistics_for_bins_jk[bin_i];
+            statistics_for_bin_JK1.DDD += DDD_fromPixel1;
+            statistics_for_bin_JK1.DRR += DRR_inPixel1;
+            statistics_for_bin_JK1.DDR += DDR_fromPixel1;
+            statistics_for_bin_JK1.RRR += RRR_inPixel1;
+        }
+        
+    } // endfor bin_i
+}
+
+// Shared-ptB kernel: same sums as correlate_primary, but loops over the
+// table of distinct ptB offsets, so data2 and mult12 are computed once
+// per primary and then fanned out to the ptsC of every bin using them
+// Per-bin partial sums for the primary are kept in the scratch vectors
+template <bool JK, bool POW2, int N_FIELDS, typename STORE>
+static void correlate_primary_shared(const halo_kernel& k, signed long int i,
+                statistics* results_pvt, jk_accumulators& jk, statistics* compensation,
+                vector<double>& DDD_fromPixel1, vector<double>& DDR_fromPixel1,
+                vector<int>& matchsUsedByPixel1){
+
+    const int n_bins = k.n_bins;
+    const STORE* pad1 = (const STORE*)k.stored1;
+    const STORE* pad2 = (N_FIELDS==1) ? pad1 : (const STORE*)k.stored2;
+    const STORE* pad3 = (N_FIELDS==1) ? pad1 : (const STORE*)k.stored3;
+    const quantisation& quant2 = (N_FIELDS==1) ? k.quant1 : k.quant2;
+    const quantisation& quant3 = (N_FIELDS==1) ? k.quant1 : k.quant3;
+    const jk_region* jk_pad = JK ? k.jk_pad : NULL;
+    if (JK) jk.flush_if_full();
+
+    // Padded index of the primary point
+    long int x, y, z;
+    const long int p = padded_primary<POW2>(k, i, x, y, z);
+    const float data1 = field_value(pad1, p, k.quant1);
+
+    // Jackknife region from the map; an interior primary has every
+    // vertex in its own region, so it takes the no-jackknife path
+    const int jk_index1 = JK ? jk_pad[p] : 0;
+    if (JK and k.regions->is_interior(x, y, z)) jk_pad = NULL;
+    statistics* statistics_for_bins_jk = JK ? jk.row(jk_index1) : NULL;
+
+    std::fill(DDD_fromPixel1.begin(), DDD_fromPixel1.end(), 0.0);
+    std::fill(DDR_fromPixel1.begin(), DDR_fromPixel1.end(), 0.0);
+    std::fill(matchsUsedByPixel1.begin(), matchsUsedByPixel1.end(), 0);
+
+    const vector<shared_ptB>& shared = *k.shared;
+    for (size_t ptB_i=0; ptB_i<shared.size(); ptB_i++){
+
+        // Second point and pair product, once for all bins
+        const long int i2 = p + shared[ptB_i].offB;
+        const float data2 = field_value(pad2, i2, quant2);
+        const int jk_index2 = jk_pad ? jk_pad[i2] : jk_index1;
+        const double mult12 = data1 * data2;
+
+        const vector< std::pair<int,int> >& uses = shared[ptB_i].uses;
+        for (size_t use_i=0; use_i<uses.size(); use_i++){
+            const int bin_i = uses[use_i].first;
+            const triangle_set& this_set = k.selectionFunction->at(bin_i).sets[uses[use_i].second];
+
+            int radial_bin_single_matchsUsedByPixels12 = 0;
+            double DDD_fromPixel2 = 0, DDR_fromPixel2 = 0;
+            ptC_sums(k, this_set, p, pad3, quant3, jk_pad, data1, mult12, jk_index1, jk_index2, bin_i, jk,
+                     DDD_fromPixel2, DDR_fromPixel2, radial_bin_single_matchsUsedByPixels12);
+
+            DDD_fromPixel1[bin_i] += DDD_fromPixel2;
+            DDR_fromPixel1[bin_i] += DDR_fromPixel2;
+
+            if ( jk_index2 != jk_index1 ){
+                statistics& statistics_for_bin_JK2 = jk.row(jk_index2)[bin_i];
+                statistics_for_bin_JK2.DDD += DDD_fromPixel2;
+                statistics_for_bin_JK2.DDR += DDR_fromPixel2;
+                statistics_for_bin_JK2.DRR += radial_bin_single_matchsUsedByPixels12 * data1;
+                statistics_for_bin_JK2.RRR += radial_bin_single_matchsUsedByPixels12 * 1.0;
+            }
+
+            matchsUsedByPixel1[bin_i] += radial_bin_single_matchsUsedByPixels12;
+
+        } // endfor uses of this ptB
+    } // endfor distinct ptB
+
+    // Final sums for each bin, as in correlate_primary
+    for (int bin_i = 0; bin_i < k.n_bins; bin_i++){
+        double DRR_inPixel1 = matchsUsedByPixel1[bin_i] * data1;
+        double RRR_inPixel1 = matchsUsedByPixel1[bin_i] * 1.0;
+
+        add_to_totals(results_pvt[bin_i], compensation ? compensation + bin_i : NULL,
+                      DDD_fromPixel1[bin_i], DDR_fromPixel1[bin_i], DRR_inPixel1, RRR_inPixel1);
+
+        if (JK){
+            statistics& statistics_for_bin_JK1   = statistics_for_bins_jk[bin_i];
+            statistics_for_bin_JK1.DDD += DDD_fromPixel1[bin_i];
+            statistics_for_bin_JK1.DRR += DRR_inPixel1;
+            statistics_for_bin_JK1.DDR += DDR_fromPixel1[bin_i];
+            statistics_for_bin_JK1.RRR += RRR_inPixel1;
+        }
+    }
+}
+
+// Per-thread scratch of the halo kernel: per-bin partial sums of one
+// primary (shared-ptB kernel), the compensation of the totals (mixed
+// precision, else empty) and the thread's progress counter (or NULL)
+struct primary_scratch{
+    vector<double> DDD_fromPixel1, DDR_fromPixel1;
+    vector<int> matchsUsedByPixel1;
+    vector<statistics> compensation;
+    progress_slot* progress;
+    primary_scratch(int n_bins, bool compensated) : 
+        DDD_fromPixel1(n_bins), DDR_fromPixel1(n_bins), matchsUsedByPixel1(n_bins),
+        compensation(compensated ? n_bins : 0), progress(NULL) {};
+};
+
+// Correlate primary i with the plain or shared-ptB kernel
+template <bool JK, bool POW2, int N_FIELDS, typename STORE>
+static inline void correlate_one(const halo_kernel& k, signed long int i,
+                statistics* results_pvt, jk_accumulators& jk, primary_scratch& scratch){
+    statistics* compensation = scratch.compensation.empty() ? NULL : scratch.compensation.data();
+    if (scratch.progress) scratch.progress->add();
+    if (k.shared){
+        correlate_primary_shared<JK,POW2,N_FIELDS,STORE>(k, i, results_pvt, jk, compensation,
+            scratch.DDD_fromPixel1, scratch.DDR_fromPixel1, scratch.matchsUsedByPixel1);
+    } else {
+        correlate_primary<JK,POW2,N_FIELDS,STORE>(k, i, results_pvt, jk, compensation);
+    }
+}
+
+// Primaries handed to the kernels: entries [list_first, list_last) of a
+// sorted list, or every voxel of [first, last) (reject-sampled), either
+// flat or tile by tile
+struct halo_traversal{
+    const vector<long int> *primaries;
+    long int list_first, list_last;
+    long int first, last;
+    bool tiled;
+    uint64_t threshold;
+    int tile;
+    long int n_tiles_1d, n_tiles;
+    vector<long int> tile_primaries, tile_start;
+};
+
+// Flat traversal of the primaries in voxels [first, last): the part of
+// the list there, or every voxel of the range
+static halo_traversal make_traversal(const vector<long int> *primaries, long int first, long int last){
+    halo_traversal t;
+    t.primaries = primaries;
+    t.list_first = t.list_last = 0;
+    if (primaries){
+        t.list_first = std::lower_bound(primaries->begin(), primaries->end(), first) - primaries->begin();
+        t.list_last = std::lower_bound(primaries->begin(), primaries->end(), last) - primaries->begin();
+    }
+    t.first = first;
+    t.last = last;
+    t.tiled = false;
+    t.threshold = sample_threshold(sample_fraction);
+    t.tile = 0;
+    t.n_tiles_1d = t.n_tiles = 0;
+    return t;
+}
+
+// Primaries a traversal will correlate (expected, if reject-sampled)
+static double traversal_primaries(const halo_traversal& t){
+    if (t.primaries) return t.list_last - t.list_first;
+    return (t.last - t.first)*(sample_fraction<1.0 ? sample_fraction : 1.0);
+}
+
+// One thread's share of the primaries, for one kernel variant
+// (contains the omp for, so call from inside the parallel region)
+template <bool JK, bool SAMPLED, bool POW2, int N_FIELDS, typename STORE>
+static void correlate_primaries(const halo_kernel& k, const halo_traversal& t,
+                statistics* results_pvt, jk_accumulators& jk){
+
+    const int Nres = k.Nres;
+    const int tile = t.tile;
+    const vector<long int> *primaries = t.primaries;
+
+    primary_scratch scratch(k.n_bins, k.compensated);
+    scratch.progress = k.progress ? k.progress->slot(omp_get_thread_num()) : NULL;
+
+    if (t.tiled){
+
+        // Tiles are the unit of work, primaries inside each tile
+        // run z fastest so neighbouring primaries share cache lines
+        #pragma omp for schedule(dynamic)
+        for ( signed long int tile_i=0; tile_i<t.n_tiles; tile_i++ ){
+
+            // Sampled primaries of this tile, from the list
+            if (primaries){
+                for (long int sample_i=t.tile_start[tile_i]; sample_i<t.tile_start[tile_i+1]; sample_i++){
+                    const signed long int i = t.tile_primaries[sample_i];
+                    correlate_one<JK,POW2,N_FIELDS,STORE>(k, i, results_pvt, jk, scratch);
+                }
+                continue;
+            }
+
+            const int x0 = tile * (tile_i / (t.n_tiles_1d*t.n_tiles_1d));
+            const int y0 = tile * ((tile_i / t.n_tiles_1d) % t.n_tiles_1d);
+            const int z0 = tile * (tile_i % t.n_tiles_1d);
+            const int x1 = std::min(x0 + tile, Nres);
+            const int y1 = std::min(y0 + tile, Nres);
+            const int z1 = std::min(z0 + tile, Nres);
+            for (int x=x0; x<x1; x++){
+                for (int y=y0; y<y1; y++){
+                    for (int z=z0; z<z1; z++){
+                        const signed long int i = (long(x)*Nres + y)*Nres + z;
+                        if (SAMPLED){
+                            if ( !accept_primary(sample_seed, i, t.threshold) ){ continue; }
+                        }
+                        correlate_one<JK,POW2,N_FIELDS,STORE>(k, i, results_pvt, jk, scratch);
+                    }
+                }
+            }
+        } // end omp for (over tiles)
+
+    } else {
 
-        // REJECTION sample
-        // Run over ALL data indices, and reject or accept each
-        // Probability for accept depends on the sample_fraction 
+        // Either the list of primaries, or every voxel with rejection
+        const signed long int n_samples = primaries ? t.list_last - t.list_first : t.last - t.first;
         #pragma omp for
-        for ( signed long int i=0; i<Nres3; i++ ){
-            if (sample_fraction!=1.0){                
-                if ( (rand()%Nres3) >= sample_fraction_int ){ continue; }
+        for ( signed long int sample_i=0; sample_i<n_samples; sample_i++ ){
+            const signed long int i = primaries ? (*primaries)[t.list_first + sample_i] : t.first + sample_i;
+            if (SAMPLED){
+                if ( !accept_primary(sample_seed, i, t.threshold) ){ continue; }
             }
+            correlate_one<JK,POW2,N_FIELDS,STORE>(k, i, results_pvt, jk, scratch);
+        } // end omp for (over positions)
+    }
+
+    // Compensation goes back into the thread's totals once
+    for (int bin_i=0; bin_i<(int)scratch.compensation.size(); bin_i++){
+        results_pvt[bin_i] += scratch.compensation[bin_i];
+    }
+}
 
-        // RANDOM ints
-        // Run over the requested number of samples, generating random index each time
-        // Tests indicate this is slower -- but seems like should be faster??!
-        // #pragma omp for
-        // for ( int sample_i=0; sample_i<sample_fraction_int; sample_i++ ){
-        //     signed long int i = rand()%Nres3;
+// Pointer to one compiled variant of correlate_primaries
+typedef void (*haloVariantType)(const halo_kernel&, const halo_traversal&,
+                statistics*, jk_accumulators&);
 
-            // Get first data point value
-            const float data1 = box1[i];
+template <bool JK, bool SAMPLED, bool POW2, int N_FIELDS>
+static haloVariantType halo_variant_storage(int storage){
+    if (storage==STORAGE_INT16) return correlate_primaries<JK,SAMPLED,POW2,N_FIELDS,int16_t>;
+    if (storage==STORAGE_INT8) return correlate_primaries<JK,SAMPLED,POW2,N_FIELDS,int8_t>;
+    return correlate_primaries<JK,SAMPLED,POW2,N_FIELDS,float>;
+}
 
-            // Get jackknife section and which bin
-            const int jk_index1 = (int)floor(i / jk_length);
-            vector< statistics >& statistics_for_bins_jk = results_jk_pvt.at(jk_index1);
+template <bool JK, bool SAMPLED, bool POW2>
+static haloVariantType halo_variant_fields(int n_fields, int storage){
+    if (n_fields==1) return halo_variant_storage<JK,SAMPLED,POW2,1>(storage);
+    return halo_variant_storage<JK,SAMPLED,POW2,3>(storage);
+}
 
-            // Get location of data point
-            const int x = (int)(i/Nres2);
-            const int y = (int)( (i % Nres2) / Nres);
-            const int z = (i % Nres);
+template <bool JK, bool SAMPLED>
+static haloVariantType halo_variant_pow2(bool pow2, int n_fields, int storage){
+    if (pow2) return halo_variant_fields<JK,SAMPLED,true>(n_fields, storage);
+    return halo_variant_fields<JK,SAMPLED,false>(n_fields, storage);
+}
 
-            // Loop over all triangle bins from this data point
-            for (int bin_i = 0; bin_i < n_bins; bin_i++){
+template <bool JK>
+static haloVariantType halo_variant_sampled(bool sampled, bool pow2, int n_fields, int storage){
+    if (sampled) return halo_variant_pow2<JK,true>(pow2, n_fields, storage);
+    return halo_variant_pow2<JK,false>(pow2, n_fields, storage);
+}
 
-                // printf("\n **** Bin %d ***** \n", bin_i);
+// Variant of the halo kernel for this run
+static haloVariantType halo_variant(bool jk, bool sampled, bool pow2, int n_fields, int storage){
+    if (jk) return halo_variant_sampled<true>(sampled, pow2, n_fields, storage);
+    return halo_variant_sampled<false>(sampled, pow2, n_fields, storage);
+}
 
-                // Get the statistics (DDD etc) for this bin
-                statistics& statistics_for_bin       = results_pvt.at(bin_i);
-                statistics& statistics_for_bin_JK1   = statistics_for_bins_jk.at(bin_i);
+// log2(Nres) if Nres is a power of two, otherwise -1
+static int log2_if_pow2(int Nres){
+    if (Nres<=0 or (Nres & (Nres-1))!=0) return -1;
+    int log2_Nres = 0;
+    while ((1<<log2_Nres) < Nres) log2_Nres++;
+    return log2_Nres;
+}
 
-                // The number of selection function elements used by the first point
-                int radial_bin_single_matchsUsedByPixel1 = 0;
-                double DDD_fromPixel1 = 0, DDR_fromPixel1 = 0; 
-  
-                // Get the triangle vertices list for primary points
-                triangle_configs &triangles_in_bin = selectionFunction->at(bin_i);
-
-                // Loop over all primary points for triangles (ptB)
-                for (int ptB_i=0; ptB_i<(int)triangles_in_bin.sets.size(); ptB_i++){
-                    
-                    // printf("\n    ---- PointB %d ----- \n", ptB_i);
-
-                    // Get the location of the primary point
-                    point ptB = triangles_in_bin.at(ptB_i).ptB;
-                    const int x2 = wrap_int(x + ptB.x, Nres);
-                    const int y2 = wrap_int(y + ptB.y, Nres);
-                    const int z2 = wrap_int(z + ptB.z, Nres);
-                    const signed long int i2 = (x2*Nres2) + (y2*Nres) + z2;
-
-                    // Get the data value and which jackknife bin
-                    const float data2 = box2[i2];
-                    const int jk_index2 = (int)floor(i2 / jk_length);
-
-                    // Store data1*data2 for later
-                    const double mult12 = data1 * data2;
-
-                    // The number of selection function elements used by the second point
-                    int radial_bin_single_matchsUsedByPixels12 = 0;
-                    double DDD_fromPixel2 = 0;
-                    
-                    // Get the selection function element for this node
-                    vector<point>& ptsC_for_radial_bin = triangles_in_bin.at(ptB_i).ptsC;
-
-                    // Loop over the secondary points (ptC)
-                    for (int ptC_it=0; ptC_it<(int)ptsC_for_radial_bin.size(); ptC_it++){ 
-
-                        // Get the location of the secondary point
-                        point ptC = ptsC_for_radial_bin.at(ptC_it);
-                        int x3 = wrap_int(x + ptC.x, Nres);
-                        int y3 = wrap_int(y + ptC.y, Nres);
-                        int z3 = wrap_int(z + ptC.z, Nres);
-                        const signed long int i3 = (x3*Nres2) + (y3*Nres) + z3;
-
-                        // Get the data array index and value
-                        const float data3 = box3[i3];
-                        const int jk_index3 = (int)floor(i3 / jk_length);
-
-                        // Store data1 * data2 * data3
-                        double mult123 = mult12*data3;
-
-                        // Add to the DDD that pixel2 contributed to
-                        DDD_fromPixel2 += mult123;
-
-                        // The number of selection function elements used by the second point increases
-                        radial_bin_single_matchsUsedByPixels12++;
-
-                        // Third JK -- add to it if it is not the same as any other jk index
-                        if (jk_index3!=jk_index2 and jk_index3!=jk_index1){
-                            statistics& statistics_for_bin_JK3 = results_jk_pvt.at(jk_index3).at(bin_i);
-                            statistics_for_bin_JK3.DDD += mult123;
-                            statistics_for_bin_JK3.DDR += mult12;
-                            statistics_for_bin_JK3.DRR += data1;
-                            statistics_for_bin_JK3.RRR += 1.0;
+// Side of a cubic tile of primaries, such that the tile plus its halo
+// in every field read by the kernel fits in the L2 cache of one core
+int auto_tile_size(int halo, int bytes_per_cell){
+    long int l2_bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (l2_bytes<=0) l2_bytes = 1L << 20;
+    int side = (int)floor(cbrt(double(l2_bytes) / bytes_per_cell));
+    return std::max(side - 2*halo, 8);
+}
+
+// Progress reporter for one kernel run (progress_interval, off if 0)
+// expected_primaries: list size, or range times the sampled fraction
+// n_fields: fields correlated per primary (batch kernel)
+// done_before: of those, the primaries done before a resume
+static progress_reporter* start_progress(vector< triangle_configs > *selectionFunction,
+                double expected_primaries, int n_fields, double done_before = 0.0){
+
+    // (ptB, ptC) pairs evaluated per primary, and the heaviest bin
+    double per_primary = 0, heaviest = 0;
+    int heaviest_bin = 0;
+    for (int bin_i=0; bin_i<(int)selectionFunction->size(); bin_i++){
+        const double pairs = selectionFunction->at(bin_i).size();
+        per_primary += pairs;
+        if (pairs>heaviest){
+            heaviest = pairs;
+            heaviest_bin = bin_i;
+        }
+    }
+    if (progress_interval>0){
+        printf("      [progress] every %gs: %.0f primaries, %.0f triangles each, %.0f%% in bin %d\n",
+               progress_interval, expected_primaries, per_primary*n_fields, 100.0*heaviest/std::max(per_primary, 1.0), heaviest_bin);
+        if (done_before>0){
+            printf("      [progress] %.0f primaries done before resuming\n", done_before);
+        }
+    }
+    return new progress_reporter(omp_get_max_threads(), expected_primaries, per_primary*n_fields, progress_interval, done_before);
+}
+
+// Kernel of each NUMA node, reading copies of the stored fields and the
+// jackknife map (n_cells padded cells) made on that node, when the
+// fields are replicated (numa_mode) and the threads span several nodes;
+// empty otherwise (replicas then NULL)
+static vector<halo_kernel> replicate_kernel(const halo_kernel& k, long int n_cells, numa_replicas*& replicas){
+
+    vector<halo_kernel> node_kernels;
+    replicas = NULL;
+    if (numa_mode!=NUMA_REPLICATE) return node_kernels;
+    replicas = new numa_replicas();
+    const int n_nodes = replicas->n_nodes();
+    if (n_nodes<2){
+        delete replicas;
+        replicas = NULL;
+        return node_kernels;
+    }
+
+    // Float pads (K interleaved for the batch kernel), or codes with the
+    // spare bytes the SIMD gathers read
+    const size_t field_bytes = k.pad1 ? n_cells*k.batch*sizeof(float) : n_cells*storage_bytes(storage_mode) + 4;
+    vector<const void*> stored1 = replicas->replicate(k.stored1, field_bytes);
+    vector<const void*> stored2 = (k.stored2==k.stored1) ? stored1 : replicas->replicate(k.stored2, field_bytes);
+    vector<const void*> stored3 = (k.stored3==k.stored1) ? stored1 : (k.stored3==k.stored2) ? stored2 :
+                                  replicas->replicate(k.stored3, field_bytes);
+    vector<const void*> jk_pad = k.jk_pad ? replicas->replicate(k.jk_pad, n_cells*sizeof(jk_region)) :
+                                 vector<const void*>(n_nodes, (const void*)NULL);
+
+    node_kernels.assign(n_nodes, k);
+    for (int node_i=0; node_i<n_nodes; node_i++){
+        halo_kernel& node_k = node_kernels[node_i];
+        node_k.stored1 = stored1[node_i];
+        node_k.stored2 = stored2[node_i];
+        node_k.stored3 = stored3[node_i];
+        if (k.pad1){
+            node_k.pad1 = (const float*)node_k.stored1;
+            node_k.pad2 = (const float*)node_k.stored2;
+            node_k.pad3 = (const float*)node_k.stored3;
+        }
+        node_k.jk_pad = (const jk_region*)jk_pad[node_i];
+    }
+    cout << "      Fields replicated on " << n_nodes << " NUMA nodes\n";
+    return node_kernels;
+}
+
+// Everything a box needs before its primaries are correlated, built
+// once and shared by every range of them (see correlation_run)
+struct correlation_setup{
+    vector< triangle_configs > *selectionFunction;
+    int Nres, n_bins;
+    const float *box1, *box2, *box3;
+    const vector<long int> *primaries;
+    const box_slab* slab;
+    bool wrap;                  // wrap kernel, else the halo kernel
+    bool zero_spread;           // results are all zero
+    jk_regions regions;
+
+    // Halo kernel: padded fields (or their codes) and padded region map
+    halo_kernel k;
+    float *pad1, *pad2, *pad3;
+    jk_region* jk_pad;
+    int n_fields, n_planes;
+    vector<halo_kernel> node_kernels;
+
+    // Wrap kernel: region of every voxel, and copies of the boxes
+    jk_region* jk_map;
+    vector<const void*> boxes1, boxes2, boxes3, jk_maps;
+
+    numa_replicas* replicas;    // NULL unless replicated on several nodes
+    progress_reporter* progress;
+};
+
+// Side of the tiles of primaries (tile_size, or to fit in L2)
+static int halo_tile(const correlation_setup& s){
+    int tile = tile_size;
+    if (tile<=0){
+        tile = auto_tile_size(s.k.halo, storage_bytes(storage_mode)*s.n_fields + (s.jk_pad ? sizeof(jk_region) : 0));
+    }
+    return std::min(std::max(tile, 1), s.Nres);
+}
+
+// Pad, quantise and map the fields for the halo kernel
+// mixed: float partial sums over each ptC list, compensated totals
+// slab: only the primaries of these planes, box1 being the slab data
+// (auto-correlation, flat traversal)
+static void setup_halo(correlation_setup& s, bool mixed){
+
+    vector< triangle_configs > *selectionFunction = s.selectionFunction;
+    const int Nres = s.Nres;
+    const box_slab* slab = s.slab;
+    const float *box1 = s.box1, *box2 = s.box2, *box3 = s.box3;
+
+    // Halo covers the largest offset, so offsets never leave the padded box
+    const int halo = max_offset(selectionFunction);
+    const int Npad = Nres + 2*halo;
+    for (int bin_i=0; bin_i<s.n_bins; bin_i++){
+        if (selectionFunction->at(bin_i).Npad!=Npad){
+            set_linear_offsets(selectionFunction, Npad);
+            break;
+        }
+    }
+
+    // Planes of the padded box: the whole box, or the slab and its halo
+    const int n_planes = s.n_planes = slab ? slab->nx + 2*halo : Npad;
+    const int x0 = slab ? slab->x0 : 0;
+
+    // Pad each distinct field once
+    float* pad1 = slab ? slab_pad(box1, Nres, halo, n_planes) : halo_pad(box1, Nres, halo);
+    float* pad2 = (box2==box1) ? pad1 : halo_pad(box2, Nres, halo);
+    float* pad3 = (box3==box1) ? pad1 : (box3==box2) ? pad2 : halo_pad(box3, Nres, halo);
+    const int n_fields = s.n_fields = 1 + (pad2!=pad1) + (pad3!=pad1 and pad3!=pad2);
+
+    // Jackknife region of every padded cell (not needed for a single region)
+    jk_region* jk_pad = s.jk_pad = (jackknife_N>1) ? jk_region_map(s.regions, halo, x0, n_planes) : NULL;
+
+    halo_kernel& k = s.k;
+    k.n_bins = s.n_bins;
+    k.Nres = Nres;
+    k.Nres2 = long(Nres)*Nres;
+    k.halo = halo;
+    k.Npad = Npad;
+    k.Npad2 = long(Npad)*Npad;
+    k.log2_Nres = log2_if_pow2(Nres);
+    k.x0 = x0;
+    k.box1 = box1;
+    k.pad1 = pad1;
+    k.pad2 = pad2;
+    k.pad3 = pad3;
+    k.stored1 = pad1;
+    k.stored2 = pad2;
+    k.stored3 = pad3;
+    k.jk_pad = jk_pad;
+    k.regions = &s.regions;
+    k.batch = 1;
+    k.compensated = mixed;
+    k.progress = NULL;
+    k.selectionFunction = selectionFunction;
+
+    // Distinct ptB offsets over all bins, for the shared-ptB kernel
+    k.shared = (kernel_mode==KERNEL_SHARED) ? share_ptB_offsets(selectionFunction) : NULL;
+    if (k.shared){
+        cout << "      " << k.shared->size() << " distinct ptB offsets\n";
+    }
+
+    // Vectorised ptC loop for this CPU (scalar if not supported)
+    k.gather_sum = mixed ? gather_sum_float_kernel(simd_level) : gather_sum_kernel(simd_level);
+    k.gather_int16 = gather_int16_kernel(simd_level);
+    k.gather_int8 = gather_int8_kernel(simd_level);
+    k.gather_batch = NULL;
+
+    // Quantised storage: the kernel reads codes instead of the float
+    // pads, which are freed straight away
+    if (storage_mode!=STORAGE_FLOAT){
+        const long int Npad3 = k.Npad2*n_planes;
+        k.stored1 = quantise_field(pad1, Npad3, storage_mode, k.quant1);
+        k.stored2 = (pad2==pad1) ? k.stored1 : quantise_field(pad2, Npad3, storage_mode, k.quant2);
+        k.stored3 = (pad3==pad1) ? k.stored1 : (pad3==pad2) ? k.stored2 : quantise_field(pad3, Npad3, storage_mode, k.quant3);
+        if (pad2==pad1) k.quant2 = k.quant1;
+        if (pad3==pad1) k.quant3 = k.quant1; else if (pad3==pad2) k.quant3 = k.quant2;
+        for (int field_i=0; field_i<n_fields; field_i++){
+            const quantisation& quant = (field_i==0) ? k.quant1 : (field_i==1 and pad2!=pad1) ? k.quant2 : k.quant3;
+            printf("\n      Field %d as %s: scale %.3e, max error %.3e (half step %.3e)", field_i+1,
+                   storage_name(storage_mode), quant.scale, quant.max_error, 0.5*quant.scale);
+        }
+        printf("\n");
+        if (pad3!=pad1 and pad3!=pad2) delete[] pad3;
+        if (pad2!=pad1) delete[] pad2;
+        delete[] pad1;
+        pad1 = pad2 = pad3 = NULL;
+        k.pad1 = k.pad2 = k.pad3 = NULL;
+    }
+    s.pad1 = pad1;
+    s.pad2 = pad2;
+    s.pad3 = pad3;
+
+    const bool sampled = (!s.primaries and sample_fraction!=1.0);
+    const bool pow2 = (k.log2_Nres>=0);
+    cout << "      Kernel variant: jk=" << (jackknife_N>1) << " sampled=" << sampled;
+    cout << " pow2=" << pow2 << " fields=" << (n_fields==1 ? 1 : 3);
+    cout << " storage=" << storage_name(storage_mode) << "\n";
+
+    if (traversal_mode==TRAVERSE_TILES and !slab){
+        const int tile = halo_tile(s);
+        const long int n_tiles_1d = (Nres + tile - 1) / tile;
+        cout << "      Tiles of " << tile << "^3 (" << n_tiles_1d*n_tiles_1d*n_tiles_1d << " tiles)\n";
+    }
+
+    // Each thread reads the copies on its own NUMA node, if replicated
+    s.node_kernels = replicate_kernel(k, k.Npad2*n_planes, s.replicas);
+}
+
+// Free the padded copies (or their codes)
+static void free_halo(correlation_setup& s){
+    const halo_kernel& k = s.k;
+    if (storage_mode!=STORAGE_FLOAT){
+        if (k.stored3!=k.stored1 and k.stored3!=k.stored2) free((void*)k.stored3);
+        if (k.stored2!=k.stored1) free((void*)k.stored2);
+        free((void*)k.stored1);
+    }
+    if (s.pad3!=s.pad1 and s.pad3!=s.pad2) delete[] s.pad3;
+    if (s.pad2!=s.pad1) delete[] s.pad2;
+    delete[] s.pad1;
+    delete[] s.jk_pad;
+    delete k.shared;
+}
+
+// Run the halo kernel over the primaries of a traversal, into results
+// as_double: all-double sums even if set up for mixed precision (the
+// check of PRECISION_VALIDATE, not counted in the progress)
+static void correlate_halo(const correlation_setup& s, halo_traversal t,
+                vector<statistics_with_jk> *results, bool as_double){
+
+    const int n_bins = s.n_bins;
+    const int Nres = s.Nres;
+    const vector<long int> *primaries = t.primaries;
+
+    // Tiles of primaries for the tiled traversal (a range of voxels that
+    // isn't the whole box is traversed flat)
+    t.tiled = (traversal_mode==TRAVERSE_TILES and !s.slab and
+               (primaries or (t.first==0 and t.last==long(Nres)*Nres*Nres)));
+    const int tile = t.tile = halo_tile(s);
+    const long int n_tiles_1d = t.n_tiles_1d = (Nres + tile - 1) / tile;
+    const long int n_tiles = t.n_tiles = n_tiles_1d*n_tiles_1d*n_tiles_1d;
+
+    // A list of primaries is regrouped tile by tile (counting sort,
+    // so each tile keeps ascending indices)
+    vector<long int> &tile_primaries = t.tile_primaries, &tile_start = t.tile_start;
+    if (primaries and t.tiled){
+        const long int Nres2 = long(Nres)*Nres;
+        const long int n_list = t.list_last - t.list_first;
+        vector<long int> tile_of(n_list);
+        tile_start.assign(n_tiles+1, 0);
+        for (long int sample_i=0; sample_i<n_list; sample_i++){
+            const long int i = primaries->at(t.list_first + sample_i);
+            const long int x = i/Nres2, y = (i % Nres2)/Nres, z = i % Nres;
+            tile_of.at(sample_i) = ((x/tile)*n_tiles_1d + y/tile)*n_tiles_1d + z/tile;
+            tile_start.at(tile_of.at(sample_i)+1)++;
+        }
+        for (long int tile_i=0; tile_i<n_tiles; tile_i++){
+            tile_start.at(tile_i+1) += tile_start.at(tile_i);
+        }
+        vector<long int> fill(tile_start.begin(), tile_start.end()-1);
+        tile_primaries.resize(n_list);
+        for (long int sample_i=0; sample_i<n_list; sample_i++){
+            tile_primaries.at(fill.at(tile_of.at(sample_i))++) = primaries->at(t.list_first + sample_i);
+        }
+    }
+
+    // Compiled variant for this run
+    const bool with_jk = (jackknife_N>1);
+    const bool sampled = (!primaries and sample_fraction!=1.0);
+    const bool pow2 = (s.k.log2_Nres>=0);
+    haloVariantType correlate_variant = halo_variant(with_jk, sampled, pow2, s.n_fields==1 ? 1 : 3, storage_mode);
+
+    // One accumulator block per thread (totals only without jackknife)
+    vector<statistics*> blocks(omp_get_max_threads());
+    const bool sparse_jk = use_sparse_jackknife(n_bins);
+    const long int n_rows = (sparse_jk or !with_jk) ? 1 : 1 + jackknife_N;
+
+    #pragma omp parallel
+    {
+        statistics* results_pvt = new_accumulators(n_bins, n_rows);
+        jk_accumulators jk(n_bins, n_rows>1 ? results_pvt + n_bins : NULL, results);
+        blocks[omp_get_thread_num()] = results_pvt;
+
+        halo_kernel k = s.replicas ? s.node_kernels[s.replicas->node()] : s.k;
+        k.progress = as_double ? NULL : s.progress;
+        if (as_double){
+            k.compensated = false;
+            k.gather_sum = gather_sum_kernel(simd_level);
+        }
+        correlate_variant(k, t, results_pvt, jk);
+
+        // Tree reduction across threads, instead of a serial critical merge
+        jk.finish();
+        reduce_accumulators(blocks, n_bins, n_rows);
+        store_accumulators(blocks, n_bins, n_rows, results);
+    } //end omp parllel
+
+    if (!with_jk) single_region(results);
+}
+
+// Batched halo kernel: the sums of correlate_primary (auto-correlation)
+// for K fields interleaved in pad1, K floats per padded cell, so each
+// offset, loop step and jackknife lookup is shared by the K fields and
+// the loops over them vectorise (KW: K at compile time, or 0)
+// Accumulators hold n_bins*K statistics per row, in [bin][field] order
+template <bool JK, bool POW2, int KW>
+static void correlate_primary_batch(const halo_kernel& k, signed long int i,
+                statistics* results_pvt, jk_accumulators& jk, double* scratch){
+
+    const int K = KW ? KW : k.batch;
+    const jk_region* jk_pad = JK ? k.jk_pad : NULL;
+    if (JK) jk.flush_if_full();
+
+    // Padded index of the primary point, and its K values
+    long int x, y, z;
+    const long int p = padded_primary<POW2>(k, i, x, y, z);
+    const float* data1 = k.pad1 + p*K;
+
+    // Jackknife region as in correlate_primary (same for every field)
+    const int jk_index1 = JK ? jk_pad[p] : 0;
+    if (JK and k.regions->is_interior(x, y, z)) jk_pad = NULL;
+    statistics* statistics_for_bins_jk = JK ? jk.row(jk_index1) : NULL;
+
+    // Per-field sums, in the thread's scratch
+    double* mult12 = scratch;
+    double* sum_data3 = scratch + K;
+    double* DDD_fromPixel1 = scratch + 2*K;
+    double* DDR_fromPixel1 = scratch + 3*K;
+
+    for (int bin_i = 0; bin_i < k.n_bins; bin_i++){
+
+        int radial_bin_single_matchsUsedByPixel1 = 0;
+        for (int b=0; b<K; b++){
+            DDD_fromPixel1[b] = 0;
+            DDR_fromPixel1[b] = 0;
+        }
+
+        triangle_configs &triangles_in_bin = k.selectionFunction->at(bin_i);
+
+        for (int ptB_i=0; ptB_i<(int)triangles_in_bin.sets.size(); ptB_i++){
+
+            const triangle_set& this_set = triangles_in_bin.sets[ptB_i];
+            const int* offsC = this_set.offsC.data();
+            const int n_ptsC = (int)this_set.offsC.size();
+            const int mult_BC = this_set.mult_BC, mult_CB = this_set.mult_CB;
+            const int mult = mult_BC + mult_CB;
+
+            // Second point straight from the padded box
+            const long int i2 = p + this_set.offB;
+            const float* data2 = k.pad1 + i2*K;
+            const int jk_index2 = jk_pad ? jk_pad[i2] : jk_index1;
+
+            for (int b=0; b<K; b++){
+                mult12[b] = data1[b] * data2[b];
+            }
+
+            // Without jackknife regions the ptC loop is a batched gather
+            if (!jk_pad){
+                k.gather_batch(k.pad1 + p*K, offsC, n_ptsC, K, sum_data3);
+            } else {
+                for (int b=0; b<K; b++) sum_data3[b] = 0;
+                for (int ptC_it=0; ptC_it<n_ptsC; ptC_it++){
+
+                    // Third point straight from the padded box
+                    const long int i3 = p + offsC[ptC_it];
+                    const float* data3 = k.pad1 + i3*K;
+                    for (int b=0; b<K; b++){
+                        sum_data3[b] += data3[b];
+                    }
+
+                    const int jk_index3 = jk_pad[i3];
+                    if (jk_index3!=jk_index2 and jk_index3!=jk_index1){
+                        statistics* statistics_for_bin_JK3 = jk.row(jk_index3) + bin_i*K;
+                        for (int b=0; b<K; b++){
+                            statistics_for_bin_JK3[b].DDD += mult * (mult12[b]*data3[b]);
+                            statistics_for_bin_JK3[b].DDR += mult_BC * mult12[b] + mult_CB * double(data1[b]*data3[b]);
+                            statistics_for_bin_JK3[b].DRR += mult * data1[b];
+                            statistics_for_bin_JK3[b].RRR += mult;
                         }
+                    }
+
+                } // endfor ptC_it (secondary point)
+            }
+
+            const int radial_bin_single_matchsUsedByPixels12 = mult * n_ptsC;
+            statistics* statistics_for_bin_JK2 = (jk_index2!=jk_index1) ? jk.row(jk_index2) + bin_i*K : NULL;
+            for (int b=0; b<K; b++){
+                const double DDD_fromPixel2 = mult * mult12[b] * sum_data3[b];
+                const double DDR_fromPixel2 = (mult_BC * n_ptsC) * mult12[b] + mult_CB * data1[b] * sum_data3[b];
+                DDD_fromPixel1[b] += DDD_fromPixel2;
+                DDR_fromPixel1[b] += DDR_fromPixel2;
+                if (statistics_for_bin_JK2){
+                    statistics_for_bin_JK2[b].DDD += DDD_fromPixel2;
+                    statistics_for_bin_JK2[b].DDR += DDR_fromPixel2;
+                    statistics_for_bin_JK2[b].DRR += radial_bin_single_matchsUsedByPixels12 * data1[b];
+                    statistics_for_bin_JK2[b].RRR += radial_bin_single_matchsUsedByPixels12 * 1.0;
+                }
+            }
+
+            radial_bin_single_matchsUsedByPixel1 += radial_bin_single_matchsUsedByPixels12;
+
+        } // endfor second point
+
+        statistics* statistics_for_bin = results_pvt + bin_i*K;
+        statistics* statistics_for_bin_JK1 = JK ? statistics_for_bins_jk + bin_i*K : NULL;
+        for (int b=0; b<K; b++){
+            const double DRR_inPixel1 = radial_bin_single_matchsUsedByPixel1 * data1[b];
+            const double RRR_inPixel1 = radial_bin_single_matchsUsedByPixel1 * 1.0;
+            statistics_for_bin[b].DDD += DDD_fromPixel1[b];
+            statistics_for_bin[b].DDR += DDR_fromPixel1[b];
+            statistics_for_bin[b].DRR += DRR_inPixel1;
+            statistics_for_bin[b].RRR += RRR_inPixel1;
+            if (JK){
+                statistics_for_bin_JK1[b].DDD += DDD_fromPixel1[b];
+                statistics_for_bin_JK1[b].DDR += DDR_fromPixel1[b];
+                statistics_for_bin_JK1[b].DRR += DRR_inPixel1;
+                statistics_for_bin_JK1[b].RRR += RRR_inPixel1;
+            }
+        }
+
+    } // endfor bin_i
+}
+
+// One thread's share of the primaries for the batched kernel, a list
+// or every voxel (reject-sampled), in flat order
+// (contains the omp for, so call from inside the parallel region)
+template <bool JK, bool POW2, int KW>
+static void correlate_primaries_batch(const halo_kernel& k, const halo_traversal& t,
+                statistics* results_pvt, jk_accumulators& jk){
+
+    const vector<long int> *primaries = t.primaries;
+    const bool sampled = (!primaries and sample_fraction!=1.0);
+    vector<double> scratch(4*k.batch);
+    progress_slot* progress = k.progress ? k.progress->slot(omp_get_thread_num()) : NULL;
+
+    const signed long int n_samples = primaries ? t.list_last - t.list_first : t.last - t.first;
+    #pragma omp for
+    for ( signed long int sample_i=0; sample_i<n_samples; sample_i++ ){
+        const signed long int i = primaries ? (*primaries)[t.list_first + sample_i] : t.first + sample_i;
+        if (sampled){
+            if ( !accept_primary(sample_seed, i, t.threshold) ){ continue; }
+        }
+        if (progress) progress->add();
+        correlate_primary_batch<JK,POW2,KW>(k, i, results_pvt, jk, scratch.data());
+    } // end omp for (over positions)
+}
+
+// Batched variant for this run, fixed widths for the usual batch sizes
+template <bool JK, bool POW2>
+static haloVariantType batch_variant_width(int K){
+    if (K==4) return correlate_primaries_batch<JK,POW2,4>;
+    if (K==8) return correlate_primaries_batch<JK,POW2,8>;
+    if (K==16) return correlate_primaries_batch<JK,POW2,16>;
+    return correlate_primaries_batch<JK,POW2,0>;
+}
+
+static haloVariantType batch_variant(bool jk, bool pow2, int K){
+    if (jk) return pow2 ? batch_variant_width<true,true>(K) : batch_variant_width<true,false>(K);
+    return pow2 ? batch_variant_width<false,true>(K) : batch_variant_width<false,false>(K);
+}
 
-                    } // endfor ptC_it (secondary point)
+// Wrap kernel for one thread's share of the primaries, compiled for
+// JK, SAMPLED and POW2 as the halo kernel (POW2 also wraps by masking)
+// (contains the omp for, so call from inside the parallel region)
+template <bool JK, bool SAMPLED, bool POW2>
+static void correlate_wrap(const float* box1, const float* box2, const float* box3,
+                vector< triangle_configs > *selectionFunction, int Nres,
+                const jk_regions& regions, const jk_region* jk_map, const halo_traversal& t,
+                statistics* results_pvt, jk_accumulators& jk, progress_slot* progress){
+
+    const int n_bins = selectionFunction->size();
+    const long int Nres2 = long(Nres)*Nres;
+    const long int Nres3 = Nres2*Nres;
+    const int log2_Nres = POW2 ? log2_if_pow2(Nres) : 0;
+
+    // Run over the precomputed list of primaries if given,
+    // otherwise REJECTION sample:
+    // Run over ALL data indices of the range, and reject or accept each
+    // Probability for accept depends on the sample_fraction 
+    const vector<long int> *primaries = t.primaries;
+    const signed long int n_samples = primaries ? t.list_last - t.list_first : t.last - t.first;
+    #pragma omp for
+    for ( signed long int sample_i=0; sample_i<n_samples; sample_i++ ){
+        const signed long int i = primaries ? (*primaries)[t.list_first + sample_i] : t.first + sample_i;
+        if (SAMPLED){                
+            if ( !accept_primary(sample_seed, i, t.threshold) ){ continue; }
+        }
+        if (progress) progress->add();
+
+        // Get first data point value
+        const float data1 = box1[i];
+        if (JK) jk.flush_if_full();
+
+        // Get location of data point
+        const int x = POW2 ? (int)(i >> (2*log2_Nres)) : (int)(i/Nres2);
+        const int y = POW2 ? (int)((i >> log2_Nres) & (Nres-1)) : (int)( (i % Nres2) / Nres);
+        const int z = POW2 ? (int)(i & (Nres-1)) : (i % Nres);
 
-                    // All the DDD that Pixel2 contributed to, was also contribued by pixel1    
-                    DDD_fromPixel1 += DDD_fromPixel2;
+        // Get jackknife region, and whether every vertex is inside it
+        const int jk_index1 = JK ? jk_map[i] : 0;
+        const bool interior = !JK or regions.is_interior(x, y, z);
+        statistics* statistics_for_bins_jk = JK ? jk.row(jk_index1) : NULL;
 
-                    // DDR depends on mult12 and radial_bin_single_matchsUsedByPixels12
-                    DDR_fromPixel1 += radial_bin_single_matchsUsedByPixels12 * mult12;
+        // Loop over all triangle bins from this data point
+        for (int bin_i = 0; bin_i < n_bins; bin_i++){
 
-                    // Second JK
-                    if ( jk_index2 != jk_index1 ){
-                        statistics& statistics_for_bin_JK2 = results_jk_pvt.at(jk_index2).at(bin_i);
-                        statistics_for_bin_JK2.DDD += DDD_fromPixel2;
-                        statistics_for_bin_JK2.DDR += radial_bin_single_matchsUsedByPixels12 * mult12;
-                        statistics_for_bin_JK2.DRR += radial_bin_single_matchsUsedByPixels12 * data1;
-                        statistics_for_bin_JK2.RRR += radial_bin_single_matchsUsedByPixels12 * 1.0;
+            // printf("\n **** Bin %d ***** \n", bin_i);
+
+            // Get the statistics (DDD etc) for this bin
+            statistics& statistics_for_bin       = results_pvt[bin_i];
+
+            // The number of selection function elements used by the first point
+            int radial_bin_single_matchsUsedByPixel1 = 0;
+            double DDD_fromPixel1 = 0, DDR_fromPixel1 = 0; 
+  
+            // Get the triangle vertices list for primary points
+            triangle_configs &triangles_in_bin = selectionFunction->at(bin_i);
+
+            // Loop over all primary points for triangles (ptB)
+            for (int ptB_i=0; ptB_i<(int)triangles_in_bin.sets.size(); ptB_i++){
+                
+                // printf("\n    ---- PointB %d ----- \n", ptB_i);
+
+                // Get the location of the primary point
+                point ptB = triangles_in_bin.at(ptB_i).ptB;
+                const int x2 = wrap_coord<POW2>(x + ptB.x, Nres);
+                const int y2 = wrap_coord<POW2>(y + ptB.y, Nres);
+                const int z2 = wrap_coord<POW2>(z + ptB.z, Nres);
+                const signed long int i2 = (x2*Nres2) + (y2*Nres) + z2;
+
+                // Get the data value and which jackknife bin
+                const float data2 = box2[i2];
+                const int jk_index2 = interior ? jk_index1 : jk_map[i2];
+
+                // Store data1*data2 for later
+                const double mult12 = data1 * data2;
+
+                // The number of selection function elements used by the second point
+                int radial_bin_single_matchsUsedByPixels12 = 0;
+                double DDD_fromPixel2 = 0;
+
+                // Each (ptB,ptC) stands for mult_BC stored triangles, and mult_CB
+                // with ptB and ptC swapped (whose DDR uses data3 instead of data2)
+                const int mult_BC = triangles_in_bin.at(ptB_i).mult_BC;
+                const int mult_CB = triangles_in_bin.at(ptB_i).mult_CB;
+                const int mult = mult_BC + mult_CB;
+                double sum_data3 = 0;
+                
+                // Get the selection function element for this node
+                vector<point>& ptsC_for_radial_bin = triangles_in_bin.at(ptB_i).ptsC;
+
+                // Loop over the secondary points (ptC)
+                for (int ptC_it=0; ptC_it<(int)ptsC_for_radial_bin.size(); ptC_it++){ 
+
+                    // Get the location of the secondary point
+                    point ptC = ptsC_for_radial_bin.at(ptC_it);
+                    int x3 = wrap_coord<POW2>(x + ptC.x, Nres);
+                    int y3 = wrap_coord<POW2>(y + ptC.y, Nres);
+                    int z3 = wrap_coord<POW2>(z + ptC.z, Nres);
+                    const signed long int i3 = (x3*Nres2) + (y3*Nres) + z3;
+
+                    // Get the data array index and value
+                    const float data3 = box3[i3];
+
+                    // Store data1 * data2 * data3
+                    double mult123 = mult12*data3;
+
+                    // Add to the DDD that pixel2 contributed to
+                    DDD_fromPixel2 += mult * mult123;
+                    sum_data3 += data3;
+
+                    // The number of selection function elements used by the second point increases
+                    radial_bin_single_matchsUsedByPixels12 += mult;
+
+                    // Third JK -- add to it if it is not the same as any other jk index
+                    if (interior) continue;
+                    const int jk_index3 = jk_map[i3];
+                    if (jk_index3!=jk_index2 and jk_index3!=jk_index1){
+                        statistics& statistics_for_bin_JK3 = jk.row(jk_index3)[bin_i];
+                        statistics_for_bin_JK3.DDD += mult * mult123;
+                        statistics_for_bin_JK3.DDR += mult_BC * mult12 + mult_CB * double(data1*data3);
+                        statistics_for_bin_JK3.DRR += mult * data1;
+                        statistics_for_bin_JK3.RRR += mult;
                     }
 
-                    // The number of selection function elements used by the first point increases
-                    radial_bin_single_matchsUsedByPixel1 += radial_bin_single_matchsUsedByPixels12;
+                } // endfor ptC_it (secondary point)
+
+                // All the DDD that Pixel2 contributed to, was also contribued by pixel1    
+                DDD_fromPixel1 += DDD_fromPixel2;
+
+                // DDR depends on mult12 and the number of ptsC (and data3 if swapped)
+                const double DDR_fromPixel2 = (mult_BC * (int)ptsC_for_radial_bin.size()) * mult12 + mult_CB * data1 * sum_data3;
+                DDR_fromPixel1 += DDR_fromPixel2;
+
+                // Second JK
+                if ( jk_index2 != jk_index1 ){
+                    statistics& statistics_for_bin_JK2 = jk.row(jk_index2)[bin_i];
+                    statistics_for_bin_JK2.DDD += DDD_fromPixel2;
+                    statistics_for_bin_JK2.DDR += DDR_fromPixel2;
+                    statistics_for_bin_JK2.DRR += radial_bin_single_matchsUsedByPixels12 * data1;
+                    statistics_for_bin_JK2.RRR += radial_bin_single_matchsUsedByPixels12 * 1.0;
+                }
+
+                // The number of selection function elements used by the first point increases
+                radial_bin_single_matchsUsedByPixel1 += radial_bin_single_matchsUsedByPixels12;
 
-                } // endfor second point
+            } // endfor second point
 
 
-                // Get the final sums
-                // DDD has been summed accumulatively
-                // DDR has been summed accumulatively
-                double DRR_inPixel1 = radial_bin_single_matchsUsedByPixel1 * data1;
-                double RRR_inPixel1 = radial_bin_single_matchsUsedByPixel1 * 1.0;
+            // Get the final sums
+            // DDD has been summed accumulatively
+            // DDR has been summed accumulatively
+            double DRR_inPixel1 = radial_bin_single_matchsUsedByPixel1 * data1;
+            double RRR_inPixel1 = radial_bin_single_matchsUsedByPixel1 * 1.0;
 
-                // Add the partial sums to the whole sums
-                statistics_for_bin.DDD += DDD_fromPixel1;
-                statistics_for_bin.DDR += DDR_fromPixel1;
-                statistics_for_bin.DRR += DRR_inPixel1;
-                statistics_for_bin.RRR += RRR_inPixel1;
+            // Add the partial sums to the whole sums
+            statistics_for_bin.DDD += DDD_fromPixel1;
+            statistics_for_bin.DDR += DDR_fromPixel1;
+            statistics_for_bin.DRR += DRR_inPixel1;
+            statistics_for_bin.RRR += RRR_inPixel1;
 
-                // Also add the partial sums to the first pixel's jackknife array
-                // CANT just use statistics_for_bin.DDD etc, because these will generally already contain sums from other pixels
+            // Also add the partial sums to the first pixel's jackknife array
+            // CANT just use statistics_for_bin.DDD etc, because these will generally already contain sums from other pixels
+            if (JK){
+                statistics& statistics_for_bin_JK1   = statistics_for_bins_jk[bin_i];
                 statistics_for_bin_JK1.DDD += DDD_fromPixel1;
                 statistics_for_bin_JK1.DRR += DRR_inPixel1;
                 statistics_for_bin_JK1.DDR += DDR_fromPixel1;
                 statistics_for_bin_JK1.RRR += RRR_inPixel1;
-                
-            } // endfor bin_i
-        } // end omp for (over positions)
+            }
+            
+        } // endfor bin_i
+    } // end omp for (over positions)
+}
 
+// Pointer to one compiled variant of correlate_wrap
+typedef void (*wrapVariantType)(const float*, const float*, const float*,
+                vector< triangle_configs >*, int, const jk_regions&, const jk_region*,
+                const halo_traversal&, statistics*, jk_accumulators&, progress_slot*);
 
-        // Sum the private arrays for each thread in critical section 
-        // Can't be run in two threads at once to stop clashes
-        #pragma omp critical
-        {
-            for (int bin_i=0; bin_i<n_bins; bin_i++ ){
-                results->at(bin_i).stats += results_pvt.at(bin_i);                
+// Variant of the wrap kernel for this run
+static wrapVariantType wrap_variant(bool jk, bool sampled, bool pow2){
+    if (jk){
+        if (sampled) return pow2 ? correlate_wrap<true,true,true> : correlate_wrap<true,true,false>;
+        return pow2 ? correlate_wrap<true,false,true> : correlate_wrap<true,false,false>;
+    }
+    if (sampled) return pow2 ? correlate_wrap<false,true,true> : correlate_wrap<false,true,false>;
+    return pow2 ? correlate_wrap<false,false,true> : correlate_wrap<false,false,false>;
+}
 
-                // DD_JK, DR_JK, RR_JK values start at DD, DR, RR values
-                for (int jk_i=0; jk_i<jackknife_N; jk_i++){
-                    results->at(bin_i).stats_JK.at(jk_i) += results_jk_pvt.at(jk_i).at(bin_i);
-                }
-            } // endfor bin_i
-        } // end omp critical
+// Largest relative deviation of the mixed-precision sums from the
+// all-double sums, over every bin (and jackknife region)
+static void report_precision(vector<statistics_with_jk> *results, vector<statistics_with_jk> *results_double){
+    double worst_DDD = 0, worst_DDR = 0;
+    int worst_bin = 0;
+    for (int bin_i=0; bin_i<(int)results->size(); bin_i++){
+        for (int jk_i=-1; jk_i<jackknife_N; jk_i++){
+            const statistics& s = (jk_i<0) ? results->at(bin_i).stats : results->at(bin_i).stats_JK.at(jk_i);
+            const statistics& s_double = (jk_i<0) ? results_double->at(bin_i).stats : results_double->at(bin_i).stats_JK.at(jk_i);
+            const double dev_DDD = (s_double.DDD!=0) ? fabs(s.DDD/s_double.DDD - 1.0) : fabs(s.DDD);
+            const double dev_DDR = (s_double.DDR!=0) ? fabs(s.DDR/s_double.DDR - 1.0) : fabs(s.DDR);
+            if (dev_DDD>worst_DDD or dev_DDR>worst_DDR) worst_bin = bin_i;
+            worst_DDD = std::max(worst_DDD, dev_DDD);
+            worst_DDR = std::max(worst_DDR, dev_DDR);
+        }
+    }
+    printf("\n      Mixed precision vs double: max relative deviation DDD %.3e, DDR %.3e (worst in bin %d)\n",
+           worst_DDD, worst_DDR, worst_bin);
+}
+
+// Map the regions, and copy the boxes and the map on each NUMA node
+// (as the halo kernel), for the wrap kernel
+static void setup_wrap(correlation_setup& s){
+    const long int Nres3 = long(s.Nres)*s.Nres*s.Nres;
+    const bool sampled = (!s.primaries and sample_fraction!=1.0);
+    cout << "      Kernel variant: wrap jk=" << (jackknife_N>1) << " sampled=" << sampled;
+    cout << " pow2=" << (log2_if_pow2(s.Nres)>=0) << "\n";
+
+    // Jackknife region of every voxel (not needed for a single region)
+    s.jk_map = (jackknife_N>1) ? jk_region_map(s.regions, 0) : NULL;
+
+    s.replicas = (numa_mode==NUMA_REPLICATE) ? new numa_replicas() : NULL;
+    if (s.replicas and s.replicas->n_nodes()<2){
+        delete s.replicas;
+        s.replicas = NULL;
+    }
+    if (s.replicas){
+        const size_t box_bytes = size_t(Nres3)*sizeof(float);
+        s.boxes1 = s.replicas->replicate(s.box1, box_bytes);
+        s.boxes2 = (s.box2==s.box1) ? s.boxes1 : s.replicas->replicate(s.box2, box_bytes);
+        s.boxes3 = (s.box3==s.box1) ? s.boxes1 : (s.box3==s.box2) ? s.boxes2 : s.replicas->replicate(s.box3, box_bytes);
+        s.jk_maps = s.jk_map ? s.replicas->replicate(s.jk_map, size_t(Nres3)*sizeof(jk_region)) :
+                    vector<const void*>(s.replicas->n_nodes(), (const void*)NULL);
+        cout << "      Fields replicated on " << s.replicas->n_nodes() << " NUMA nodes\n";
+    }
+}
+
+// Run the wrap kernel over the primaries of a traversal, into results
+static void correlate_wrap(const correlation_setup& s, const halo_traversal& t,
+                vector<statistics_with_jk> *results){
+
+    const int n_bins = s.n_bins;
+    const bool with_jk = (jackknife_N>1);
+    const bool sampled = (!t.primaries and sample_fraction!=1.0);
+    const bool pow2 = (log2_if_pow2(s.Nres)>=0);
+
+    vector<statistics*> blocks(omp_get_max_threads());
+    const bool sparse_jk = use_sparse_jackknife(n_bins);
+    const long int n_rows = (sparse_jk or !with_jk) ? 1 : 1 + jackknife_N;
+
+    #pragma omp parallel
+    {
+        const numa_replicas* replicas = s.replicas;
+        const int node_i = replicas ? replicas->node() : 0;
+        const float* node_box1 = replicas ? (const float*)s.boxes1[node_i] : s.box1;
+        const float* node_box2 = replicas ? (const float*)s.boxes2[node_i] : s.box2;
+        const float* node_box3 = replicas ? (const float*)s.boxes3[node_i] : s.box3;
+        const jk_region* node_jk_map = replicas ? (const jk_region*)s.jk_maps[node_i] : s.jk_map;
+
+        // Each thread gets its own private statistics and statistics_JK array
+        // in one aligned block; JK part goes in [JK_index][bin_i] order,
+        // so that jk index can be got outside of the bins
+        // (only rows for touched regions, if sparse)
+        statistics* results_pvt = new_accumulators(n_bins, n_rows);
+        jk_accumulators jk(n_bins, n_rows>1 ? results_pvt + n_bins : NULL, results);
+        blocks[omp_get_thread_num()] = results_pvt;
+
+        wrap_variant(with_jk, sampled, pow2)(node_box1, node_box2, node_box3, s.selectionFunction, s.Nres,
+            s.regions, node_jk_map, t, results_pvt, jk, s.progress->slot(omp_get_thread_num()));
+
+        // Sum the private arrays for each thread with a tree reduction
+        jk.finish();
+        reduce_accumulators(blocks, n_bins, n_rows);
+        store_accumulators(blocks, n_bins, n_rows, results);
     } //end omp parllel
+    if (!with_jk) single_region(results);
+}
 
-    // All the stats_JK are subtracted from the total stats values
-    for (int bin_i=0; bin_i<n_bins; bin_i++ ){
-        for (int jk_index=0; jk_index<jackknife_N; jk_index++){
-            results->at(bin_i).stats_JK.at(jk_index) = results->at(bin_i).stats - results->at(bin_i).stats_JK.at(jk_index);
+correlation_run::correlation_run(const float* box1, const float* box2, const float* box3,
+                vector< triangle_configs > *selectionFunction, int Nres,
+                const vector<long int> *primaries, long int first, long int last,
+                long int done_from, const box_slab* slab) : setup(new correlation_setup()){
+
+    correlation_setup& s = *setup;
+    s.selectionFunction = selectionFunction;
+    s.Nres = Nres;
+    s.n_bins = selectionFunction->size();
+    s.box1 = box1;
+    s.box2 = box2;
+    s.box3 = box3;
+    s.primaries = primaries;
+    s.slab = slab;
+    s.pad1 = s.pad2 = s.pad3 = NULL;
+    s.jk_pad = s.jk_map = NULL;
+    s.replicas = NULL;
+    s.progress = NULL;
+
+    s.wrap = (kernel_mode==KERNEL_WRAP and !slab);
+
+    // Get spread of data -- if no spread, the results are zeros
+    // (not checked on a slab, whose ranks would disagree)
+    s.zero_spread = false;
+    if (!slab){
+        const long int Nres3 = long(Nres)*Nres*Nres;
+        long double min = *std::min_element(box1,box1+Nres3);
+        long double max = *std::max_element(box1,box1+Nres3);
+        long double range = max - min;
+        cout << "      Data min is " << min << "\n";
+        cout << "      Data max is " << max << "\n";
+        cout << "      Data range is " << range << "\n";
+        s.zero_spread = (range==0.0);
+        if (s.zero_spread){
+            cout << "      Zero spread in data, returning zeros results\n";
+            return;
         }
-    } // endfor over bins, for storing jackknifed results
+    }
+
+    // Make sure we have defined the number of threads
+    omp_set_num_threads(global_nthreads);    
+
+    // Split the data vector into jackknife_N regions (slabs or cubes,
+    // see jackknife.hpp), with interior flags for the largest offset
+    const int halo = max_offset(selectionFunction);
+    s.regions = make_jk_regions(Nres, halo);
+
+    if (s.wrap){
+        setup_wrap(s);
+    } else {
+        setup_halo(s, precision_mode!=PRECISION_DOUBLE);
+    }
+
+    // Progress over all the primaries of [first, last), of which those
+    // below done_from were correlated before (a resumed run)
+    const double done_before = traversal_primaries(make_traversal(primaries, first, done_from));
+    s.progress = start_progress(selectionFunction, traversal_primaries(make_traversal(primaries, first, last)), 1, done_before);
+}
 
-    // Return the 
+correlation_run::~correlation_run(){
+    correlation_setup& s = *setup;
+    delete s.progress;
+    if (!s.zero_spread){
+        if (s.wrap){
+            delete[] s.jk_map;
+        } else {
+            free_halo(s);
+        }
+    }
+    delete s.replicas;
+    delete setup;
+}
+
+vector<statistics_with_jk>* correlation_run::correlate(long int first, long int last){
+
+    const correlation_setup& s = *setup;
+    vector<statistics_with_jk> *results = new vector<statistics_with_jk>(s.n_bins);
+    if (s.zero_spread) return results;
+    const halo_traversal t = make_traversal(s.primaries, first, last);
+
+    // Halo-padded kernel fills the same private sums without wrapping
+    // (validation runs both precisions, keeping the mixed results)
+    if (!s.wrap){
+        correlate_halo(s, t, results, false);
+        if (precision_mode==PRECISION_VALIDATE){
+            vector<statistics_with_jk> *results_double = new vector<statistics_with_jk>(s.n_bins);
+            correlate_halo(s, t, results_double, true);
+            report_precision(results, results_double);
+            delete results_double;
+        }
+    } else {
+        correlate_wrap(s, t, results);
+    }
     return results;
 }
 
+// Main correlation method
+vector<statistics_with_jk>* 
+run_correlation(const float* box1, const float* box2, const float* box3, 
+                vector< triangle_configs > *selectionFunction, 
+                int Nres, const vector<long int> *primaries, bool raw){
+
+    const long int Nres3 = long(Nres)*Nres*Nres;
+    correlation_run run(box1, box2, box3, selectionFunction, Nres, primaries, 0, Nres3, 0);
+    vector<statistics_with_jk> *results = run.correlate(0, Nres3);
+
+    // All the stats_JK are subtracted from the total stats values
+    if (!raw) jackknife_complement(results);
+    return results;
+}
+
+
+// Correlation of the primaries of one slab
+vector<statistics_with_jk>* 
+run_correlation_slab(const box_slab& slab, 
+                vector< triangle_configs > *selectionFunction, 
+                int Nres, const vector<long int> *primaries){
+
+    const long int Nres2 = long(Nres)*Nres;
+    const long int first = slab.x0*Nres2, last = (slab.x0 + slab.nx)*Nres2;
+
+    // Regions and halo as for run_correlation (regions of the whole box)
+    assert(slab.halo==max_offset(selectionFunction));
+    correlation_run run(slab.data, slab.data, slab.data, selectionFunction, Nres, primaries, first, last, first, &slab);
+    return run.correlate(first, last);
+}
+
+// Batched correlation of K interleaved auto-correlation fields
+vector< vector<statistics_with_jk>* >*
+run_correlation_batch(const float* boxes, int K,
+                vector< triangle_configs > *selectionFunction, 
+                int Nres, const vector<long int> *primaries){
+
+    int n_bins = selectionFunction->size();
+    long int Nres3 = long(Nres)*Nres*Nres;
+
+    // Results of all fields together, [bin][field] as the accumulators
+    vector<statistics_with_jk> *results = new vector<statistics_with_jk>(n_bins*K);
+
+    // Spread of each field -- a field with no spread gets zeros results,
+    // as from run_correlation
+    vector<float> field_min(boxes, boxes + K), field_max(boxes, boxes + K);
+    for (long int i=0; i<Nres3; i++){
+        for (int b=0; b<K; b++){
+            field_min[b] = std::min(field_min[b], boxes[i*K + b]);
+            field_max[b] = std::max(field_max[b], boxes[i*K + b]);
+        }
+    }
+
+    omp_set_num_threads(global_nthreads);    
+
+    // Regions and halo as for run_correlation
+    const int halo = max_offset(selectionFunction);
+    jk_regions regions = make_jk_regions(Nres, halo);
+    const int Npad = Nres + 2*halo;
+    for (int bin_i=0; bin_i<n_bins; bin_i++){
+        if (selectionFunction->at(bin_i).Npad!=Npad){
+            set_linear_offsets(selectionFunction, Npad);
+            break;
+        }
+    }
+
+    // One padded box of interleaved fields
+    float* pad = halo_pad(boxes, Nres, halo, K);
+    jk_region* jk_pad = (jackknife_N>1) ? jk_region_map(regions, halo) : NULL;
+
+    halo_kernel k;
+    k.n_bins = n_bins;
+    k.Nres = Nres;
+    k.Nres2 = long(Nres)*Nres;
+    k.halo = halo;
+    k.Npad = Npad;
+    k.Npad2 = long(Npad)*Npad;
+    k.log2_Nres = log2_if_pow2(Nres);
+    k.x0 = 0;
+    k.box1 = NULL;
+    k.pad1 = k.pad2 = k.pad3 = pad;
+    k.stored1 = k.stored2 = k.stored3 = pad;
+    k.jk_pad = jk_pad;
+    k.regions = &regions;
+    k.batch = K;
+    k.compensated = false;
+    k.gather_sum = NULL;
+    k.gather_batch = gather_batch_kernel(simd_level);
+    k.selectionFunction = selectionFunction;
+    k.shared = NULL;
+
+    halo_traversal t = make_traversal(primaries, 0, Nres3);
+
+    const bool with_jk = (jackknife_N>1);
+    const bool pow2 = (k.log2_Nres>=0);
+    haloVariantType correlate_variant = batch_variant(with_jk, pow2, K);
+    cout << "      Kernel variant: batch=" << K << " jk=" << with_jk << " pow2=" << pow2 << "\n";
+
+    // Accumulators as for the halo kernel, with n_bins*K "bins"
+    const int n_stats = n_bins*K;
+    vector<statistics*> blocks(omp_get_max_threads());
+    const bool sparse_jk = use_sparse_jackknife(n_stats);
+    const long int n_rows = (sparse_jk or !with_jk) ? 1 : 1 + jackknife_N;
+
+    k.progress = start_progress(selectionFunction,
+        primaries ? primaries->size() : Nres3*(sample_fraction<1.0 ? sample_fraction : 1.0), K);
+
+    numa_replicas* replicas = NULL;
+    const vector<halo_kernel> node_kernels = replicate_kernel(k, k.Npad2*Npad, replicas);
+
+    #pragma omp parallel
+    {
+        statistics* results_pvt = new_accumulators(n_stats, n_rows);
+        jk_accumulators jk(n_stats, n_rows>1 ? results_pvt + n_stats : NULL, results);
+        blocks[omp_get_thread_num()] = results_pvt;
+
+        correlate_variant(replicas ? node_kernels[replicas->node()] : k, t, results_pvt, jk);
+
+        jk.finish();
+        reduce_accumulators(blocks, n_stats, n_rows);
+        store_accumulators(blocks, n_stats, n_rows, results);
+    } //end omp parllel
+    delete k.progress;
+    delete replicas;
+
+    if (!with_jk) single_region(results);
+    jackknife_complement(results);
+
+    // Split into the results of each field
+    vector< vector<statistics_with_jk>* > *results_batch = new vector< vector<statistics_with_jk>* >(K);
+    for (int b=0; b<K; b++){
+        results_batch->at(b) = new vector<statistics_with_jk>(n_bins);
+        if (field_max[b]==field_min[b]){
+            cout << "      Zero spread in field " << b << " of the batch, returning zeros results\n";
+            continue;
+        }
+        for (int bin_i=0; bin_i<n_bins; bin_i++){
+            results_batch->at(b)->at(bin_i) = results->at(bin_i*K + b);
+        }
+    }
+
+    delete results;
+    delete[] pad;
+    delete[] jk_pad;
+    return results_batch;
+}
+
 
 // Pad a double value to 22 chars
 // char* pad(double value, int length=22){
@@ -317,12 +1841,19 @@ run_correlation(const float* box1, const float* box2, const float* box3,
 //     return s;
 // }
 
-void save(vector<statistics_with_jk> *results, estimatorFunctionType estimator, vector< triangle_configs > *selectionFunction, const char *outputfilename){
+void save(vector<statistics_with_jk> *results, estimatorFunctionType estimator, vector< triangle_configs > *selectionFunction, const char *outputfilename, const vector<string> *comments){
 
     // Save the correlation results into the specified folder
     ofstream save_file_id(outputfilename);
     if (save_file_id){ 
 
+        // Comment lines first
+        if (comments){
+            for (int c=0; c<(int)comments->size(); c++){
+                save_file_id << comments->at(c) << "\n";
+            }
+        }
+
         // Add header row
         save_file_id.fill(' ');
         save_file_id << setw(22) << left << "# R1_avg";
@@ -386,4 +1917,97 @@ void save(vector<statistics_with_jk> *results, estimatorFunctionType estimator,
     }     
 }
 
+// Partial files start with this (and a version)
+static const char partial_magic[8] = {'C','3','P','A','R','T','0','4'};
+
+partial_header make_partial_header(int Nres, float L, int n_bins, int shard, int n_shards,
+                                   uint64_t verts_hash, uint64_t inputs_hash){
+    partial_header header;
+    memset(&header, 0, sizeof(header));     // padding too, so files are deterministic
+    memcpy(header.magic, partial_magic, sizeof(partial_magic));
+    header.Nres = Nres;
+    header.L = L;
+    header.n_bins = n_bins;
+    header.jackknife_N = jackknife_N;
+    header.jk_layout = jk_layout;
+    header.sample_fraction = sample_fraction;
+    header.sample_seed = sample_seed;
+    header.shard = shard;
+    header.n_shards = n_shards;
+    header.done = shard * (long(Nres)*Nres*Nres) / n_shards;
+    header.verts_hash = verts_hash;
+    header.inputs_hash = inputs_hash;
+    return header;
+}
+
+static const uint64_t fnv_offset = 14695981039346656037ULL;
+static const uint64_t fnv_prime = 1099511628211ULL;
+
+uint64_t file_hash(const char *filename){
+    FILE* file = fopen(filename, "rb");
+    if (file==NULL) return 0;
+    uint64_t hash = fnv_offset;
+    unsigned char buffer[65536];
+    size_t n_read;
+    while ((n_read = fread(buffer, 1, sizeof(buffer), file))>0){
+        for (size_t byte_i=0; byte_i<n_read; byte_i++){
+            hash = (hash ^ buffer[byte_i]) * fnv_prime;
+        }
+    }
+    fclose(file);
+    return hash;
+}
+
+uint64_t string_hash(const string& st){
+    uint64_t hash = fnv_offset;
+    for (size_t char_i=0; char_i<st.length(); char_i++){
+        hash = (hash ^ (unsigned char)st[char_i]) * fnv_prime;
+    }
+    return hash;
+}
 
+// Store the raw sums of a shard, flushed to disk before closing
+bool save_partial(vector<statistics_with_jk> *results, const partial_header& header, const char *partialfilename){
+    FILE* file = fopen(partialfilename, "wb");
+    if (file==NULL){
+        printf("Could not open partial file '%s'\n", partialfilename);
+        return false;
+    }
+    bool written = (fwrite(&header, sizeof(partial_header), 1, file) == 1);
+    for (int bin_i=0; bin_i<(int)results->size() and written; bin_i++){
+        const statistics_with_jk& bin_stats = results->at(bin_i);
+        written = (fwrite(&bin_stats.stats, sizeof(statistics), 1, file) == 1) and
+                  (fwrite(bin_stats.stats_JK.data(), sizeof(statistics), bin_stats.stats_JK.size(), file) == bin_stats.stats_JK.size());
+    }
+    written = written and fflush(file)==0 and fsync(fileno(file))==0;
+    written = (fclose(file)==0) and written;
+    if (!written){
+        printf("  ERROR: could not write partial file '%s'\n", partialfilename);
+    }
+    return written;
+}
+
+// Load the raw sums of a shard, with its header
+vector<statistics_with_jk>* load_partial(const char *partialfilename, partial_header& header){
+    FILE* file = fopen(partialfilename, "rb");
+    if (file==NULL){
+        printf("File does not exist: '%s'\n", partialfilename);
+        exit(1);
+    }
+    if (fread(&header, sizeof(partial_header), 1, file) != 1 or memcmp(header.magic, partial_magic, sizeof(partial_magic))!=0){
+        printf("  Not a partial file: '%s'\n", partialfilename);
+        exit(1);
+    }
+    vector<statistics_with_jk>* results = new vector<statistics_with_jk>(header.n_bins);
+    for (int bin_i=0; bin_i<header.n_bins; bin_i++){
+        statistics_with_jk& bin_stats = results->at(bin_i);
+        bin_stats.stats_JK.resize(header.jackknife_N);
+        if (fread(&bin_stats.stats, sizeof(statistics), 1, file) != 1 or
+            fread(bin_stats.stats_JK.data(), sizeof(statistics), header.jackknife_N, file) != (size_t)header.jackknife_N){
+            printf("  Failed to load bin %d of %d from '%s'\n", bin_i+1, header.n_bins, partialfilename);
+            exit(1);
+        }
+    }
+    fclose(file);
+    return results;
+}
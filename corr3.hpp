@@ -18,6 +18,7 @@ using std::isnan;
 #endif
 
 #include <cstdlib>
+#include <stdint.h>
 
 #include <string.h>
 #include <sys/types.h>
@@ -55,10 +56,26 @@ using std::ofstream;
 #include "cpp_tools/dir_ext.hpp"
 #include "cpp_tools/loop_data.hpp"
 
-// corr3 statistics struct (DDD, DDR, DRR, RRR)
-// And also with jackknifing vector
-struct statistics;
-struct statistics_with_jk;
+#include "globals.hpp"
+
+// Structure for corr3 statistics
+// DDD, DDR, DRR, RRR
+struct statistics{ 
+    double DDD, DDR, DRR, RRR; 
+
+    statistics() : DDD(0.0), DDR(0.0), DRR(0.0), RRR(0.0) {};
+
+    statistics(double _DDD, double _DDR, double _DRR, double _RRR) : 
+                DDD(_DDD), DDR(_DDR), DRR(_DRR), RRR(_RRR) { };
+
+};
+
+// corr3 statistics with jackknifed values
+struct statistics_with_jk{
+    statistics stats;
+    vector<statistics> stats_JK;
+    statistics_with_jk() : stats_JK(jackknife_N) {}
+};
 
 // Operators for corr3 statistics
 // ostream& operator<<(ofstream& os, statistics& s);
@@ -71,13 +88,142 @@ typedef double (*estimatorFunctionType)(statistics&);
 double estimatorLS(statistics& s);
 double estimatorPlain(statistics& s);
 
+// Correlation kernels
+//   KERNEL_WRAP: wraps every vertex with wrap_int (reference)
+//   KERNEL_HALO: periodic halo-padded box, precomputed linear offsets
+//   KERNEL_SHARED: halo kernel, each distinct ptB evaluated once for all bins
+enum kernel_modes { KERNEL_WRAP, KERNEL_HALO, KERNEL_SHARED };
+
+// Order in which the halo kernel visits primaries
+//   TRAVERSE_FLAT:  z fastest over the whole box
+//   TRAVERSE_TILES: cubic tiles (sized for L2) handed to threads
+enum traversal_modes { TRAVERSE_FLAT, TRAVERSE_TILES };
+
+// Accumulation in the halo kernel
+//   PRECISION_DOUBLE:   double throughout (reference)
+//   PRECISION_MIXED:    float partial sums over each ptC list, added
+//                       into Neumaier-compensated double totals
+//   PRECISION_VALIDATE: mixed, also run in double to report the deviation
+enum precision_modes { PRECISION_DOUBLE, PRECISION_MIXED, PRECISION_VALIDATE };
+
+// Tile side that keeps a tile plus its halo in L2
+int auto_tile_size(int halo, int bytes_per_cell);
+
+// Copy box into a periodically padded box of (Nres+2*halo)^3
+// (width > 1 for a box of interleaved fields, see interleave_boxes)
+float* halo_pad(const float* box, int Nres, int halo, int width = 1);
+
+// Pad a slab of n_planes planes (x halo already in the slab, see
+// box_slab) periodically in y and z, to n_planes*(Nres+2*halo)^2
+float* slab_pad(const float* slab, int Nres, int halo, int n_planes);
+
+// Interleave K boxes of Nres^3 into one, voxel-major: field b of
+// voxel i at [i*K + b], the layout of run_correlation_batch
+float* interleave_boxes(const vector<float*>& boxes, int Nres);
+
 // Main correlation method
+// primaries: sorted list of sampled primary indices (see sampling.hpp),
+// or NULL to reject-sample every voxel with sample_fraction
+// raw: keep the sums inside each jackknife region (for partial files),
+// instead of their complements
 vector<statistics_with_jk>* 
 run_correlation(const float* box1, const float* box2, const float* box3, 
 				vector< triangle_configs > *selectionFunction, 
-				int Nres);
+				int Nres, const vector<long int> *primaries = NULL, bool raw = false);
+
+// Planes [x0, x0+nx) of a box, as held by one rank of the MPI engine:
+// data holds nx+2*halo planes of Nres^2, plane j being plane x0-halo+j
+// of the box (periodic), with halo = max_offset of the bins
+struct box_slab{
+    int x0, nx, halo;
+    float* data;
+};
+
+// Raw sums (as run_correlation with raw) over the primaries of a slab,
+// auto-correlation with the halo kernel
+// primaries: sorted list over the whole box, or NULL as above
+vector<statistics_with_jk>* 
+run_correlation_slab(const box_slab& slab, 
+				vector< triangle_configs > *selectionFunction, 
+				int Nres, const vector<long int> *primaries = NULL);
+
+// One correlation set up once (padded fields, jackknife map, NUMA
+// copies and progress) and run over one or more ranges of primaries,
+// e.g. the chunks between checkpoints, giving raw sums for each
+// first, last:  the whole range of primary indices to be correlated
+// done_from:    start of what is left of it (first, unless resumed)
+// slab:         this rank's slab (auto-correlation, halo kernel), or NULL
+struct correlation_setup;
+class correlation_run{
+public:
+    correlation_run(const float* box1, const float* box2, const float* box3,
+                    vector< triangle_configs > *selectionFunction,
+                    int Nres, const vector<long int> *primaries,
+                    long int first, long int last, long int done_from,
+                    const box_slab* slab = NULL);
+    ~correlation_run();
+
+    // Raw sums over the primaries of [first, last), within the range
+    vector<statistics_with_jk>* correlate(long int first, long int last);
+
+private:
+    correlation_setup* setup;
+    correlation_run(const correlation_run&);
+    correlation_run& operator=(const correlation_run&);
+};
+
+// Bytes of the sums run_correlation holds for n_bins bins (all the
+// threads' accumulators and the results), with the current settings
+double accumulator_bytes(int n_bins);
+
+// Subtract each region's sums from the totals (the jackknife samples)
+void jackknife_complement(vector<statistics_with_jk> *results);
+
+// Correlate K auto-correlation fields in one traversal, from a box of
+// interleaved fields (see interleave_boxes), giving K sets of results
+// Each offset and jackknife lookup is shared by the K fields
+vector< vector<statistics_with_jk>* >*
+run_correlation_batch(const float* boxes, int K,
+				vector< triangle_configs > *selectionFunction, 
+				int Nres, const vector<long int> *primaries = NULL);
+
+// Header of a partial file: raw sums over one shard of the primaries,
+// which merge adds up (all shards must agree on everything but shard)
+// Checkpoints are partial files of the primaries below done so far
+// (fields in pairs of 4 bytes and then 8, so there is no padding)
+struct partial_header{
+    char magic[8];
+    int32_t Nres;
+    float L;
+    int32_t n_bins;
+    int32_t jk_layout;
+    int64_t jackknife_N;
+    double sample_fraction;
+    uint64_t sample_seed;
+    int32_t shard, n_shards;    // shard from 1 to n_shards
+    int64_t done;               // sums over the primaries below this voxel
+    uint64_t verts_hash;        // contents of the verts file (see file_hash)
+    uint64_t inputs_hash;       // names and sizes of the input fields
+};
+
+// Fill the header for this run (globals, N, L, shard, bins and inputs),
+// with done at the end of the shard
+partial_header make_partial_header(int Nres, float L, int n_bins, int shard, int n_shards,
+                                   uint64_t verts_hash = 0, uint64_t inputs_hash = 0);
+
+// FNV-1a hash of the contents of a file (0 if it can't be read), or
+// of a string, to tell the partials of different bins or inputs apart
+uint64_t file_hash(const char *filename);
+uint64_t string_hash(const string& st);
+
+// Store / load the raw sums of a shard (header, then for each bin the
+// totals and jackknife_N region sums, as DDD, DDR, DRR, RRR doubles)
+// save_partial returns false if any of it could not be written
+bool save_partial(vector<statistics_with_jk> *results, const partial_header& header, const char *partialfilename);
+vector<statistics_with_jk>* load_partial(const char *partialfilename, partial_header& header);
 
 // Save results to file
-void save(vector<statistics_with_jk> *results, estimatorFunctionType estimator, vector< triangle_configs > *selectionFunction, const char *binfilename);
+// comments: optional lines written above the header (e.g. input fields)
+void save(vector<statistics_with_jk> *results, estimatorFunctionType estimator, vector< triangle_configs > *selectionFunction, const char *binfilename, const vector<string> *comments = NULL);
 
 #endif
\ No newline at end of file
@@ -95,6 +95,29 @@ vector< pair<string,string> >* get_loop_filenames(ArgumentParser parser, string
     return file_pairs;
 }
 
+vector<string>* get_dat_filenames(string directory){
+    /* Sorted list of the .dat files in a directory */
+
+    vector<string> *filenames = new vector<string>();
+    DIR* my_dir = opendir(directory.c_str());
+    if (my_dir==NULL){
+        cout << "  ERROR: cannot open folder " << directory << "\n";
+        cout << "  Method terminates.\n";
+        exit(1);
+    }
+    struct dirent * dp = NULL;
+    while ((dp = readdir(my_dir)) != NULL){
+        string filename_st = dp->d_name;
+        if (has_suffix(filename_st , ".dat.catalog") or !has_suffix(filename_st , ".dat")){
+            continue;
+        }
+        filenames->push_back(join(directory, filename_st));
+    }
+    (void)closedir(my_dir);
+    std::sort(filenames->begin(), filenames->end());
+    return filenames;
+}
+
 float round_float(float d){
   return floor(d + 0.5);
 }
@@ -156,26 +179,28 @@ int get_filename_N_L(string filename, int &N, float &L){
 }
 
 double* load_double_data(string inputfilename, int N){
-    double *box = (double *)malloc(sizeof(double)*(N*N*N));
+    const size_t N3 = size_t(N)*N*N;
+    double *box = (double *)malloc(sizeof(double)*N3);
     FILE* fid = NULL;
     if((fid = fopen(inputfilename.c_str(),"rb"))==NULL) {
         cout << "  Error opening double data file: " << inputfilename << "\n";
         return NULL;
     } else {
-        fread(box, sizeof(double), N*N*N, fid );  
+        fread(box, sizeof(double), N3, fid );  
         fclose(fid);
     }
     return box;
 }
 
 float* load_float_data(string inputfilename, int N){
-    float *box = (float *)malloc(sizeof(float)*(N*N*N));
+    const size_t N3 = size_t(N)*N*N;
+    float *box = (float *)malloc(sizeof(float)*N3);
     FILE* fid = NULL;
     if((fid = fopen(inputfilename.c_str(),"rb"))==NULL) {
         cout << "  Error opening float data file: " << inputfilename << "\n";
         return NULL;
     } else {
-        fread(box, sizeof(float), N*N*N, fid );  
+        fread(box, sizeof(float), N3, fid );  
         fclose(fid);
     }
     return box;
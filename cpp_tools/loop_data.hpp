@@ -4,6 +4,7 @@
 #include <dirent.h>
 #include <fstream>
 #include <cmath>
+#include <algorithm>
 
 #include "dir_ext.hpp"
 #include "string_ext.hpp"
@@ -14,6 +15,8 @@ const static int _FAILURE = -1;
 
 vector< pair<string,string> >* get_loop_filenames(ArgumentParser parser, string output_folder, string output_prefix);
 
+vector<string>* get_dat_filenames(string directory);
+
 int get_filename_N_L(string filename, int &N, float &L);
 
 float* load_float_data(string inputfilename, int N);
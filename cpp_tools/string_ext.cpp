@@ -22,7 +22,7 @@ string descriptive(string filename){
 
 pair<string,string> split_filename(string filename){
     size_t index = filename.find_last_of("/");
-    string dir = filename.substr(0, index); 
+    string dir = (index==string::npos) ? "." : filename.substr(0, index); 
     string basename = filename.substr(index+1, string::npos);
     return make_pair(dir, basename);
 }
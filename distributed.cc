@@ -0,0 +1,240 @@
+/*************************************************************
+  Distributed (MPI) engine: slabs, halo exchange, reduction
+*************************************************************/
+
+#include "distributed.hpp"
+#include "globals.hpp"
+#include "bins.hpp"
+
+// Plane index wrapped into [0, Nres)
+static inline int wrap_plane(int x, int Nres){
+    return ((x % Nres) + Nres) % Nres;
+}
+
+// Rank owning plane x
+static int plane_owner(int x, int n_ranks, int Nres){
+    int rank = int((long(x)*n_ranks)/Nres);
+    while (rank>0 and slab_start(rank, n_ranks, Nres)>x) rank--;
+    while (rank<n_ranks-1 and slab_start(rank+1, n_ranks, Nres)<=x) rank++;
+    return rank;
+}
+
+// Layout of this rank
+rank_layout make_rank_layout(int Nres){
+    rank_layout layout;
+    MPI_Comm_rank(MPI_COMM_WORLD, &layout.rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &layout.n_ranks);
+    if (layout.n_ranks>Nres){
+        cout << "  ERROR: " << layout.n_ranks << " ranks for only " << Nres << " planes\n";
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    layout.x0 = slab_start(layout.rank, layout.n_ranks, Nres);
+    layout.nx = slab_start(layout.rank+1, layout.n_ranks, Nres) - layout.x0;
+    MPI_Comm node_comm;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_size(node_comm, &layout.node_ranks);
+    MPI_Comm_free(&node_comm);
+    return layout;
+}
+
+// Read planes [x0, x0+nx) of the file, as floats
+static void read_planes(string inputfilename, int Nres, int x0, int nx, float* planes){
+
+    const long int Nres2 = long(Nres)*Nres;
+    const long int Nres3 = Nres2*Nres;
+    const long int n_cells = nx*Nres2;
+
+    // Check file size -- make sure correct for double or float
+    std::ifstream::pos_type size = filesize(inputfilename.c_str());
+    const double element_bytes = double(size)/double(Nres3);
+    if (element_bytes!=8.0 and element_bytes!=4.0){
+        cout << "  ERROR: unknown data type (not float or double)\n";
+        cout << "  Mehod terminates.\n";
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    FILE* file = fopen(inputfilename.c_str(), "rb");
+    if (file==NULL){
+        cout << "  ERROR: could not open " << inputfilename << "\n";
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    fseeko(file, off_t(x0*Nres2) * off_t(element_bytes), SEEK_SET);
+    size_t n_read;
+    if (element_bytes==8.0){
+        double* planesD = new double[n_cells];
+        n_read = fread(planesD, sizeof(double), n_cells, file);
+        for (long int i=0; i<n_cells; i++){
+            planes[i] = float(planesD[i]);
+        }
+        delete[] planesD;
+    } else {
+        n_read = fread(planes, sizeof(float), n_cells, file);
+    }
+    fclose(file);
+    if ((long int)n_read!=n_cells){
+        cout << "  ERROR: short read of " << inputfilename << "\n";
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
+
+// Load, normalise and pad this rank's slab
+bool load_slab(string inputfilename, int Nres, string normalisationSt,
+                const rank_layout& layout, int halo, box_slab& slab){
+
+    const long int Nres2 = long(Nres)*Nres;
+    const long int Nres3 = Nres2*Nres;
+    slab.x0 = layout.x0;
+    slab.nx = layout.nx;
+    slab.halo = halo;
+    slab.data = new float[(layout.nx + 2*halo)*Nres2];
+
+    // Own planes go after the low halo
+    float* own = slab.data + halo*Nres2;
+    const long int n_own = layout.nx*Nres2;
+    read_planes(inputfilename, Nres, layout.x0, layout.nx, own);
+
+    // Mean of the whole box, from the sums of every rank
+    long double sums[2] = {0, 0};
+    for (long int i=0; i<n_own; i++){
+        sums[0] += own[i];
+        sums[1] += own[i] * own[i];
+    }
+    MPI_Allreduce(MPI_IN_PLACE, sums, 2, MPI_LONG_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    long double sumdata = sums[0], sumdata_sq = sums[1];
+    long double ave = sumdata / double(Nres3);
+    const bool root = (layout.rank==0);     // whole-box lines once, from rank 0
+    if (root) cout << "      Data mean is " << ave << "\n";
+
+    // Same normalisations as a whole box
+    if ( normalisationSt=="" || normalisationSt=="normOne" || normalisationSt=="normOverdensity" ){
+        if (ave==0.0){
+            if (sumdata_sq==0.0){
+                if (root) cout << "  WARNING: box is all zeros; will give dummy output";
+            } else {
+                if (root) cout << "  ERROR: box ave = 0, but not all zeros, forbiddged for normOne normalisation";
+                delete[] slab.data;
+                slab.data = NULL;
+                return false;
+            }
+        } else if (normalisationSt=="normOverdensity"){
+            for (long int i=0; i<n_own; i++) { own[i] = (own[i]-ave)/ave; }
+        } else {
+            for (long int i=0; i<n_own; i++) { own[i] = (own[i]/ave); }
+        }
+    } else {
+        if (root) cout << "  ERROR: unrecognised normalisation: '" << normalisationSt << "'\n";
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    exchange_halos(slab, Nres, layout);
+    return true;
+}
+
+// Halo exchange: each halo plane comes from the rank owning it (tagged
+// with its place in the receiving slab), so a halo wider than the
+// neighbouring slabs is filled from further ranks
+void exchange_halos(box_slab& slab, int Nres, const rank_layout& layout){
+
+    const long int Nres2 = long(Nres)*Nres;
+    const int halo = slab.halo;
+    const int n_planes = slab.nx + 2*halo;
+    vector<MPI_Request> requests;
+
+    // Receive (or copy) every halo plane of this slab
+    for (int j=0; j<n_planes; j++){
+        if (j>=halo and j<halo+slab.nx) continue;
+        const int x = wrap_plane(slab.x0 - halo + j, Nres);
+        const int owner = plane_owner(x, layout.n_ranks, Nres);
+        if (owner==layout.rank){
+            memcpy(slab.data + j*Nres2, slab.data + (x - slab.x0 + halo)*Nres2, Nres2*sizeof(float));
+        } else {
+            requests.push_back(MPI_Request());
+            MPI_Irecv(slab.data + j*Nres2, Nres2, MPI_FLOAT, owner, j, MPI_COMM_WORLD, &requests.back());
+        }
+    }
+
+    // Send own planes to every other rank whose halo needs them
+    for (int rank=0; rank<layout.n_ranks; rank++){
+        if (rank==layout.rank) continue;
+        const int x0 = slab_start(rank, layout.n_ranks, Nres);
+        const int nx = slab_start(rank+1, layout.n_ranks, Nres) - x0;
+        for (int j=0; j<nx + 2*halo; j++){
+            if (j>=halo and j<halo+nx) continue;
+            const int x = wrap_plane(x0 - halo + j, Nres);
+            if (plane_owner(x, layout.n_ranks, Nres)!=layout.rank) continue;
+            requests.push_back(MPI_Request());
+            MPI_Isend(slab.data + (x - slab.x0 + halo)*Nres2, Nres2, MPI_FLOAT, rank, j, MPI_COMM_WORLD, &requests.back());
+        }
+    }
+
+    MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+}
+
+// Correlate every rank's primaries and add them up
+vector<statistics_with_jk>*
+run_distributed(const box_slab& slab, vector< triangle_configs > *selectionFunction,
+                int Nres, const rank_layout& layout, const vector<long int> *primaries){
+
+    int n_bins = selectionFunction->size();
+
+    // Spread of the whole box -- if no spread, return zeros results
+    const long int n_own = long(slab.nx)*Nres*Nres;
+    const float* own = slab.data + long(slab.halo)*Nres*Nres;
+    float min = *std::min_element(own, own+n_own);
+    float max = *std::max_element(own, own+n_own);
+    MPI_Allreduce(MPI_IN_PLACE, &min, 1, MPI_FLOAT, MPI_MIN, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &max, 1, MPI_FLOAT, MPI_MAX, MPI_COMM_WORLD);
+    if (layout.rank==0){
+        cout << "      Data min is " << min << "\n";
+        cout << "      Data max is " << max << "\n";
+        cout << "      Data range is " << max - min << "\n";
+    }
+    if (max==min){
+        if (layout.rank==0) cout << "      Zero spread in data, returning zeros results\n";
+        return new vector<statistics_with_jk>(n_bins);
+    }
+
+    if (layout.rank==0){
+        cout << "      " << layout.n_ranks << " ranks, rank 0 planes " << slab.x0 << " to " << slab.x0 + slab.nx - 1 << "\n";
+    }
+    vector<statistics_with_jk> *results = run_correlation_slab(slab, selectionFunction, Nres, primaries);
+
+    // Raw sums are additive over ranks; rank 0 takes the complement
+    reduce_results(results);
+    if (layout.rank==0) jackknife_complement(results);
+    return results;
+}
+
+// Reduce the totals and jackknife sums, packed as doubles
+void reduce_results(vector<statistics_with_jk> *results){
+
+    const int n_bins = results->size();
+    const long int per_bin = 4*(1 + jackknife_N);
+    vector<double> packed(n_bins*per_bin);
+    for (int bin_i=0; bin_i<n_bins; bin_i++){
+        double* row = &packed[bin_i*per_bin];
+        for (long int jk_i=-1; jk_i<jackknife_N; jk_i++){
+            const statistics& s = (jk_i<0) ? results->at(bin_i).stats : results->at(bin_i).stats_JK[jk_i];
+            double* cell = row + 4*(jk_i + 1);
+            cell[0] = s.DDD; cell[1] = s.DDR; cell[2] = s.DRR; cell[3] = s.RRR;
+        }
+    }
+
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    if (rank==0){
+        MPI_Reduce(MPI_IN_PLACE, packed.data(), packed.size(), MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    } else {
+        MPI_Reduce(packed.data(), NULL, packed.size(), MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+        return;
+    }
+
+    for (int bin_i=0; bin_i<n_bins; bin_i++){
+        const double* row = &packed[bin_i*per_bin];
+        for (long int jk_i=-1; jk_i<jackknife_N; jk_i++){
+            statistics& s = (jk_i<0) ? results->at(bin_i).stats : results->at(bin_i).stats_JK[jk_i];
+            const double* cell = row + 4*(jk_i + 1);
+            s = statistics(cell[0], cell[1], cell[2], cell[3]);
+        }
+    }
+}
@@ -0,0 +1,50 @@
+/*************************************************************
+  Distributed (MPI) engine
+  The box is split into slabs of x planes, one per rank, each
+  padded with the halo planes of its periodic neighbours; ranks
+  correlate their own primaries and the raw sums are added up
+  on rank 0. Only built into driver_mpi (-D_USEMPI_)
+*************************************************************/
+
+#ifndef __DISTRIBUTED_HPP__
+#define __DISTRIBUTED_HPP__
+
+#include <mpi.h>
+
+#include "corr3.hpp"
+
+// Planes [x0, x0+nx) owned by this rank (as even as possible), and
+// the ranks sharing this rank's node (and its memory)
+struct rank_layout{
+    int rank, n_ranks;
+    int x0, nx;
+    int node_ranks;
+};
+
+// First plane owned by a rank, of Nres planes over n_ranks
+inline int slab_start(int rank, int n_ranks, int Nres){
+    return int(long(rank)*Nres/n_ranks);
+}
+
+// Layout of this rank in MPI_COMM_WORLD (every rank needs a plane)
+rank_layout make_rank_layout(int Nres);
+
+// Load this rank's planes of a float or double box, normalised with
+// the mean of the whole box, then fill the halo planes
+// Returns false if the box can't be normalised (same on every rank)
+bool load_slab(string inputfilename, int Nres, string normalisationSt,
+                const rank_layout& layout, int halo, box_slab& slab);
+
+// Fill the halo planes of the slab from the ranks that own them
+void exchange_halos(box_slab& slab, int Nres, const rank_layout& layout);
+
+// Correlate the primaries of every rank: the jackknifed results on
+// rank 0 (other ranks get their own raw sums)
+vector<statistics_with_jk>*
+run_distributed(const box_slab& slab, vector< triangle_configs > *selectionFunction,
+                int Nres, const rank_layout& layout, const vector<long int> *primaries);
+
+// Add the raw sums of every rank into rank 0's results
+void reduce_results(vector<statistics_with_jk> *results);
+
+#endif
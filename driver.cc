@@ -4,10 +4,46 @@
 
 #include "corr3.hpp"
 #include "globals.hpp"
+#include "gather.hpp"
+#include "multipoles.hpp"
+#include "bispectrum.hpp"
+#include "sampling.hpp"
+#include "jackknife.hpp"
+#include "quantise.hpp"
+#include "calibrate.hpp"
+#include "numa.hpp"
+#include "planner.hpp"
+#ifdef _USEMPI_
+#include "distributed.hpp"
+#endif
 
 long int jackknife_N = 1;
+int jk_layout = JK_CUBES;
+int jk_accumulation = JK_AUTO;
 double sample_fraction = 0.01;
+unsigned long int sample_seed = 0;
 int global_nthreads = 1;
+int kernel_mode = KERNEL_HALO;
+int simd_level = SIMD_SCALAR;
+int traversal_mode = TRAVERSE_FLAT;
+int tile_size = 0;
+int precision_mode = PRECISION_DOUBLE;
+int storage_mode = STORAGE_FLOAT;
+int batch_size = 1;
+int shell_block = 0;
+int numa_mode = NUMA_OFF;
+double progress_interval = 0.0;
+
+// Rank of this process (0 without MPI): only rank 0 writes files
+static int process_rank(){
+#ifdef _USEMPI_
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    return rank;
+#else
+    return 0;
+#endif
+}
 
 // Get the number of threads
 int omp_thread_count() {
@@ -17,9 +53,371 @@ int omp_thread_count() {
     return n;
 }
 
+// Load a box of float or double data and normalise it in place
+// Returns false if the box can't be normalised (file is skipped)
+static bool load_box(string inputfilename, int Nres, string normalisationSt, float* box){
+
+    long int Nres3 = long(Nres)*Nres*Nres;
+
+    // Check file size -- make sure correct for double or float
+    std::ifstream::pos_type size = filesize(inputfilename.c_str());
+    const double element_bytes = double(size)/double(Nres3);
+    if (element_bytes!=8.0 and element_bytes!=4.0){
+        cout << "  ERROR: unknown data type (not float or double)\n";
+        cout << "  Mehod terminates.\n";
+        exit(1);            
+    }
+    FILE* file = fopen(inputfilename.c_str(), "rb");
+    if (file==NULL){
+        cout << "  ERROR: could not open " << inputfilename << "\n";
+        exit(1);
+    }
+
+    // Read in chunks straight into the box, rather than through a
+    // full-size copy (8 GB of doubles at 1024^3, 64 GB at 2048^3);
+    // doubles (python generated data) or floats (simfast / 21cmfast?)
+    // are converted by every thread, so the box's pages are first
+    // touched across the NUMA nodes rather than all on this thread's
+    const long int chunk = 1L << 20;
+    vector<double> chunkD(element_bytes==8.0 ? chunk : 0);
+    vector<float> chunkF(element_bytes==4.0 ? chunk : 0);
+    for (long int first=0; first<Nres3; first+=chunk){
+        const long int n = std::min(chunk, Nres3 - first);
+        size_t n_read;
+        if (element_bytes==8.0){
+            n_read = fread(&chunkD[0], sizeof(double), n, file);
+            #pragma omp parallel for
+            for (long int i=0; i<n; i++) box[first + i] = float(chunkD[i]);
+        } else {
+            n_read = fread(&chunkF[0], sizeof(float), n, file);
+            #pragma omp parallel for
+            for (long int i=0; i<n; i++) box[first + i] = chunkF[i];
+        }
+        if ((long int)n_read!=n){
+            cout << "  ERROR: short read of " << inputfilename << "\n";
+            exit(1);
+        }
+    }
+    fclose(file);
+
+    // Get data mean
+    // cout << "  Taking average... ";
+    long double sumdata = 0;
+    long double sumdata_sq = 0;
+    for (long int i=0; i<Nres3; i++) { 
+        sumdata += box[i]; 
+        sumdata_sq += box[i] * box[i];
+    }
+    long double ave = sumdata / double(Nres3);
+    cout << "      Data mean is " << ave << "\n";
+
+    // Normalise to ( T /<T> ), random field is 1.0 everywhere
+    if ( normalisationSt=="" || normalisationSt=="normOne" ){
+
+        if (ave==0.0){ 
+            if (sumdata_sq==0.0){
+                cout << "  WARNING: box is all zeros; will give dummy output"; 
+            } else {
+                cout << "  ERROR: box ave = 0, but not all zeros, forbiddged for normOne normalisation";                     
+                return false;
+            }
+        } else {
+            #pragma omp parallel for
+            for (long int i=0; i<Nres3; i++) { box[i] = (box[i]/ave); }
+        }
+
+    // Normalise to ( T - <T> ) / <T>
+    } else if (normalisationSt=="normOverdensity"){
+
+        if (ave==0.0){ 
+            if (sumdata_sq==0.0){
+                cout << "  WARNING: box is all zeros; will give dummy output"; 
+            } else {
+                cout << "  ERROR: box ave = 0, but not all zeros, forbiddged for normOne normalisation";                     
+                return false;
+            }
+        } else {
+            #pragma omp parallel for
+            for (long int i=0; i<Nres3; i++) { box[i] = (box[i]-ave)/ave; }
+        }
+
+    } else {
+        cout << "  ERROR: unrecognised normalisation: '" << normalisationSt << "'\n";
+        exit(1);
+    }
+
+    return true;
+}
+
+// Load the field at vertex 2 or 3 of a cross-correlation, which
+// must have the same N and L as the primary field (else NULL)
+static float* load_cross_field(string filename, int Nres, float L, string normalisationSt){
+    int this_Nres = -1; float this_L = -1.0;
+    if (get_filename_N_L(filename, this_Nres, this_L)!=_SUCCESS or Nres!=this_Nres or L!=this_L){
+        cout << "    Different N/L for " << filename << "\n";
+        return NULL;
+    }
+    cout << "      Cross field " << basename(filename) << "\n";
+    float* box = new float[long(Nres)*Nres*Nres];
+    if (!load_box(filename, Nres, normalisationSt, box)){
+        delete[] box;
+        return NULL;
+    }
+    return box;
+}
+
+// Estimator from its command line name (renamed for the output prefix)
+static estimatorFunctionType choose_estimator(string& estimatorSt){
+    estimatorFunctionType estimator = estimatorPlain;                                                   // Default estimator is Landy-Szalay
+    if (estimatorSt=="" || estimatorSt=="plain" || estimatorSt=="Plain"){
+        estimatorSt = "estimatorPlain";
+        estimator = estimatorPlain;
+    } else if (estimatorSt=="LS"){
+        estimatorSt = "estimatorLandaySzalay";
+        estimator = estimatorPlain;
+    } else {
+        cout << "  ERROR: unrecognised estimator: '" << estimatorSt << "'\n";
+        exit(1);
+    }
+    return estimator;
+}
+
+// Partial files of the same run: everything in the header but the shard
+// and done (the seed only matters if primaries were sampled), so the
+// same bins (verts contents) and the same input fields
+static bool same_run(const partial_header& a, const partial_header& b){
+    return a.Nres==b.Nres and a.L==b.L and a.n_bins==b.n_bins and
+           a.verts_hash==b.verts_hash and a.inputs_hash==b.inputs_hash and
+           a.jackknife_N==b.jackknife_N and a.jk_layout==b.jk_layout and
+           a.sample_fraction==b.sample_fraction and
+           (a.sample_fraction>=1.0 or a.sample_seed==b.sample_seed) and
+           a.n_shards==b.n_shards;
+}
+
+// Merge subcommand: add up the partial files of every shard of a run
+// (--shard), then save with the estimator and jackknife errors as an
+// unsharded run would
+//   driver merge -b verts [-e estimator] [-o output] -p partial_files...
+static int merge_main(int argc, const char * argv[]){
+
+    ArgumentParser parser;
+    parser.addArgument("-b", "--vertsfilename", 1, true);
+    parser.addArgument("-p", "--partials", '+', true);
+    parser.addArgument("-e", "--estimator", 1, true);
+    parser.addArgument("-o", "--outputfilename", 1, true);
+    parser.parse(argc, argv);
+
+    // Checked here, so the options can come in any order
+    string vertsfilename = parser.retrieve<string>("vertsfilename");
+    vector<string> partialfilenames = parser.retrieve< vector<string> >("partials");
+    if (vertsfilename.length()==0 or partialfilenames.size()==0){
+        cout << "  ERROR: merge needs -b vertsfilename and -p partial files\n";
+        exit(1);
+    }
+    string estimatorSt = parser.retrieve<string>("estimator");
+    estimatorFunctionType estimator = choose_estimator(estimatorSt);
+
+    // Load every partial, in shard order
+    vector< pair<int, vector<statistics_with_jk>*> > partials;
+    vector<partial_header> headers;
+    for (size_t file_i=0; file_i<partialfilenames.size(); file_i++){
+        partial_header header;
+        vector<statistics_with_jk>* results = load_partial(partialfilenames[file_i].c_str(), header);
+        cout << "  Shard " << header.shard << " of " << header.n_shards << ": " << partialfilenames[file_i] << "\n";
+        if (header.done!=make_partial_header(header.Nres, header.L, header.n_bins, header.shard, header.n_shards).done){
+            cout << "  WARNING: a checkpoint, with only the primaries below voxel " << header.done << "\n";
+        }
+        partials.push_back(std::make_pair(header.shard, results));
+        headers.push_back(header);
+    }
+    std::sort(partials.begin(), partials.end());
+
+    // Shards of one run: everything but the shard must agree
+    const partial_header& first = headers[0];
+    for (size_t file_i=1; file_i<headers.size(); file_i++){
+        const partial_header& header = headers[file_i];
+        if (!same_run(header, first)){
+            cout << "  ERROR: " << partialfilenames[file_i] << " is not from the same run as " << partialfilenames[0] << "\n";
+            exit(1);
+        }
+    }
+    for (size_t file_i=1; file_i<partials.size(); file_i++){
+        if (partials[file_i].first==partials[file_i-1].first){
+            cout << "  ERROR: shard " << partials[file_i].first << " given twice\n";
+            exit(1);
+        }
+    }
+    if ((int)partials.size()!=first.n_shards){
+        cout << "  WARNING: merging " << partials.size() << " of " << first.n_shards << " shards\n";
+    }
+
+    // Bins from the verts file, for save (the file the shards used)
+    if (file_hash(vertsfilename.c_str())!=first.verts_hash){
+        cout << "  ERROR: the partials were not computed with the bins of " << vertsfilename << "\n";
+        exit(1);
+    }
+    jackknife_N = first.jackknife_N;
+    vector< triangle_configs > *selectionFunction = 
+    load_triangle_configs(vertsfilename.c_str(), first.L / first.Nres);
+    if ((int)selectionFunction->size()!=first.n_bins){
+        cout << "  ERROR: " << vertsfilename << " has " << selectionFunction->size();
+        cout << " bins, the partials have " << first.n_bins << "\n";
+        exit(1);
+    }
+
+    // Sum the raw sums, then take the jackknife complements
+    vector<statistics_with_jk>* merged = partials[0].second;
+    for (size_t file_i=1; file_i<partials.size(); file_i++){
+        for (int bin_i=0; bin_i<first.n_bins; bin_i++){
+            statistics_with_jk& into = merged->at(bin_i);
+            statistics_with_jk& from = partials[file_i].second->at(bin_i);
+            into.stats += from.stats;
+            for (int jk_i=0; jk_i<jackknife_N; jk_i++){
+                into.stats_JK.at(jk_i) += from.stats_JK.at(jk_i);
+            }
+        }
+        delete partials[file_i].second;
+    }
+    jackknife_complement(merged);
+
+    // Output named as the unsharded run, unless given
+    string outputfilename = parser.retrieve<string>("outputfilename");
+    if (outputfilename.length()==0){
+        pair<string,string> folder_name = split_filename(partialfilenames[0]);
+        string name = folder_name.second;
+        const size_t prefix_end = name.find('_');
+        if (name.compare(0, 5, "shard")==0 and prefix_end!=string::npos){
+            name = name.substr(prefix_end + 1);
+        }
+        outputfilename = join(folder_name.first, name);
+    }
+    cout << "  Saving merged results to " << outputfilename << "\n";
+    save(merged, estimator, selectionFunction, outputfilename.c_str());
+    delete merged;
+
+    cout << " Finished at " << pretty_time() << "\n";
+    cout << " ------------------------------------------------------------------\n";
+    return 0;
+}
+
 //  Main Method
+// Prefix of the output filenames (records the sample fraction)
+static string output_prefix(bool cross, string estimatorSt, string vertsfilename, string normalisationSt){
+    char prefix[500];
+    sprintf(prefix,"%s_%s_%s_sample%.3f_%s_", cross ? "corr3cross" : "corr3", estimatorSt.c_str(), descriptive(vertsfilename).c_str(), sample_fraction, normalisationSt.c_str());
+    return prefix;
+}
+
+// File the results of one input go to: the output, or the shard's
+// partial file
+static string result_filename(string outputfilename, bool sharded, int shard, int n_shards){
+    if (!sharded) return outputfilename;
+    char shard_prefix[100];
+    sprintf(shard_prefix, "shard%dof%d_", shard, n_shards);
+    return add_filename_prefix(outputfilename, shard_prefix);
+}
+
+// Where a checkpointed correlation writes, and how often
+struct checkpoint_plan{
+    double minutes;             // between checkpoints
+    bool resume;                // continue from the checkpoint if there is one
+    string checkpointfilename;  // raw sums so far (a partial file)
+    string interimfilename;     // estimates so far, empty for none
+};
+
+// Correlation in chunks of primaries (ascending voxel index), saving the
+// raw sums and the position to a checkpoint after each chunk; chunks
+// are sized from the time of the last to take about plan.minutes
+// header: of this file's partials (see make_partial_header)
+// Returns the raw sums if raw, as run_correlation
+static vector<statistics_with_jk>* run_checkpointed(const float* box1, const float* box2, const float* box3,
+                vector< triangle_configs > *selectionFunction, int Nres,
+                const vector<long int> *primaries, partial_header header, bool raw,
+                const checkpoint_plan& plan, estimatorFunctionType estimator, const vector<string> *comments){
+
+    const int n_bins = selectionFunction->size();
+    const long int Nres3 = long(Nres)*Nres*Nres;
+    long int begin, end;
+    shard_range(Nres3, header.shard, header.n_shards, begin, end);
+    long int done = begin;
+
+    // Raw sums so far: from the checkpoint, or zero
+    vector<statistics_with_jk> *results = NULL;
+    if (plan.resume and fileexists(plan.checkpointfilename)){
+        partial_header saved;
+        results = load_partial(plan.checkpointfilename.c_str(), saved);
+        if (!same_run(saved, header) or saved.shard!=header.shard){
+            cout << "  ERROR: " << plan.checkpointfilename << " is not a checkpoint of this run\n";
+            exit(1);
+        }
+        done = saved.done;
+        cout << "\n      Resuming from voxel " << done << " of " << end << "\n";
+    } else {
+        results = new vector<statistics_with_jk>(n_bins);
+    }
+
+    // Padding, jackknife map and progress once for the file, the
+    // kernel once for each chunk
+    correlation_run run(box1, box2, box3, selectionFunction, Nres, primaries, begin, end, done);
+    long int chunk = std::max((end - done)/100, 1L);
+    while (done<end){
+        const long int chunk_end = std::min(done + chunk, end);
+        const double start = omp_get_wtime();
+        vector<statistics_with_jk> *chunk_results = run.correlate(done, chunk_end);
+        const double seconds = omp_get_wtime() - start;
+
+        for (int bin_i=0; bin_i<n_bins; bin_i++){
+            statistics_with_jk& into = results->at(bin_i);
+            statistics_with_jk& from = chunk_results->at(bin_i);
+            into.stats += from.stats;
+            for (int jk_i=0; jk_i<jackknife_N; jk_i++){
+                into.stats_JK.at(jk_i) += from.stats_JK.at(jk_i);
+            }
+        }
+        delete chunk_results;
+        done = chunk_end;
+
+        // Written aside then renamed, so a kill or a failed write (full
+        // disk) never replaces the last checkpoint with half of one
+        header.done = done;
+        string tmpfilename = plan.checkpointfilename + ".tmp";
+        if (!save_partial(results, header, tmpfilename.c_str())){
+            cout << "      WARNING: checkpoint not saved, keeping the previous one\n";
+            remove(tmpfilename.c_str());
+        } else if (rename(tmpfilename.c_str(), plan.checkpointfilename.c_str())!=0){
+            cout << "      WARNING: could not rename " << tmpfilename << " to " << plan.checkpointfilename << "\n";
+        } else {
+            printf("      Checkpoint at voxel %ld of %ld (%.1f%%) at %s\n", done, end,
+                   100.0*(done - begin)/(end - begin), currentTimeTaken().c_str());
+        }
+        fflush(stdout);
+
+        // Estimates and jackknife errors of the primaries so far
+        if (plan.interimfilename.length()>0){
+            vector<statistics_with_jk> interim(*results);
+            jackknife_complement(&interim);
+            save(&interim, estimator, selectionFunction, plan.interimfilename.c_str(), comments);
+        }
+
+        // Next chunk to take about the checkpoint interval
+        const double scale = plan.minutes*60.0 / std::max(seconds, 1e-3);
+        chunk = std::max(long(chunk * std::min(std::max(scale, 0.25), 4.0)), 1L);
+    }
+
+    if (!raw) jackknife_complement(results);
+    return results;
+}
+
 int main( int argc, const char * argv[] ){
 
+    // Distributed engine: every rank runs main, only rank 0 prints
+#ifdef _USEMPI_
+    MPI_Init(NULL, NULL);
+    if (process_rank()>0){
+        if (freopen("/dev/null", "w", stdout)==NULL) exit(1);
+    }
+#endif
+
     cout << "\n ------------------------------------------------------------------\n";
 
     // Feedback start time of script
@@ -28,6 +426,15 @@ int main( int argc, const char * argv[] ){
    // Start script timer
     startTimer();
 
+    // Subcommand: merge the partial files of a sharded run
+    if (argc>1 and string(argv[1])=="merge"){
+        int merge_status = (process_rank()==0) ? merge_main(argc-1, argv+1) : 0;
+#ifdef _USEMPI_
+        MPI_Finalize();
+#endif
+        return merge_status;
+    }
+
     // Command Line arguments parser (short, long, nargs, optional)
     ArgumentParser parser;
     parser.addArgument("-d", "--directory", 1, true);
@@ -39,18 +446,127 @@ int main( int argc, const char * argv[] ){
 
     parser.addArgument("-b", "--vertsfilename", 1, false);    
 
+    parser.addArgument("--field2", 1, true);
+    parser.addArgument("--field3", 1, true);
+
     parser.addArgument("-s", "--sample_fraction", 1, true);
+    parser.addArgument("-r", "--seed", 1, true);
+    parser.addArgument("--samplesfilename", 1, true);
+    parser.addArgument("--time_budget", 1, true);
+    parser.addArgument("--calibrate", 1, true);
+    parser.addArgument("--shard", 1, true);
+    parser.addArgument("--checkpoint", 1, true);
+    parser.addArgument("--resume", 1, true);
+    parser.addArgument("--interim", 1, true);
+
+    parser.addArgument("-j", "--jackknife", 1, true);
+    parser.addArgument("--jk_regions", 1, true);
+    parser.addArgument("--jk_accumulate", 1, true);
+
+    parser.addArgument("--symmetry", 1, true);
 
     parser.addArgument("-N", "--resolution", 1, true);
     parser.addArgument("-L", "--length", 1, true);
 
+    parser.addArgument("-k", "--kernel", 1, true);
+    parser.addArgument("-v", "--simd", 1, true);
+    parser.addArgument("-t", "--traversal", 1, true);
+    parser.addArgument("--tile_size", 1, true);
+    parser.addArgument("--batch", 1, true);
+    parser.addArgument("--precision", 1, true);
+    parser.addArgument("--storage", 1, true);
+    parser.addArgument("--progress", 1, true);
+    parser.addArgument("--threads", 1, true);
+    parser.addArgument("--pin", 1, true);
+    parser.addArgument("--numa", 1, true);
+    parser.addArgument("--memory_limit", 1, true);
+    parser.addArgument("--memory_plan", 1, true);
+
+    parser.addArgument("-g", "--engine", 1, true);
+    parser.addArgument("--lmax", 1, true);
+    parser.addArgument("--kbinsfilename", 1, true);
+
     parser.parse(argc, argv);
 
-    // Set number of threads
+    // Set number of threads (all that OpenMP offers, unless --threads)
     global_nthreads = omp_thread_count();
+    string threads_st = parser.retrieve<string>("threads");
+    if (threads_st.length()>0){
+        global_nthreads = atoi(threads_st.c_str());
+        if (global_nthreads<1){
+            cout << "  ERROR: invalid threads " << threads_st << "\n";
+            exit(1);
+        }
+    }
     cout << "  global_nthreads=" << global_nthreads << "\n";
     omp_set_num_threads(global_nthreads);
 
+    // Copy the read-only fields onto each NUMA node for the kernels
+    string numaSt = parser.retrieve<string>("numa");
+    if (numaSt=="" || numaSt=="off"){
+        numa_mode = NUMA_OFF;
+    } else if (numaSt=="replicate"){
+        numa_mode = NUMA_REPLICATE;
+        if (numa_node_count()<2){
+            cout << "  One NUMA node, fields are not replicated\n";
+        }
+    } else {
+        cout << "  ERROR: unrecognised numa: '" << numaSt << "'\n";
+        exit(1);
+    }
+
+    // Pin the threads to CPUs (spread over the nodes by default when
+    // replicating, so each thread stays by its copy, unless OpenMP
+    // already binds them)
+    string pinSt = parser.retrieve<string>("pin");
+    int pin_mode = PIN_OFF;
+    if (pinSt==""){
+        pin_mode = (numa_mode==NUMA_REPLICATE and getenv("OMP_PROC_BIND")==NULL) ? PIN_SPREAD : PIN_OFF;
+    } else if (pinSt=="off"){
+        pin_mode = PIN_OFF;
+    } else if (pinSt=="compact"){
+        pin_mode = PIN_COMPACT;
+    } else if (pinSt=="spread"){
+        pin_mode = PIN_SPREAD;
+    } else {
+        cout << "  ERROR: unrecognised pin: '" << pinSt << "'\n";
+        exit(1);
+    }
+    if (pin_mode!=PIN_OFF){
+        const int n_nodes = pin_threads(pin_mode);
+        if (n_nodes==0){
+            cout << "  WARNING: could not pin the threads\n";
+        } else {
+            cout << "  Pinned threads (" << (pin_mode==PIN_COMPACT ? "compact" : "spread");
+            cout << ") over " << n_nodes << " NUMA node" << (n_nodes>1 ? "s\n" : "\n");
+        }
+    }
+
+    // Expected peak memory against --memory_limit (GB per process, by
+    // default what is free): adapt the settings until it fits, refuse
+    // to run, or only report it
+    string memory_planSt = parser.retrieve<string>("memory_plan");
+    int plan_mode = PLAN_ADAPT;
+    if (memory_planSt=="" || memory_planSt=="adapt"){
+        plan_mode = PLAN_ADAPT;
+    } else if (memory_planSt=="refuse"){
+        plan_mode = PLAN_REFUSE;
+    } else if (memory_planSt=="off"){
+        plan_mode = PLAN_OFF;
+    } else {
+        cout << "  ERROR: unrecognised memory_plan: '" << memory_planSt << "'\n";
+        exit(1);
+    }
+    double memory_limit = 0.0;
+    string memory_limit_st = parser.retrieve<string>("memory_limit");
+    if (memory_limit_st.length()>0){
+        memory_limit = atof(memory_limit_st.c_str()) * 1024.0*1024.0*1024.0;
+        if (memory_limit<=0.0){
+            cout << "  ERROR: invalid memory limit " << memory_limit_st << " GB\n";
+            exit(1);
+        }
+    }
+
     // Set sample fraction
     string sample_fraction_st = parser.retrieve<string>("sample_fraction");
     if (sample_fraction_st.length()>0){
@@ -66,27 +582,275 @@ int main( int argc, const char * argv[] ){
         cout << "  reducing sample_fraction from " << sample_fraction;
         sample_fraction = 1.0;
         cout << " to " << sample_fraction << "\n";
-    } else {
+    } else if (parser.retrieve<string>("time_budget").length()==0){
         cout << "  sample_fraction=" << sample_fraction << "\n";
     }
 
+    // Or the sample fraction that fits each file in --time_budget
+    // minutes at the calibrated speed (chosen once the bins are loaded)
+    double time_budget = 0.0;
+    string time_budget_st = parser.retrieve<string>("time_budget");
+    if (time_budget_st.length()>0){
+        time_budget = atof(time_budget_st.c_str());
+        if (time_budget<=0.0 or sample_fraction_st.length()>0){
+            cout << "  ERROR: --time_budget needs a positive number of minutes, and no --sample_fraction\n";
+            exit(1);
+        }
+        sample_fraction = 1.0;
+    }
+
+    // Speed of the kernel: measured at startup (cached per host, CPU
+    // and settings), or guessed from the thread count
+    string calibrateSt = parser.retrieve<string>("calibrate");
+    int calibrate_mode = CALIBRATE_AUTO;
+    if (calibrateSt=="" || calibrateSt=="auto"){
+        calibrate_mode = CALIBRATE_AUTO;
+    } else if (calibrateSt=="force"){
+        calibrate_mode = CALIBRATE_FORCE;
+    } else if (calibrateSt=="off"){
+        calibrate_mode = CALIBRATE_OFF;
+    } else {
+        cout << "  ERROR: unrecognised calibrate: '" << calibrateSt << "'\n";
+        exit(1);
+    }
+#ifdef _USEMPI_
+    calibrate_mode = CALIBRATE_OFF;     // would need the whole box on a rank
+#endif
+    if (time_budget>0.0 and calibrate_mode==CALIBRATE_OFF){
+        cout << "  ERROR: --time_budget needs the calibrated speed (not --calibrate off, or MPI)\n";
+        exit(1);
+    }
+
+    // Number and shape of jackknife regions
+    // (cubes by default, slabs if jackknife_N isn't a cube number)
+    string jackknife_st = parser.retrieve<string>("jackknife");
+    if (jackknife_st.length()>0){
+        jackknife_N = atol(jackknife_st.c_str());
+    }
+    if (jackknife_N<1){
+        cout << "  ERROR: invalid jackknife " << jackknife_N << "\n";
+        exit(1);
+    }
+    string jkRegionsSt = parser.retrieve<string>("jk_regions");
+    long int jk_per_side = lround(cbrt(double(jackknife_N)));
+    if (jkRegionsSt==""){
+        jk_layout = (jk_per_side*jk_per_side*jk_per_side==jackknife_N) ? JK_CUBES : JK_SLABS;
+    } else if (jkRegionsSt=="cubes"){
+        jk_layout = JK_CUBES;
+    } else if (jkRegionsSt=="slabs"){
+        jk_layout = JK_SLABS;
+    } else {
+        cout << "  ERROR: unrecognised jk_regions: '" << jkRegionsSt << "'\n";
+        exit(1);
+    }
+    string jkAccumulateSt = parser.retrieve<string>("jk_accumulate");
+    if (jkAccumulateSt=="" || jkAccumulateSt=="auto"){
+        jk_accumulation = JK_AUTO;
+    } else if (jkAccumulateSt=="dense"){
+        jk_accumulation = JK_DENSE;
+    } else if (jkAccumulateSt=="sparse"){
+        jk_accumulation = JK_SPARSE;
+    } else {
+        cout << "  ERROR: unrecognised jk_accumulate: '" << jkAccumulateSt << "'\n";
+        exit(1);
+    }
+    if (jackknife_N>1){
+        cout << "  jackknife_N=" << jackknife_N << (jk_layout==JK_CUBES ? " cubes\n" : " slabs\n");
+    }
+
+    // Choose correlation kernel
+    string kernelSt = parser.retrieve<string>("kernel");
+    if (kernelSt=="" || kernelSt=="halo"){
+        kernel_mode = KERNEL_HALO;
+        cout << "  Using halo-padded kernel\n";
+    } else if (kernelSt=="shared"){
+        kernel_mode = KERNEL_SHARED;
+        cout << "  Using halo-padded kernel with shared ptB offsets\n";
+    } else if (kernelSt=="wrap"){
+        kernel_mode = KERNEL_WRAP;
+        cout << "  Using wrapping kernel\n";
+    } else {
+        cout << "  ERROR: unrecognised kernel: '" << kernelSt << "'\n";
+        exit(1);
+    }
+
+    // Choose instruction set for the ptC loop (default: best from CPUID)
+    string simdSt = parser.retrieve<string>("simd");
+    if (simdSt=="" || simdSt=="auto"){
+        simd_level = detect_simd_level();
+    } else if (simdSt=="avx512"){
+        simd_level = SIMD_AVX512;
+    } else if (simdSt=="avx2"){
+        simd_level = SIMD_AVX2;
+    } else if (simdSt=="scalar"){
+        simd_level = SIMD_SCALAR;
+    } else {
+        cout << "  ERROR: unrecognised simd: '" << simdSt << "'\n";
+        exit(1);
+    }
+    if (simd_level>detect_simd_level()){
+        cout << "  WARNING: " << simd_level_name(simd_level) << " not supported by this CPU\n";
+        simd_level = detect_simd_level();
+    }
+    if (kernel_mode!=KERNEL_WRAP){
+        cout << "  Using " << simd_level_name(simd_level) << " gather for the ptC loop\n";
+    }
+
+    // Choose order of primaries (tiles only apply to the halo kernel)
+    string traversalSt = parser.retrieve<string>("traversal");
+    if (traversalSt=="" || traversalSt=="flat"){
+        traversal_mode = TRAVERSE_FLAT;
+    } else if (traversalSt=="tiles"){
+        traversal_mode = TRAVERSE_TILES;
+        if (kernel_mode==KERNEL_WRAP){
+            cout << "  WARNING: tiled traversal needs the halo kernel, using flat\n";
+            traversal_mode = TRAVERSE_FLAT;
+        }
+    } else {
+        cout << "  ERROR: unrecognised traversal: '" << traversalSt << "'\n";
+        exit(1);
+    }
+    string tile_size_st = parser.retrieve<string>("tile_size");
+    if (tile_size_st.length()>0){
+        tile_size = atoi(tile_size_st.c_str());
+    }
+
+    // Accumulation: double, or float partial sums with compensated
+    // totals (mixed), or mixed checked against double (validate)
+    string precisionSt = parser.retrieve<string>("precision");
+    if (precisionSt=="" || precisionSt=="double"){
+        precision_mode = PRECISION_DOUBLE;
+    } else if (precisionSt=="mixed" || precisionSt=="validate"){
+        precision_mode = (precisionSt=="mixed") ? PRECISION_MIXED : PRECISION_VALIDATE;
+        if (kernel_mode==KERNEL_WRAP){
+            cout << "  WARNING: the wrap kernel always accumulates in double\n";
+        } else {
+            cout << "  Using " << precisionSt << " precision accumulation\n";
+        }
+    } else {
+        cout << "  ERROR: unrecognised precision: '" << precisionSt << "'\n";
+        exit(1);
+    }
+
+    // Storage of the padded fields: floats, or quantised int16 / int8
+    // codes with a scale and offset per box (halo kernels only)
+    string storageSt = parser.retrieve<string>("storage");
+    if (storageSt=="" || storageSt=="float"){
+        storage_mode = STORAGE_FLOAT;
+    } else if (storageSt=="int16" || storageSt=="int8"){
+        storage_mode = (storageSt=="int16") ? STORAGE_INT16 : STORAGE_INT8;
+        if (kernel_mode==KERNEL_WRAP){
+            cout << "  WARNING: the wrap kernel always reads floats\n";
+        } else {
+            cout << "  Storing fields as " << storageSt << "\n";
+        }
+    } else {
+        cout << "  ERROR: unrecognised storage: '" << storageSt << "'\n";
+        exit(1);
+    }
+
+    // Live progress of the direct kernels every --progress seconds
+    string progress_st = parser.retrieve<string>("progress");
+    if (progress_st.length()>0){
+        progress_interval = atof(progress_st.c_str());
+        if (progress_interval<0.0){
+            cout << "  ERROR: invalid progress interval " << progress_interval << "\n";
+            exit(1);
+        }
+    }
+
+    // Choose engine: direct triangle sums, or FFT multipoles
+    string engineSt = parser.retrieve<string>("engine");
+    int lmax = 10;
+    if (engineSt=="" || engineSt=="direct"){
+        engineSt = "direct";
+    } else if (engineSt=="multipoles"){
+        string lmax_st = parser.retrieve<string>("lmax");
+        if (lmax_st.length()>0){
+            lmax = atoi(lmax_st.c_str());
+        }
+        cout << "  Using FFT multipoles engine with lmax=" << lmax << "\n";
+
+        // Every voxel, and no jackknife regions (the sums are not split)
+        if (jackknife_N>1 or time_budget>0.0 or (sample_fraction_st.length()>0 and sample_fraction<1.0)){
+            cout << "  ERROR: the multipoles engine needs every primary and no jackknife\n";
+            cout << "  (no -j above 1, -s below 1 or --time_budget)\n";
+            exit(1);
+        }
+        sample_fraction = 1.0;
+        fftwf_init_threads();
+    } else {
+        cout << "  ERROR: unrecognised engine: '" << engineSt << "'\n";
+        exit(1);
+    }
+
+    // Auto-correlation: evaluate each triangle and its ptB<->ptC swap once
+    string symmetrySt = parser.retrieve<string>("symmetry");
+    bool use_symmetry = false;
+    if (symmetrySt=="" || symmetrySt=="off"){
+        use_symmetry = false;
+    } else if (symmetrySt=="on"){
+        use_symmetry = (engineSt=="direct");
+    } else {
+        cout << "  ERROR: unrecognised symmetry: '" << symmetrySt << "'\n";
+        exit(1);
+    }
+
+    // Also run the bispectrum of every box, if given k bins
+    string kbinsfilename = parser.retrieve<string>("kbinsfilename");
+    vector<kbin_triangle> *kbins = NULL;
+    if (kbinsfilename.length()>0){
+        kbins = load_kbin_triangles(kbinsfilename.c_str());
+        cout << "  Will also run bispectrum for " << kbins->size() << " k triangles\n";
+        if (engineSt!="multipoles") fftwf_init_threads();
+    }
+
+    // Seed for sampling primaries (from the clock if not given)
+    string seed_st = parser.retrieve<string>("seed");
+    if (seed_st.length()>0){
+        sample_seed = strtoul(seed_st.c_str(), NULL, 10);
+    } else {
+        sample_seed = (unsigned long int)time(NULL);
+    }
+#ifdef _USEMPI_
+    MPI_Bcast(&sample_seed, 1, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD);
+#endif
+
+    // An existing --samplesfilename fixes the fraction and seed (those
+    // it was drawn with, which -s and --seed must match if given), so
+    // the output names and partial headers record them
+    string samplesfilename = parser.retrieve<string>("samplesfilename");
+    if (engineSt=="direct" and samplesfilename.length()>0 and fileexists(samplesfilename)){
+        samples_header drawn;
+        if (!read_samples_header(samplesfilename.c_str(), drawn)){
+            cout << "  ERROR: " << samplesfilename << " is not a samples file (or one without its fraction and seed)\n";
+            exit(1);
+        }
+        if ((sample_fraction_st.length()>0 and sample_fraction!=drawn.fraction) or
+            (seed_st.length()>0 and sample_seed!=drawn.seed)){
+            cout << "  ERROR: " << samplesfilename << " was drawn with sample_fraction=" << drawn.fraction
+                 << " and seed=" << drawn.seed << ", not as requested\n";
+            exit(1);
+        }
+        if (time_budget>0.0){
+            cout << "  --time_budget not applied, the samples file sets the fraction\n";
+            time_budget = 0.0;
+        }
+        sample_fraction = drawn.fraction;
+        sample_seed = drawn.seed;
+        cout << "  sample_fraction=" << sample_fraction << " of " << samplesfilename << "\n";
+    }
+    if (sample_fraction<1.0){
+        cout << "  seed=" << sample_seed << "\n";
+    }
+
     // Bin filename from command line args
     string vertsfilename = parser.retrieve<string>("vertsfilename");
     string directory = parser.retrieve<string>("directory");
 
     // Choose estimator (converts DD, DR etc into corr3)
     string estimatorSt = parser.retrieve<string>("estimator");
-    estimatorFunctionType estimator = estimatorPlain;                                                   // Default estimator is Landy-Szalay
-    if (estimatorSt=="" || estimatorSt=="plain" || estimatorSt=="Plain"){
-        estimatorSt = "estimatorPlain";
-        estimator = estimatorPlain;
-    } else if (estimatorSt=="LS"){
-        estimatorSt = "estimatorLandaySzalay";
-        estimator = estimatorPlain;
-    } else {
-        cout << "  ERROR: unrecognised estimator: '" << estimatorSt << "'\n";
-        exit(1);
-    }
+    estimatorFunctionType estimator = choose_estimator(estimatorSt);
 
     // Choose normalisation type
     string normalisationSt = parser.retrieve<string>("normalisation");
@@ -101,9 +865,139 @@ int main( int argc, const char * argv[] ){
         exit(1);
     }
 
+    // Cross-correlation: fields at the ptB (field2) and ptC (field3)
+    // vertices, the primary field coming from -i / -d as usual
+    // field3 defaults to field2, so two fields need only --field2
+    string field2St = parser.retrieve<string>("field2");
+    string field3St = parser.retrieve<string>("field3");
+    bool cross = (field2St.length()>0 or field3St.length()>0);
+    if (cross){
+        if (field2St.length()==0){
+            cout << "  ERROR: --field3 given without --field2\n";
+            exit(1);
+        }
+        if (field3St.length()==0){
+            field3St = field2St;
+        }
+        if (engineSt!="direct" or kbins){
+            cout << "  ERROR: cross-correlation needs the direct engine (and no kbinsfilename)\n";
+            exit(1);
+        }
+        if (use_symmetry and field3St!=field2St){
+            cout << "  WARNING: symmetry needs the same field at ptB and ptC, turning off\n";
+            use_symmetry = false;
+        }
+        cout << "  Cross-correlating with field2=" << field2St << " field3=" << field3St << "\n";
+    }
+
+    // Batch of realisations correlated in one traversal (same N and L,
+    // auto-correlation, direct engine)
+    string batch_st = parser.retrieve<string>("batch");
+    if (batch_st.length()>0){
+        batch_size = atoi(batch_st.c_str());
+        if (batch_size<1){
+            cout << "  ERROR: invalid batch size " << batch_size << "\n";
+            exit(1);
+        }
+    }
+    if (batch_size>1){
+        if (engineSt!="direct" or cross){
+            cout << "  ERROR: batches need the direct engine, without --field2/--field3\n";
+            exit(1);
+        }
+        cout << "  Correlating batches of " << batch_size << " files";
+        cout << " (halo kernel, flat traversal)\n";
+        if (precision_mode!=PRECISION_DOUBLE or storage_mode!=STORAGE_FLOAT){
+            cout << "  WARNING: batches always read floats and accumulate in double\n";
+        }
+    }
+
+    // Shard k of n: only the k-th of n disjoint ranges of primaries, with
+    // the raw sums saved to a partial file for "driver merge"
+    // (every shard must draw the same sampled primaries)
+    int shard = 1, n_shards = 1;
+    string shardSt = parser.retrieve<string>("shard");
+    const bool sharded = (shardSt.length()>0);
+    if (sharded){
+        if (sscanf(shardSt.c_str(), "%d/%d", &shard, &n_shards)!=2 or shard<1 or shard>n_shards){
+            cout << "  ERROR: invalid shard '" << shardSt << "' (k/n, with k from 1 to n)\n";
+            exit(1);
+        }
+        if (engineSt!="direct" or batch_size>1 or kbins){
+            cout << "  ERROR: shards need the direct engine, without --batch or kbinsfilename\n";
+            exit(1);
+        }
+        if ((sample_fraction<1.0 or time_budget>0.0) and seed_st.length()==0 and parser.retrieve<string>("samplesfilename").length()==0){
+            cout << "  ERROR: sampled shards need --seed or --samplesfilename, to share the primaries\n";
+            exit(1);
+        }
+        cout << "  Shard " << shard << " of " << n_shards << "\n";
+    }
+
+    // Checkpoints of the raw sums and the position in the primaries every
+    // --checkpoint minutes, next to the output; --resume on continues
+    // from them (and skips files already saved), --interim on also saves
+    // the estimates so far at every checkpoint
+    checkpoint_plan plan;
+    plan.minutes = 0.0;
+    string checkpointSt = parser.retrieve<string>("checkpoint");
+    if (checkpointSt.length()>0){
+        plan.minutes = atof(checkpointSt.c_str());
+        if (plan.minutes<=0.0){
+            cout << "  ERROR: invalid checkpoint interval " << checkpointSt << " (minutes)\n";
+            exit(1);
+        }
+    }
+    string resumeSt = parser.retrieve<string>("resume");
+    if (resumeSt=="" || resumeSt=="off"){
+        plan.resume = false;
+    } else if (resumeSt=="on"){
+        plan.resume = true;
+    } else {
+        cout << "  ERROR: unrecognised resume: '" << resumeSt << "'\n";
+        exit(1);
+    }
+    string interimSt = parser.retrieve<string>("interim");
+    bool interim = false;
+    if (interimSt=="" || interimSt=="off"){
+        interim = false;
+    } else if (interimSt=="on"){
+        interim = true;
+    } else {
+        cout << "  ERROR: unrecognised interim: '" << interimSt << "'\n";
+        exit(1);
+    }
+    if ((plan.resume or interim) and plan.minutes==0.0){
+        plan.minutes = 60.0;
+    }
+    const bool checkpointed = (plan.minutes>0.0);
+    if (checkpointed){
+        if (engineSt!="direct" or batch_size>1){
+            cout << "  ERROR: checkpoints need the direct engine, without --batch\n";
+            exit(1);
+        }
+        if ((sample_fraction<1.0 or time_budget>0.0) and seed_st.length()==0 and parser.retrieve<string>("samplesfilename").length()==0){
+            cout << "  ERROR: sampled checkpoints need --seed or --samplesfilename, to resume with the same primaries\n";
+            exit(1);
+        }
+        cout << "  Checkpoint every " << plan.minutes << " minutes";
+        cout << (plan.resume ? ", resuming" : "") << (interim ? ", with interim results" : "") << "\n";
+    }
+
+    // Distributed engine: slabs of the box over the MPI ranks
+#ifdef _USEMPI_
+    if (engineSt!="direct" or kernel_mode==KERNEL_WRAP or cross or batch_size>1 or sharded or checkpointed or kbins){
+        cout << "  ERROR: the MPI engine needs the direct engine and a halo kernel, without\n";
+        cout << "  --field2/--field3, --batch, --shard, checkpoints or kbinsfilename\n";
+        exit(1);
+    }
+    if (traversal_mode==TRAVERSE_TILES){
+        cout << "  WARNING: each rank traverses its slab flat\n";
+    }
+#endif
+
     // Add bin filename to output filenam
-    char prefix[500];
-    sprintf(prefix,"%s_%s_%s_sample%.3f_%s_","corr3", estimatorSt.c_str(), descriptive(vertsfilename).c_str(), sample_fraction, normalisationSt.c_str());
+    string prefix = output_prefix(cross, estimatorSt, vertsfilename, normalisationSt);
 
     // Get input -> output filenames
     vector< pair<string,string> > *file_pairs = get_loop_filenames(parser, "corr3", prefix);
@@ -114,6 +1008,25 @@ int main( int argc, const char * argv[] ){
         cout << "  No files found.\n  Method Terminates.\n";        
     }
 
+    // Field files for vertices 2 and 3, one per primary file
+    // (folder mode: the folders are paired file by file in sorted order)
+    vector<string> *field2_files = NULL, *field3_files = NULL;
+    if (cross){
+        if (parser.retrieve<string>("directory").length()>0){
+            std::sort(file_pairs->begin(), file_pairs->end());
+            field2_files = get_dat_filenames(field2St);
+            field3_files = get_dat_filenames(field3St);
+        } else {
+            field2_files = new vector<string>(1, field2St);
+            field3_files = new vector<string>(1, field3St);
+        }
+        if (field2_files->size()!=file_pairs->size() or field3_files->size()!=file_pairs->size()){
+            cout << "  ERROR: " << file_pairs->size() << " primary files but ";
+            cout << field2_files->size() << " field2 and " << field3_files->size() << " field3 files\n";
+            exit(1);
+        }
+    }
+
     // Extract Nres and L from first filename, if not given
     int Nres = -1; 
     float L = -1.0;
@@ -143,8 +1056,8 @@ int main( int argc, const char * argv[] ){
     }
 
     // Store Nres powers and cell size
-    int Nres2 = Nres*Nres;
-    int Nres3 = Nres*Nres*Nres;
+    const long int Nres2 = long(Nres)*Nres;
+    const long int Nres3 = Nres2*Nres;
     float cell_size = float(L) / float(Nres);
 
     // NEW METHOD: load explicit triangle vertices
@@ -152,119 +1065,335 @@ int main( int argc, const char * argv[] ){
     vector< triangle_configs > *selectionFunction = 
     load_triangle_configs(vertsfilename.c_str(), cell_size);
     cout << "done\n";
+    const uint64_t verts_hash = file_hash(vertsfilename.c_str());
+
+    // Merge swapped triangles (before the offsets are computed)
+    if (use_symmetry){
+        canonicalise_triangle_configs(selectionFunction);
+    }
+
+    // Precompute the linear offsets into the halo-padded box
+    if (kernel_mode!=KERNEL_WRAP){
+        int halo = max_offset(selectionFunction);
+        set_linear_offsets(selectionFunction, Nres + 2*halo);
+        cout << "  Halo of " << halo << " cells\n";
+    }
+
+#ifdef _USEMPI_
+    const int halo = max_offset(selectionFunction);
+    rank_layout layout = make_rank_layout(Nres);
+    cout << "  " << layout.n_ranks << " MPI ranks, slabs of ~" << Nres/layout.n_ranks << " planes\n";
+    const int nx = layout.nx;
+    const bool can_wrap = false;
+    if (memory_limit_st.length()==0) memory_limit = available_memory() / layout.node_ranks;
+#else
+    const int nx = Nres;
+    const bool can_wrap = (engineSt=="direct");
+    if (memory_limit_st.length()==0) memory_limit = available_memory();
+#endif
+
+    // Plan the memory of the run, giving up speed for memory in turn
+    // (copies per NUMA node, batches, dense jackknife rows, multipoles
+    // shells held at once, then the padded fields) until it fits
+    const int n_fields = cross ? 2 + (field3St!=field2St) : 1;
+    memory_plan mplan = plan_memory(selectionFunction, Nres, n_fields, nx, engineSt=="multipoles", kbins);
+    while (plan_mode==PLAN_ADAPT and memory_limit>0.0 and mplan.peak()>memory_limit){
+        if (mplan.replicas>0.0){
+            numa_mode = NUMA_OFF;
+            cout << "  Memory: fields not replicated over the NUMA nodes\n";
+        } else if (batch_size>1){
+            batch_size = 1;
+            cout << "  Memory: correlating one file at a time\n";
+        } else if (engineSt=="direct" and jackknife_N>1 and jk_accumulation!=JK_SPARSE){
+            jk_accumulation = JK_SPARSE;
+            cout << "  Memory: sparse jackknife accumulators\n";
+        } else if (engineSt=="multipoles" and multipole_shells_held(selectionFunction->size())>1){
+            shell_block = multipole_shells_held(selectionFunction->size())/2;
+            cout << "  Memory: multipoles shells transformed " << shell_block << " at a time\n";
+        } else if (can_wrap and kernel_mode!=KERNEL_WRAP){
+            kernel_mode = KERNEL_WRAP;
+            traversal_mode = TRAVERSE_FLAT;
+            cout << "  Memory: wrapping kernel, without padded copies of the fields\n";
+        } else {
+            break;
+        }
+        mplan = plan_memory(selectionFunction, Nres, n_fields, nx, engineSt=="multipoles", kbins);
+    }
+    print_memory_plan(mplan, memory_limit);
+    if (plan_mode!=PLAN_OFF and memory_limit>0.0 and mplan.peak()>memory_limit){
+        cout << "  ERROR: not enough memory; lower -s, store the fields as --storage int16 or int8,\n";
+        cout << "  or split the box over more nodes with driver_mpi\n";
+        exit(1);
+    }
+
+    // Measured speed of the kernel on this host (0 = guess)
+    double speed = 0.0;
+    if (engineSt=="direct"){
+        speed = calibrated_speed(selectionFunction, Nres, calibrate_mode);
+    }
+
+    // Sample fraction for the time budget, and the output names with it
+    // (sparser primaries run slower, so a fraction below 1 is timed
+    // again and adjusted once)
+    if (time_budget>0.0 and speed>0.0){
+        double full_time = 0.0;
+        for (int pass=0; pass<2; pass++){
+            full_time = triangles_per_primary(selectionFunction) * Nres3 / speed;
+            sample_fraction = std::min(1.0, time_budget*60.0 / full_time);
+            if (sample_fraction>=1.0 or pass==1) break;
+            speed = calibrated_speed(selectionFunction, Nres, calibrate_mode);
+        }
+        printf("  sample_fraction=%.4g to fit %g minutes per file (%.3g for every primary)\n",
+               sample_fraction, time_budget, full_time/60.0);
+        if (sample_fraction<1.0){
+            cout << "  seed=" << sample_seed << "\n";
+        }
+        prefix = output_prefix(cross, estimatorSt, vertsfilename, normalisationSt);
+        delete file_pairs;
+        file_pairs = get_loop_filenames(parser, "corr3", prefix);
+        if (cross and parser.retrieve<string>("directory").length()>0){
+            std::sort(file_pairs->begin(), file_pairs->end());
+        }
+    }
 
     // Print summary of bins
-    double time_per_file = summary_and_time_per_file(selectionFunction, Nres3, false);
+    double time_per_file = summary_and_time_per_file(selectionFunction, Nres3, false, speed);
 
-    // Run the statistics for every file
-    cout << "\n  Running corr3 for " << file_pairs->size() << " files\n";
-    for (size_t file_i=0; file_i<file_pairs->size(); file_i++){
-        string inputfilename = file_pairs->at(file_i).first;
-        string outputfilename = file_pairs->at(file_i).second;
-        cout << "    Running for " << basename(inputfilename) << "\n";
-        cout << "      Expected end " << pretty_time(time_per_file) << "\n";
-
-        // Make sure the correct N and L
-        int this_Nres = -1; float this_L = -1.0;
-        if (get_filename_N_L(inputfilename, this_Nres, this_L)!=_SUCCESS){
-            cout << "    Failed to get N and L for " << inputfilename << "\n";
-            exit(1);
+    // Sampled primaries: built once in O(samples) and shared by every
+    // file (all have the same Nres), stored next to the output
+    // Reuses an existing list if --samplesfilename points to one
+    vector<long int> *primaries = NULL;
+    if (engineSt=="direct" and sample_fraction<1.0){
+        const bool samples_exist = (samplesfilename.length()>0 and fileexists(samplesfilename));
+#ifdef _USEMPI_
+        MPI_Barrier(MPI_COMM_WORLD);    // every rank has looked before rank 0 writes
+#endif
+        if (samples_exist){
+            samples_header drawn;
+            primaries = load_primaries(samplesfilename.c_str(), drawn);
+            if (drawn.Nres3!=Nres3 or (primaries->size()>0 and primaries->back()>=Nres3)){
+                cout << "  ERROR: samples in " << samplesfilename << " do not fit N=" << Nres << "\n";
+                exit(1);
+            }
+            if (drawn.fraction!=sample_fraction or drawn.seed!=sample_seed){
+                cout << "  ERROR: " << samplesfilename << " changed since it was read\n";
+                exit(1);
+            }
+            cout << "  Loaded " << primaries->size() << " sampled primaries from " << samplesfilename << "\n";
         } else {
-            if ( Nres!=this_Nres || L!=this_L){
-                cout << "    Different N/L for " << inputfilename << "\n";
-                continue;
+            primaries = sample_primaries(Nres3, sample_fraction, sample_seed);
+            if (samplesfilename.length()==0){
+                char samples_name[500];
+                sprintf(samples_name, "samples_N%d_sample%.3f_seed%lu.idx", Nres, sample_fraction, sample_seed);
+                samplesfilename = join(split_filename(file_pairs->at(0).second).first, samples_name);
             }
+            const bool samples_saved = (process_rank()>0 or save_primaries(primaries, Nres3, sample_fraction, sample_seed, samplesfilename.c_str()));
+            fflush(stdout);
+            cout << "  Sampled " << primaries->size() << " primaries";
+            if (samples_saved){
+                cout << ", saved to " << samplesfilename << "\n";
+            } else {
+                cout << "\n  WARNING: no samples file written, the sampled primaries are not recorded\n";
+            }
+        }
+    }
+
+    // This shard's range of voxels, the kernels' range of primaries
+    // (a sampled list is cut down to it, every voxel needs no list)
+    long int shard_first = 0, shard_last = Nres3;
+    if (sharded){
+        shard_range(Nres3, shard, n_shards, shard_first, shard_last);
+        cout << "  Voxels " << shard_first << " to " << shard_last << " in shard " << shard << " of " << n_shards;
+        if (primaries){
+            vector<long int> *all_primaries = primaries;
+            primaries = shard_primaries(all_primaries, Nres3, shard, n_shards);
+            delete all_primaries;
+            cout << ", " << primaries->size() << " primaries";
         }
+        cout << "\n";
+    }
 
-        // Prepare float box to load from file
-        float box[Nres3];
+    // Run the statistics for every file, batch_size files at a time
+    cout << "\n  Running corr3 for " << file_pairs->size() << " files\n";
+    for (size_t batch_start=0; batch_start<file_pairs->size(); batch_start+=batch_size){
 
-        // Check file size -- make sure correct for double or float
-        std::ifstream::pos_type size = filesize(inputfilename.c_str());
-        float element_bytes = float(size)/float(Nres3);
+        // Load and normalise every file of the batch
+        vector<size_t> batch_files;
+        vector<float*> batch_boxes;
+        const size_t batch_end = std::min(batch_start + batch_size, file_pairs->size());
+        for (size_t file_i=batch_start; file_i<batch_end; file_i++){
+            string inputfilename = file_pairs->at(file_i).first;
+            cout << "    Running for " << basename(inputfilename) << "\n";
+            cout << "      Expected end " << pretty_time(time_per_file) << "\n";
 
-        // Doubles data -- for python generated data
-        if (element_bytes==8.0){
-            double* boxD = load_double_data(inputfilename, Nres);
-            for (long int i=0; i<Nres3; i++) { 
-                box[i] = float(boxD[i]);
+            // Make sure the correct N and L
+            int this_Nres = -1; float this_L = -1.0;
+            if (get_filename_N_L(inputfilename, this_Nres, this_L)!=_SUCCESS){
+                cout << "    Failed to get N and L for " << inputfilename << "\n";
+                exit(1);
+            } else {
+                if ( Nres!=this_Nres || L!=this_L){
+                    cout << "    Different N/L for " << inputfilename << "\n";
+                    continue;
+                }
             }
-            delete boxD;
 
-        // Float data -- simfast / 21cmfast?
-        } else if (element_bytes==4.0) {
-            float *new_box = load_float_data(inputfilename, Nres);
-            for (long int i=0; i<Nres3; i++) { 
-                box[i] = float(new_box[i]);
+            // Resumed run: files saved before the restart are done
+            if (plan.resume){
+                string resultfilename = result_filename(file_pairs->at(file_i).second, sharded, shard, n_shards);
+                if (fileexists(resultfilename) and !fileexists(add_filename_prefix(resultfilename, "checkpoint_"))){
+                    cout << "      Already saved, skipping\n";
+                    continue;
+                }
             }
-            delete new_box;
 
-        // Dont know this type
-        } else {
-            cout << "  ERROR: unknown data type (not float or double)\n";
-            cout << "  Mehod terminates.\n";
-            exit(1);            
-        }
-
-        // Get data mean
-        // cout << "  Taking average... ";
-        long double sumdata = 0;
-        long double sumdata_sq = 0;
-        for (long int i=0; i<Nres3; i++) { 
-            sumdata += box[i]; 
-            sumdata_sq += box[i] * box[i];
-        }
-        long double ave = sumdata / double(Nres3);
-        cout << "      Data mean is " << ave << "\n";
-
-        // Normalise to ( T /<T> ), random field is 1.0 everywhere
-        if ( normalisationSt=="" || normalisationSt=="normOne" ){
-
-            if (ave==0.0){ 
-                if (sumdata_sq==0.0){
-                    cout << "  WARNING: box is all zeros; will give dummy output"; 
-                } else {
-                    cout << "  ERROR: box ave = 0, but not all zeros, forbiddged for normOne normalisation";                     
+            // Distributed: each rank loads and correlates its slab, and
+            // rank 0 saves the sums of every rank
+#ifdef _USEMPI_
+            {
+                string outputfilename = file_pairs->at(file_i).second;
+                box_slab slab;
+                if (!load_slab(inputfilename, Nres, normalisationSt, layout, halo, slab)){
                     continue;
                 }
-            } else {
-                for (long int i=0; i<Nres3; i++) { box[i] = (box[i]/ave); }
+                const bool root = (process_rank()==0);
+                if (root) cout << "      Correlating... ";
+                vector<statistics_with_jk> *results = run_distributed(slab, selectionFunction, Nres, layout, primaries);
+                delete[] slab.data;
+                if (root){
+                    cout << "  Done at " << currentTimeTaken() << '\n';
+                    cout << "      Saving... ";
+                    save(results, estimator, selectionFunction, outputfilename.c_str());
+                    cout << "  Done at " << currentTimeTaken() << '\n';
+                }
+                delete results;
+                continue;
             }
+#endif
 
-        // Normalise to ( T - <T> ) / <T>
-        } else if (normalisationSt=="normOverdensity"){
+            float* box = new float[Nres3];
+            if (!load_box(inputfilename, Nres, normalisationSt, box)){
+                delete[] box;
+                continue;
+            }
+            batch_files.push_back(file_i);
+            batch_boxes.push_back(box);
+        }
 
-            if (ave==0.0){ 
-                if (sumdata_sq==0.0){
-                    cout << "  WARNING: box is all zeros; will give dummy output"; 
-                } else {
-                    cout << "  ERROR: box ave = 0, but not all zeros, forbiddged for normOne normalisation";                     
+        // Correlate the whole batch in one traversal
+        vector< vector<statistics_with_jk>* > *batch_results = NULL;
+        if (batch_boxes.size()>1){
+            cout << "    Correlating batch of " << batch_boxes.size() << "... ";
+            float* interleaved = interleave_boxes(batch_boxes, Nres);
+            batch_results = run_correlation_batch(interleaved, batch_boxes.size(), selectionFunction, Nres, primaries);
+            delete[] interleaved;
+            cout << "  Done at " << currentTimeTaken() << '\n';
+        }
+
+        for (size_t batch_i=0; batch_i<batch_files.size(); batch_i++){
+            const size_t file_i = batch_files[batch_i];
+            string inputfilename = file_pairs->at(file_i).first;
+            string outputfilename = file_pairs->at(file_i).second;
+            float* box = batch_boxes[batch_i];
+            float* box2 = box;
+            float* box3 = box;
+            string resultfilename = result_filename(outputfilename, sharded, shard, n_shards);
+            vector<string> comments;    // header lines of the results file
+            std::ostringstream inputs_id;
+            inputs_id << basename(inputfilename) << ' ' << filesize(inputfilename.c_str());
+            if (cross){
+                string field2filename = field2_files->at(file_i);
+                string field3filename = field3_files->at(file_i);
+                inputs_id << ' ' << basename(field2filename) << ' ' << filesize(field2filename.c_str());
+                inputs_id << ' ' << basename(field3filename) << ' ' << filesize(field3filename.c_str());
+                box2 = load_cross_field(field2filename, Nres, L, normalisationSt);
+                box3 = (field3filename==field2filename) ? box2 : load_cross_field(field3filename, Nres, L, normalisationSt);
+                if (box2==NULL or box3==NULL){
+                    if (box3!=box2) delete[] box3;
+                    delete[] box2;
+                    delete[] box;
                     continue;
                 }
+
+                // Output records which field sits at which vertex
+                comments.push_back("# vertex 1 (primary): " + inputfilename);
+                comments.push_back("# vertex 2 (ptB):     " + field2filename);
+                comments.push_back("# vertex 3 (ptC):     " + field3filename);
+            }
+
+            // Partial files (shard, checkpoints) record the bins and inputs
+            const partial_header header = make_partial_header(Nres, L, selectionFunction->size(), shard, n_shards,
+                                                              verts_hash, string_hash(inputs_id.str()));
+
+            // Run the correlation
+            vector<statistics_with_jk> *results = NULL;
+            if (batch_results){
+                cout << "      Correlated in batch ";
+                results = batch_results->at(batch_i);
+            } else if (engineSt=="multipoles"){
+                cout << "      Multipoles...\n";
+                string multipolefilename = add_filename_prefix(outputfilename, "multipoles_");
+                results = run_multipoles(box, selectionFunction, Nres, cell_size, lmax, multipolefilename.c_str());
+                std::ostringstream note;
+                note << "# Multipoles engine: the Legendre sums up to lmax=" << lmax << " (" << basename(multipolefilename)
+                     << ") projected onto each bin, an approximation truncated at lmax, scaled to the bin's exact RRR";
+                comments.push_back(note.str());
+            } else if (checkpointed){
+                cout << "      Correlating with checkpoints... ";
+                plan.checkpointfilename = add_filename_prefix(resultfilename, "checkpoint_");
+                plan.interimfilename = interim ? add_filename_prefix(resultfilename, "interim_") : "";
+                results = run_checkpointed(box, box2, box3, selectionFunction, Nres, primaries,
+                                           header, sharded, plan, estimator, comments.empty() ? NULL : &comments);
+            } else if (sharded){
+                cout << "      Correlating... ";
+                correlation_run run(box, box2, box3, selectionFunction, Nres, primaries, shard_first, shard_last, shard_first);
+                results = run.correlate(shard_first, shard_last);
             } else {
-                for (long int i=0; i<Nres3; i++) { box[i] = (box[i]-ave)/ave; }
+                cout << "      Correlating... ";
+                results = run_correlation(box, box2, box3, selectionFunction, Nres, primaries);
             }
+            cout << "  Done at " << currentTimeTaken() << '\n';
 
-        } else {
-            cout << "  ERROR: unrecognised normalisation: '" << normalisationSt << "'\n";
-            exit(1);
-        }
+            // Save to file (raw sums of a shard to its partial file)
+            cout << "      Saving... ";
+            if (sharded){
+                if (!save_partial(results, header, resultfilename.c_str())){
+                    cout << "  ERROR: shard " << shard << " of " << n_shards << " not saved\n";
+                    exit(1);
+                }
+            } else {
+                save(results, estimator, selectionFunction, resultfilename.c_str(), comments.empty() ? NULL : &comments);
+            }
+            cout << "  Done at " << currentTimeTaken() << '\n';
 
-        // Run the correlation
-        cout << "      Correlating... ";
-        vector<statistics_with_jk> *results = run_correlation(box, box, box, selectionFunction, Nres);
-        cout << "  Done at " << currentTimeTaken() << '\n';
+            // Saved, so the checkpoint (and interim results) are obsolete
+            if (checkpointed){
+                remove(plan.checkpointfilename.c_str());
+                remove(add_filename_prefix(resultfilename, "interim_").c_str());
+            }
 
-        // Save to file
-        cout << "      Saving... ";
-        save(results, estimator, selectionFunction, outputfilename.c_str());
-        cout << "  Done at " << currentTimeTaken() << '\n';
+            // Bispectrum from the same normalised box
+            if (kbins){
+                cout << "      Bispectrum...\n";
+                string bispectrumfilename = add_filename_prefix(outputfilename, "bispectrum_");
+                run_bispectrum(box, kbins, Nres, L, bispectrumfilename.c_str());
+                cout << "  Done at " << currentTimeTaken() << '\n';
+            }
 
+            if (box3!=box and box3!=box2) delete[] box3;
+            if (box2!=box) delete[] box2;
+            delete[] box;
+        }
+        delete batch_results;
     }
 
     cout << " Finished all files at " << pretty_time() << "\n";
     cout << " ------------------------------------------------------------------\n";
 
+#ifdef _USEMPI_
+    MPI_Finalize();
+#endif
+
     // Successful run
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,343 @@
+/*************************************************************
+  SIMD gather kernels for the innermost (ptC) loop
+*************************************************************/
+
+#include "gather.hpp"
+
+#include <immintrin.h>
+
+// Scalar: same order of additions as the original ptC loop
+static double gather_sum_scalar(const float* base, const int* offs, int n, double mult12){
+    double sum = 0;
+    for (int j=0; j<n; j++){
+        sum += mult12 * base[offs[j]];
+    }
+    return sum;
+}
+
+// AVX2: gather 8 floats per step, accumulate in two double vectors
+__attribute__((target("avx2")))
+static double gather_sum_avx2(const float* base, const int* offs, int n, double mult12){
+    const __m256d mult = _mm256_set1_pd(mult12);
+    __m256d sum_lo = _mm256_setzero_pd();
+    __m256d sum_hi = _mm256_setzero_pd();
+    int j = 0;
+    for (; j+8<=n; j+=8){
+        const __m256i index = _mm256_loadu_si256((const __m256i*)(offs + j));
+        const __m256 data = _mm256_i32gather_ps(base, index, 4);
+        sum_lo = _mm256_add_pd(sum_lo, _mm256_mul_pd(mult, _mm256_cvtps_pd(_mm256_castps256_ps128(data))));
+        sum_hi = _mm256_add_pd(sum_hi, _mm256_mul_pd(mult, _mm256_cvtps_pd(_mm256_extractf128_ps(data, 1))));
+    }
+
+    // Horizontal sum, then the remainder
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(sum_lo, sum_hi));
+    double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; j<n; j++){
+        sum += mult12 * base[offs[j]];
+    }
+    return sum;
+}
+
+// AVX-512: gather 16 floats per step, accumulate in two double vectors
+// (GCC 12 headers warn spuriously about _mm512_undefined_* here)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f")))
+static double gather_sum_avx512(const float* base, const int* offs, int n, double mult12){
+    const __m512d mult = _mm512_set1_pd(mult12);
+    __m512d sum_lo = _mm512_setzero_pd();
+    __m512d sum_hi = _mm512_setzero_pd();
+    int j = 0;
+    for (; j+16<=n; j+=16){
+        const __m512i index = _mm512_loadu_si512((const void*)(offs + j));
+        const __m512 data = _mm512_i32gather_ps(index, base, 4);
+        const __m256 data_lo = _mm512_castps512_ps256(data);
+        const __m256 data_hi = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(data), 1));
+        sum_lo = _mm512_add_pd(sum_lo, _mm512_mul_pd(mult, _mm512_cvtps_pd(data_lo)));
+        sum_hi = _mm512_add_pd(sum_hi, _mm512_mul_pd(mult, _mm512_cvtps_pd(data_hi)));
+    }
+
+    // Horizontal sum, then the remainder
+    double sum = _mm512_reduce_add_pd(_mm512_add_pd(sum_lo, sum_hi));
+    for (; j<n; j++){
+        sum += mult12 * base[offs[j]];
+    }
+    return sum;
+}
+#pragma GCC diagnostic pop
+
+// Mixed precision: the same sums with float partial sums (twice the
+// lanes per vector), multiplied by mult12 in double once at the end
+static double gather_sum_float_scalar(const float* base, const int* offs, int n, double mult12){
+    float sum = 0;
+    for (int j=0; j<n; j++){
+        sum += base[offs[j]];
+    }
+    return mult12 * sum;
+}
+
+__attribute__((target("avx2")))
+static double gather_sum_float_avx2(const float* base, const int* offs, int n, double mult12){
+    __m256 sum_a = _mm256_setzero_ps();
+    __m256 sum_b = _mm256_setzero_ps();
+    int j = 0;
+    for (; j+16<=n; j+=16){
+        const __m256i index_a = _mm256_loadu_si256((const __m256i*)(offs + j));
+        const __m256i index_b = _mm256_loadu_si256((const __m256i*)(offs + j + 8));
+        sum_a = _mm256_add_ps(sum_a, _mm256_i32gather_ps(base, index_a, 4));
+        sum_b = _mm256_add_ps(sum_b, _mm256_i32gather_ps(base, index_b, 4));
+    }
+    for (; j+8<=n; j+=8){
+        const __m256i index = _mm256_loadu_si256((const __m256i*)(offs + j));
+        sum_a = _mm256_add_ps(sum_a, _mm256_i32gather_ps(base, index, 4));
+    }
+
+    // Horizontal sum, then the remainder
+    float lanes[8];
+    _mm256_storeu_ps(lanes, _mm256_add_ps(sum_a, sum_b));
+    float sum = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    for (; j<n; j++){
+        sum += base[offs[j]];
+    }
+    return mult12 * sum;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f")))
+static double gather_sum_float_avx512(const float* base, const int* offs, int n, double mult12){
+    __m512 sum_a = _mm512_setzero_ps();
+    __m512 sum_b = _mm512_setzero_ps();
+    int j = 0;
+    for (; j+32<=n; j+=32){
+        const __m512i index_a = _mm512_loadu_si512((const void*)(offs + j));
+        const __m512i index_b = _mm512_loadu_si512((const void*)(offs + j + 16));
+        sum_a = _mm512_add_ps(sum_a, _mm512_i32gather_ps(index_a, base, 4));
+        sum_b = _mm512_add_ps(sum_b, _mm512_i32gather_ps(index_b, base, 4));
+    }
+    for (; j+16<=n; j+=16){
+        const __m512i index = _mm512_loadu_si512((const void*)(offs + j));
+        sum_a = _mm512_add_ps(sum_a, _mm512_i32gather_ps(index, base, 4));
+    }
+
+    // Horizontal sum, then the remainder
+    float sum = _mm512_reduce_add_ps(_mm512_add_ps(sum_a, sum_b));
+    for (; j<n; j++){
+        sum += base[offs[j]];
+    }
+    return mult12 * sum;
+}
+#pragma GCC diagnostic pop
+
+// Quantised fields: integer sum of the codes base[offs[j]]
+template <typename Q>
+static long int gather_codes_scalar(const Q* base, const int* offs, int n){
+    long int sum = 0;
+    for (int j=0; j<n; j++){
+        sum += base[offs[j]];
+    }
+    return sum;
+}
+
+// AVX2: gather 32 bits at each code (the allocation has spare bytes at
+// the end), then sign-extend the low 8*sizeof(Q) bits; int32 lanes
+template <typename Q>
+__attribute__((target("avx2")))
+static long int gather_codes_avx2(const Q* base, const int* offs, int n){
+    const int shift = 32 - 8*sizeof(Q);
+    __m256i sum = _mm256_setzero_si256();
+    int j = 0;
+    for (; j+8<=n; j+=8){
+        const __m256i index = _mm256_loadu_si256((const __m256i*)(offs + j));
+        __m256i codes = _mm256_i32gather_epi32((const int*)base, index, sizeof(Q));
+        codes = _mm256_srai_epi32(_mm256_slli_epi32(codes, shift), shift);
+        sum = _mm256_add_epi32(sum, codes);
+    }
+
+    // Horizontal sum, then the remainder
+    int lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, sum);
+    long int total = 0;
+    for (int lane=0; lane<8; lane++) total += lanes[lane];
+    for (; j<n; j++){
+        total += base[offs[j]];
+    }
+    return total;
+}
+
+// AVX-512: as AVX2, 16 codes per step
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+template <typename Q>
+__attribute__((target("avx512f")))
+static long int gather_codes_avx512(const Q* base, const int* offs, int n){
+    const int shift = 32 - 8*sizeof(Q);
+    __m512i sum = _mm512_setzero_si512();
+    int j = 0;
+    for (; j+16<=n; j+=16){
+        const __m512i index = _mm512_loadu_si512((const void*)(offs + j));
+        __m512i codes = _mm512_i32gather_epi32(index, (const void*)base, sizeof(Q));
+        codes = _mm512_srai_epi32(_mm512_slli_epi32(codes, shift), shift);
+        sum = _mm512_add_epi32(sum, codes);
+    }
+
+    // Horizontal sum, then the remainder
+    long int total = _mm512_reduce_add_epi32(sum);
+    for (; j<n; j++){
+        total += base[offs[j]];
+    }
+    return total;
+}
+#pragma GCC diagnostic pop
+
+// Batched gather for K interleaved fields: sums[b] = sum of
+// base[offs[j]*K + b], each field summed in the same order as scalar
+static void gather_batch_scalar(const float* base, const int* offs, int n, int K, double* sums){
+    for (int b=0; b<K; b++) sums[b] = 0;
+    for (int j=0; j<n; j++){
+        const float* row = base + long(offs[j])*K;
+        for (int b=0; b<K; b++){
+            sums[b] += row[b];
+        }
+    }
+}
+
+// AVX2: 16 fields at a time in four double vectors, then 4 at a time
+__attribute__((target("avx2")))
+static void gather_batch_avx2(const float* base, const int* offs, int n, int K, double* sums){
+    int b = 0;
+    for (; b+16<=K; b+=16){
+        __m256d sum0 = _mm256_setzero_pd(), sum1 = _mm256_setzero_pd();
+        __m256d sum2 = _mm256_setzero_pd(), sum3 = _mm256_setzero_pd();
+        for (int j=0; j<n; j++){
+            const float* row = base + long(offs[j])*K + b;
+            sum0 = _mm256_add_pd(sum0, _mm256_cvtps_pd(_mm_loadu_ps(row)));
+            sum1 = _mm256_add_pd(sum1, _mm256_cvtps_pd(_mm_loadu_ps(row + 4)));
+            sum2 = _mm256_add_pd(sum2, _mm256_cvtps_pd(_mm_loadu_ps(row + 8)));
+            sum3 = _mm256_add_pd(sum3, _mm256_cvtps_pd(_mm_loadu_ps(row + 12)));
+        }
+        _mm256_storeu_pd(sums + b, sum0);
+        _mm256_storeu_pd(sums + b + 4, sum1);
+        _mm256_storeu_pd(sums + b + 8, sum2);
+        _mm256_storeu_pd(sums + b + 12, sum3);
+    }
+    for (; b+4<=K; b+=4){
+        __m256d sum0 = _mm256_setzero_pd();
+        for (int j=0; j<n; j++){
+            sum0 = _mm256_add_pd(sum0, _mm256_cvtps_pd(_mm_loadu_ps(base + long(offs[j])*K + b)));
+        }
+        _mm256_storeu_pd(sums + b, sum0);
+    }
+    for (; b<K; b++){
+        double sum = 0;
+        for (int j=0; j<n; j++) sum += base[long(offs[j])*K + b];
+        sums[b] = sum;
+    }
+}
+
+// AVX-512: 16 fields at a time in two double vectors, then 8 at a time
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f")))
+static void gather_batch_avx512(const float* base, const int* offs, int n, int K, double* sums){
+    int b = 0;
+    for (; b+16<=K; b+=16){
+        __m512d sum0 = _mm512_setzero_pd(), sum1 = _mm512_setzero_pd();
+        for (int j=0; j<n; j++){
+            const float* row = base + long(offs[j])*K + b;
+            sum0 = _mm512_add_pd(sum0, _mm512_cvtps_pd(_mm256_loadu_ps(row)));
+            sum1 = _mm512_add_pd(sum1, _mm512_cvtps_pd(_mm256_loadu_ps(row + 8)));
+        }
+        _mm512_storeu_pd(sums + b, sum0);
+        _mm512_storeu_pd(sums + b + 8, sum1);
+    }
+    for (; b+8<=K; b+=8){
+        __m512d sum0 = _mm512_setzero_pd();
+        for (int j=0; j<n; j++){
+            sum0 = _mm512_add_pd(sum0, _mm512_cvtps_pd(_mm256_loadu_ps(base + long(offs[j])*K + b)));
+        }
+        _mm512_storeu_pd(sums + b, sum0);
+    }
+    for (; b<K; b++){
+        double sum = 0;
+        for (int j=0; j<n; j++) sum += base[long(offs[j])*K + b];
+        sums[b] = sum;
+    }
+}
+#pragma GCC diagnostic pop
+
+// Best instruction set supported by this CPU
+int detect_simd_level(){
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+    return SIMD_SCALAR;
+}
+
+// Name of an instruction set, for feedback
+const char* simd_level_name(int level){
+    switch (level){
+        case SIMD_AVX512: return "avx512";
+        case SIMD_AVX2:   return "avx2";
+        default:          return "scalar";
+    }
+}
+
+// Gather-sum kernel for the requested instruction set
+gatherSumType gather_sum_kernel(int level){
+    int supported = detect_simd_level();
+    if (level>supported) level = supported;
+    switch (level){
+        case SIMD_AVX512: return gather_sum_avx512;
+        case SIMD_AVX2:   return gather_sum_avx2;
+        default:          return gather_sum_scalar;
+    }
+}
+
+// Mixed-precision gather-sum kernel for the requested instruction set
+gatherSumType gather_sum_float_kernel(int level){
+    int supported = detect_simd_level();
+    if (level>supported) level = supported;
+    switch (level){
+        case SIMD_AVX512: return gather_sum_float_avx512;
+        case SIMD_AVX2:   return gather_sum_float_avx2;
+        default:          return gather_sum_float_scalar;
+    }
+}
+
+// Gather kernels for quantised codes, for the requested instruction set
+gatherInt16Type gather_int16_kernel(int level){
+    int supported = detect_simd_level();
+    if (level>supported) level = supported;
+    switch (level){
+        case SIMD_AVX512: return gather_codes_avx512<int16_t>;
+        case SIMD_AVX2:   return gather_codes_avx2<int16_t>;
+        default:          return gather_codes_scalar<int16_t>;
+    }
+}
+
+gatherInt8Type gather_int8_kernel(int level){
+    int supported = detect_simd_level();
+    if (level>supported) level = supported;
+    switch (level){
+        case SIMD_AVX512: return gather_codes_avx512<int8_t>;
+        case SIMD_AVX2:   return gather_codes_avx2<int8_t>;
+        default:          return gather_codes_scalar<int8_t>;
+    }
+}
+
+// Batched gather kernel for the requested instruction set
+gatherBatchType gather_batch_kernel(int level){
+    int supported = detect_simd_level();
+    if (level>supported) level = supported;
+    switch (level){
+        case SIMD_AVX512: return gather_batch_avx512;
+        case SIMD_AVX2:   return gather_batch_avx2;
+        default:          return gather_batch_scalar;
+    }
+}
@@ -0,0 +1,47 @@
+/*************************************************************
+  SIMD gather kernels for the innermost (ptC) loop
+  Chosen at runtime from CPUID, scalar fallback always available
+*************************************************************/
+
+#ifndef __GATHER_HPP__
+#define __GATHER_HPP__
+
+#include <stdint.h>
+
+// Available instruction sets, in increasing order
+enum simd_levels { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 };
+
+// Sum of mult12 * base[offs[j]] for j < n
+typedef double (*gatherSumType)(const float* base, const int* offs, int n, double mult12);
+
+// Sum of the quantised codes base[offs[j]] for j < n
+// (int32 lanes, so n must stay below 2^31 / 2^15 for int16)
+typedef long int (*gatherInt16Type)(const int16_t* base, const int* offs, int n);
+typedef long int (*gatherInt8Type)(const int8_t* base, const int* offs, int n);
+
+// Sums over j < n of base[offs[j]*K + b] into sums[b], for K
+// interleaved fields (the batched kernel's ptC loop)
+typedef void (*gatherBatchType)(const float* base, const int* offs, int n, int K, double* sums);
+
+// Best instruction set supported by this CPU
+int detect_simd_level();
+
+// Name of an instruction set, for feedback
+const char* simd_level_name(int level);
+
+// Gather-sum kernel for the requested instruction set
+// (falls back to the best supported level below it)
+gatherSumType gather_sum_kernel(int level);
+
+// Same sums with float partial sums, for mixed precision
+// (twice the lanes per vector, rounding error of float over n terms)
+gatherSumType gather_sum_float_kernel(int level);
+
+// Gather kernels for quantised codes, for the requested instruction set
+gatherInt16Type gather_int16_kernel(int level);
+gatherInt8Type gather_int8_kernel(int level);
+
+// Batched gather kernel for the requested instruction set
+gatherBatchType gather_batch_kernel(int level);
+
+#endif
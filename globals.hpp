@@ -7,8 +7,46 @@ extern int global_nthreads;
 
 // How many total jackknife boxes to use
 extern long int jackknife_N;
+
+// Shape of the jackknife regions (JK_* in jackknife.hpp)
+extern int jk_layout;
+
+// Dense or sparse per-thread jackknife sums (JK_* in jackknife.hpp)
+extern int jk_accumulation;
     
 // What fraction of grid points to try
 extern double sample_fraction;      
 
+// Seed for the counter-based sampling of primaries (sampling.hpp)
+extern unsigned long int sample_seed;
+
+// Which correlation kernel to run (KERNEL_* in corr3.hpp)
+extern int kernel_mode;
+
+// Instruction set for the halo kernel's ptC loop (SIMD_* in gather.hpp)
+extern int simd_level;
+
+// Storage of the padded fields in the halo kernel (STORAGE_* in quantise.hpp)
+extern int storage_mode;
+
+// Accumulation of the halo kernel (PRECISION_* in corr3.hpp)
+extern int precision_mode;
+
+// Order of primaries in the halo kernel (TRAVERSE_* in corr3.hpp)
+// and tile side for tiled traversal (0 = fit L2)
+extern int traversal_mode;
+extern int tile_size;
+
+// Seconds between live progress lines from the kernels (0 = off)
+extern double progress_interval;
+
+// Copies of the kernels' read-only fields per NUMA node (NUMA_* in numa.hpp)
+extern int numa_mode;
+
+// Files correlated together by the batched kernel (1 = one at a time)
+extern int batch_size;
+
+// Radial shells the multipoles engine transforms at once (0 = all)
+extern int shell_block;
+
 #endif
\ No newline at end of file
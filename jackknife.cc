@@ -0,0 +1,99 @@
+/************************************************************
+  Jackknife regions of the grid
+*************************************************************/
+
+#include "jackknife.hpp"
+#include "globals.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <algorithm>
+
+// Periodic cell index along one axis
+static inline long int wrap_cell(long int c, int Nres){
+    return ((c % Nres) + Nres) % Nres;
+}
+
+int jk_regions::region_of(long int x, long int y, long int z) const {
+    if (layout==JK_CUBES){
+        const long int rx = x*per_side / Nres;
+        const long int ry = y*per_side / Nres;
+        const long int rz = z*per_side / Nres;
+        return (int)((rx*per_side + ry)*per_side + rz);
+    }
+    // Last slab takes the remainder, if jackknife_N doesn't divide Nres^3
+    const long int i = (x*Nres + y)*Nres + z;
+    return (int)std::min(i / jk_length, jackknife_N - 1);
+}
+
+jk_regions make_jk_regions(int Nres, int halo){
+
+    if (jackknife_N > 65536){
+        printf("  ERROR: at most 65536 jackknife regions (jackknife_N=%ld)\n", jackknife_N);
+        exit(1);
+    }
+
+    jk_regions regions;
+    regions.layout = jk_layout;
+    regions.Nres = Nres;
+    regions.jk_length = std::max(long(Nres)*Nres*Nres / jackknife_N, 1L);
+    regions.per_side = (int)lround(cbrt(double(jackknife_N)));
+    if (jk_layout==JK_CUBES){
+        if (long(regions.per_side)*regions.per_side*regions.per_side != jackknife_N){
+            printf("  ERROR: cubic jackknife regions need jackknife_N = n^3 (jackknife_N=%ld)\n", jackknife_N);
+            exit(1);
+        }
+        if (regions.per_side > Nres){
+            printf("  ERROR: more jackknife cubes per side (%d) than cells (%d)\n", regions.per_side, Nres);
+            exit(1);
+        }
+    }
+
+    // Everything is interior with one region
+    regions.interior.assign(3*Nres, 1);
+    if (jackknife_N==1) return regions;
+
+    // Regions are contiguous along each axis, so only the ends of the
+    // neighbourhood need checking, and any wrap crosses a boundary
+    for (int c=0; c<Nres; c++){
+        const bool no_wrap = (c - halo >= 0) and (c + halo < Nres);
+        if (jk_layout==JK_CUBES){
+            const bool inside = no_wrap
+                and regions.region_of(c - halo, 0, 0)==regions.region_of(c, 0, 0)
+                and regions.region_of(c + halo, 0, 0)==regions.region_of(c, 0, 0);
+            regions.interior[c] = inside;
+            regions.interior[Nres + c] = inside;
+            regions.interior[2*Nres + c] = inside;
+        } else {
+            // Slabs run along the flat index: planes x-halo..x+halo
+            // must all sit in one slab (y and z never matter)
+            regions.interior[c] = no_wrap
+                and regions.region_of(c - halo, 0, 0)==regions.region_of(c + halo, Nres-1, Nres-1);
+        }
+    }
+    return regions;
+}
+
+jk_region* jk_region_map(const jk_regions& regions, int halo, int x0, int n_planes){
+    const int Nres = regions.Nres;
+    const int Npad = Nres + 2*halo;
+    const long int Npad2 = long(Npad)*Npad;
+    if (n_planes<0) n_planes = Npad;
+    jk_region* padded = new jk_region[Npad2*n_planes];
+
+    // Parallel so each thread first-touches the slabs it fills
+    #pragma omp parallel for
+    for (int xp=0; xp<n_planes; xp++){
+        const long int x = wrap_cell(x0 + xp - halo, Nres);
+        for (int yp=0; yp<Npad; yp++){
+            const long int y = wrap_cell(yp - halo, Nres);
+            jk_region* padded_row = padded + xp*Npad2 + long(yp)*Npad;
+            for (int zp=0; zp<Npad; zp++){
+                padded_row[zp] = (jk_region)regions.region_of(x, y, wrap_cell(zp - halo, Nres));
+            }
+        }
+    }
+    return padded;
+}
@@ -0,0 +1,61 @@
+/*************************************************************
+  Jackknife regions of the grid
+  Each voxel belongs to one of jackknife_N regions, looked up
+  from a precomputed map instead of dividing every index
+*************************************************************/
+
+#ifndef __JACKKNIFE_HPP__
+#define __JACKKNIFE_HPP__
+
+#include <stdint.h>
+
+#include <vector>
+using std::vector;
+
+// Shape of the jackknife regions
+//   JK_SLABS: jackknife_N runs of the flat index, z fastest
+//             (e.g. jackknife_N=8 does NOT split into octants)
+//   JK_CUBES: jackknife_N = n^3 cubes, n along each axis
+enum jk_layouts { JK_SLABS, JK_CUBES };
+
+// How each thread accumulates the jackknife sums
+//   JK_DENSE:  a row for every region, in every thread
+//   JK_SPARSE: rows only for regions a thread touches, flushed often
+//   JK_AUTO:   sparse if the dense rows would be large
+enum jk_accumulations { JK_AUTO, JK_DENSE, JK_SPARSE };
+
+// Region index stored in the map (so at most 65536 regions)
+typedef uint16_t jk_region;
+
+// Layout of the regions on a grid of Nres^3
+struct jk_regions{
+    int layout;
+    int Nres;
+    int per_side;           // cubes along each axis (JK_CUBES)
+    long int jk_length;     // voxels in each slab (JK_SLABS)
+
+    // interior[axis*Nres + c]: every cell from c-halo to c+halo along
+    // the axis is in the same region as c, without wrapping
+    vector<char> interior;
+
+    // Region of voxel (x,y,z)
+    int region_of(long int x, long int y, long int z) const;
+
+    // Whole halo neighbourhood of (x,y,z) lies in its own region, so
+    // no ptB or ptC of this primary can be in another region
+    bool is_interior(long int x, long int y, long int z) const {
+        return interior[x] and interior[Nres + y] and interior[2*Nres + z];
+    }
+};
+
+// Regions for jackknife_N and jk_layout, with interior flags for
+// neighbourhoods of halo cells
+jk_regions make_jk_regions(int Nres, int halo);
+
+// Region of every voxel, periodically padded by halo cells
+// (same layout as halo_pad; halo=0 gives the plain grid)
+// x0, n_planes: only the n_planes padded planes from plane x0-halo
+// (layout of slab_pad), default the whole padded box
+jk_region* jk_region_map(const jk_regions& regions, int halo, int x0 = 0, int n_planes = -1);
+
+#endif
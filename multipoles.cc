@@ -0,0 +1,414 @@
+/************************************************************
+  FFT-based 3PCF multipoles (shell-weighted convolutions)
+*************************************************************/
+
+#include "multipoles.hpp"
+#include "globals.hpp"
+#include <iomanip>
+#include <complex>
+#include <map>
+using std::complex;
+
+// Legendre polynomial P_l(x), by upward recurrence
+double legendre(int l, double x){
+    double p0 = 1.0, p1 = x;
+    if (l==0) return p0;
+    for (int n=2; n<=l; n++){
+        double p2 = ((2*n-1)*x*p1 - (n-1)*p0) / n;
+        p0 = p1;
+        p1 = p2;
+    }
+    return p1;
+}
+
+// Normalised associated Legendre function (with Condon-Shortley phase)
+// so that Y_lm(theta,phi) = Plm_norm(l,m,cos(theta)) e^{i m phi}
+double Plm_norm(int l, int m, double x){
+    double s = sqrt(std::max(0.0, (1.0-x)*(1.0+x)));
+
+    // Start from P_m^m, then step up in l
+    double pmm = sqrt(1.0/(4.0*M_PI));
+    for (int i=1; i<=m; i++){
+        pmm *= -sqrt((2.0*i+1.0)/(2.0*i)) * s;
+    }
+    if (l==m) return pmm;
+
+    double pmm1 = x * sqrt(2.0*m+3.0) * pmm;
+    if (l==m+1) return pmm1;
+
+    double pll = 0;
+    for (int ll=m+2; ll<=l; ll++){
+        double a = sqrt((4.0*ll*ll-1.0) / (double(ll)*ll - double(m)*m));
+        double b = sqrt((double(ll-1)*(ll-1) - double(m)*m) / (4.0*(ll-1)*(ll-1)-1.0));
+        pll = a * (x*pmm1 - b*pmm);
+        pmm = pmm1;
+        pmm1 = pll;
+    }
+    return pll;
+}
+
+// Conjugate spherical harmonic Y*_lm of the direction of a grid offset
+static complex<double> Ylm_conj(int l, int m, point& r){
+    double rmag = mag(r);
+    double phi = atan2(double(r.y), double(r.x));
+    return std::polar(Plm_norm(l, m, r.z/rmag), -m*phi);
+}
+
+// Periodic grid index of the offset -r
+static long int minus_offset_index(point& r, int Nres){
+    long int x = (Nres - r.x) % Nres;
+    long int y = (Nres - r.y) % Nres;
+    long int z = (Nres - r.z) % Nres;
+    return (x*Nres + y)*Nres + z;
+}
+
+// Convolve work (holding a kernel K'(s) on the grid) with the field
+// whose transform is fieldhat, in place: work(x) = sum_s field(x-s) K'(s)
+static void convolve(fftwf_complex* work, const fftwf_complex* fieldhat, long int Nres3,
+                     fftwf_plan forward, fftwf_plan backward){
+    fftwf_execute_dft(forward, work, work);
+    const float norm = 1.0 / double(Nres3);
+    #pragma omp parallel for
+    for (long int i=0; i<Nres3; i++){
+        float re = work[i][0]*fieldhat[i][0] - work[i][1]*fieldhat[i][1];
+        float im = work[i][0]*fieldhat[i][1] + work[i][1]*fieldhat[i][0];
+        work[i][0] = re * norm;
+        work[i][1] = im * norm;
+    }
+    fftwf_execute_dft(backward, work, work);
+}
+
+// a_lm^b(x) = sum_{r in b} d(x+r) Y*_lm(r^) of one shell, into work
+static void shell_field(fftwf_complex* work, vector<point>& shell, int l, int m, int Nres,
+                        const fftwf_complex* dhat, fftwf_plan forward, fftwf_plan backward){
+    const long int Nres3 = long(Nres)*Nres*Nres;
+    memset(work, 0, sizeof(fftwf_complex)*Nres3);
+    for (size_t pt_i=0; pt_i<shell.size(); pt_i++){
+        point& r = shell.at(pt_i);
+        complex<double> Y = Ylm_conj(l, m, r);
+        long int s = minus_offset_index(r, Nres);
+        work[s][0] += Y.real();
+        work[s][1] += Y.imag();
+    }
+    convolve(work, dhat, Nres3, forward, backward);
+}
+
+// Sums over the grid of d(x) f_i(x) g*_j(x) (real part) for every i and j
+// of the two lists (j>=i if they are the same list), into sums[i*n_g + j],
+// and of d(x) f_i(x) into df[i] if given
+static void grid_products(const float* box, long int Nres3,
+                          const vector<fftwf_complex*>& f, const vector<fftwf_complex*>& g, bool same,
+                          vector<double>& sums, vector< complex<double> >* df){
+    const int n_f = f.size(), n_g = g.size();
+    sums.assign(n_f*n_g, 0.0);
+    if (df) df->assign(n_f, 0.0);
+    #pragma omp parallel
+    {
+        vector<double> sums_pvt(n_f*n_g, 0.0);
+        vector< complex<double> > df_pvt(n_f, 0.0);
+
+        #pragma omp for
+        for (long int i=0; i<Nres3; i++){
+            const double d = box[i];
+            for (int f_i=0; f_i<n_f; f_i++){
+                const double re1 = f[f_i][i][0], im1 = f[f_i][i][1];
+                df_pvt[f_i] += complex<double>(d*re1, d*im1);
+                for (int g_i=(same ? f_i : 0); g_i<n_g; g_i++){
+                    sums_pvt[f_i*n_g+g_i] += d*(re1*g[g_i][i][0] + im1*g[g_i][i][1]);
+                }
+            }
+        }
+
+        #pragma omp critical
+        {
+            for (int pair_i=0; pair_i<n_f*n_g; pair_i++) sums[pair_i] += sums_pvt[pair_i];
+            if (df) for (int f_i=0; f_i<n_f; f_i++) (*df)[f_i] += df_pvt[f_i];
+        }
+    } // end omp parallel
+}
+
+int multipole_shells_held(int n_bins){
+    return std::max(1, (shell_block>0) ? std::min(shell_block, n_bins) : n_bins);
+}
+
+// Main multipoles method
+vector<statistics_with_jk>*
+run_multipoles(const float* box,
+               vector< triangle_configs > *selectionFunction,
+               int Nres, float cell_size, int lmax,
+               const char *multipolefilename){
+
+    int n_bins = selectionFunction->size();
+    const long int Nres3 = long(Nres)*Nres*Nres;
+    const int n_lm = (lmax+1)*(lmax+2)/2;
+
+    // Grid offsets in each radial shell (same r range as the verts bins)
+    vector< vector<point> > shells(n_bins);
+    vector<double> shell_r(n_bins, 0.0);
+    for (int bin_i=0; bin_i<n_bins; bin_i++){
+        double rmin = selectionFunction->at(bin_i).rmin / cell_size;
+        double rmax = selectionFunction->at(bin_i).rmax / cell_size;
+        if (rmax >= 0.5*Nres){
+            printf("  ERROR: bin %d rmax (%.1f cells) aliases on a %d box\n", bin_i, rmax, Nres);
+            exit(1);
+        }
+        int R = (int)ceil(rmax);
+        for (int x=-R; x<=R; x++){
+            for (int y=-R; y<=R; y++){
+                for (int z=-R; z<=R; z++){
+                    point r(x, y, z);
+                    double rmag = mag(r);
+                    if (rmag>0 and rmag>=rmin and rmag<rmax){
+                        shells.at(bin_i).push_back(r);
+                        shell_r.at(bin_i) += rmag;
+                    }
+                }
+            }
+        }
+        if (shells.at(bin_i).size()>0) shell_r.at(bin_i) /= shells.at(bin_i).size();
+    }
+
+    // Shell sums of Y*_lm, i.e. a_lm^b for a uniform field
+    vector< complex<double> > Q(n_bins*n_lm);
+    for (int bin_i=0; bin_i<n_bins; bin_i++){
+        for (int l=0; l<=lmax; l++){
+            for (int m=0; m<=l; m++){
+                complex<double> sum = 0;
+                for (size_t pt_i=0; pt_i<shells.at(bin_i).size(); pt_i++){
+                    sum += Ylm_conj(l, m, shells.at(bin_i).at(pt_i));
+                }
+                Q.at(bin_i*n_lm + l*(l+1)/2 + m) = sum;
+            }
+        }
+    }
+
+    // Transforms of the field and of its square (the square only for
+    // the degenerate triangles), and a work grid
+    fftwf_complex* dhat = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex)*Nres3);
+    fftwf_complex* d2hat = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex)*Nres3);
+    fftwf_complex* work = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex)*Nres3);
+    fftwf_plan_with_nthreads(global_nthreads);
+    fftwf_plan forward = fftwf_plan_dft_3d(Nres, Nres, Nres, dhat, dhat, FFTW_FORWARD, FFTW_ESTIMATE);
+    fftwf_plan backward = fftwf_plan_dft_3d(Nres, Nres, Nres, dhat, dhat, FFTW_BACKWARD, FFTW_ESTIMATE);
+
+    long double sum_d = 0;
+    for (long int i=0; i<Nres3; i++){
+        dhat[i][0] = box[i];            dhat[i][1] = 0;
+        d2hat[i][0] = box[i]*box[i];    d2hat[i][1] = 0;
+        sum_d += box[i];
+    }
+    fftwf_execute_dft(forward, dhat, dhat);
+    fftwf_execute_dft(forward, d2hat, d2hat);
+
+    // Legendre sums for each l and bin pair, [l][b1][b2]
+    // DDR has the field at the end in b1 (the ptB of run_correlation)
+    const int n_pairs = n_bins*n_bins;
+    vector<double> DDD((lmax+1)*n_pairs), DDR((lmax+1)*n_pairs);
+    vector<double> DRR((lmax+1)*n_pairs), RRR((lmax+1)*n_pairs);
+
+    // Degenerate triangles (r1==r2, so P_l=1 for every l), per bin
+    vector<double> DDD_self(n_bins), DDR_self(n_bins);
+    for (int bin_i=0; bin_i<n_bins; bin_i++){
+        for (int pass=0; pass<2; pass++){
+            memset(work, 0, sizeof(fftwf_complex)*Nres3);
+            for (size_t pt_i=0; pt_i<shells.at(bin_i).size(); pt_i++){
+                work[minus_offset_index(shells.at(bin_i).at(pt_i), Nres)][0] += 1.0;
+            }
+            convolve(work, (pass==0) ? d2hat : dhat, Nres3, forward, backward);
+            double sum = 0;
+            #pragma omp parallel for reduction(+:sum)
+            for (long int i=0; i<Nres3; i++){
+                sum += box[i] * work[i][0];
+            }
+            if (pass==0) DDD_self.at(bin_i) = sum;
+            else         DDR_self.at(bin_i) = sum;
+        }
+    }
+
+    fftwf_free(d2hat);
+
+    // a_lm^b of a block of shells at a time (multipole_shells_held, all
+    // of them if memory allows), each block against itself and then
+    // against every later shell, transformed one at a time
+    const int n_held = multipole_shells_held(n_bins);
+    vector<fftwf_complex*> held(n_held);
+    held.at(0) = work;
+    for (int held_i=1; held_i<n_held; held_i++){
+        held.at(held_i) = (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex)*Nres3);
+    }
+    fftwf_complex* streamed = (n_held<n_bins) ? (fftwf_complex*) fftwf_malloc(sizeof(fftwf_complex)*Nres3) : NULL;
+    if (n_held<n_bins){
+        printf("      Shell transforms %d at a time, of %d\n", n_held, n_bins);
+    }
+
+    // One pass per (l, m>=0); a_l,-m is the conjugate (up to sign) for a real field
+    for (int l=0; l<=lmax; l++){
+        const double norm = 4.0*M_PI / (2.0*l+1.0);
+        for (int m=0; m<=l; m++){
+            const double weight = (m==0) ? norm : 2.0*norm;
+
+            // Sum d(x) a^b1(x) a*^b2(x) (b2>=b1), and d(x) a^b1(x), over the grid
+            vector<double> pair_sums(n_pairs, 0.0);
+            vector< complex<double> > A(n_bins, 0.0);
+            for (int block_first=0; block_first<n_bins; block_first+=n_held){
+                const int block_size = std::min(n_held, n_bins - block_first);
+                vector<fftwf_complex*> block(held.begin(), held.begin() + block_size);
+                for (int held_i=0; held_i<block_size; held_i++){
+                    shell_field(block.at(held_i), shells.at(block_first + held_i), l, m, Nres, dhat, forward, backward);
+                }
+                vector<double> sums;
+                vector< complex<double> > dA;
+                grid_products(box, Nres3, block, block, true, sums, &dA);
+                for (int i=0; i<block_size; i++){
+                    A.at(block_first + i) = dA.at(i);
+                    for (int j=i; j<block_size; j++){
+                        pair_sums.at((block_first + i)*n_bins + block_first + j) = sums.at(i*block_size + j);
+                    }
+                }
+                for (int b2=block_first + block_size; b2<n_bins; b2++){
+                    shell_field(streamed, shells.at(b2), l, m, Nres, dhat, forward, backward);
+                    grid_products(box, Nres3, block, vector<fftwf_complex*>(1, streamed), false, sums, NULL);
+                    for (int i=0; i<block_size; i++){
+                        pair_sums.at((block_first + i)*n_bins + b2) = sums.at(i);
+                    }
+                }
+            }
+
+            // Add this m to the Legendre sums
+            for (int b1=0; b1<n_bins; b1++){
+                for (int b2=0; b2<n_bins; b2++){
+                    const long int index = l*n_pairs + b1*n_bins + b2;
+                    const complex<double> Q1 = Q.at(b1*n_lm + l*(l+1)/2 + m);
+                    const complex<double> Q2 = Q.at(b2*n_lm + l*(l+1)/2 + m);
+                    const double QQ = (Q1*std::conj(Q2)).real();
+                    DDD.at(index) += weight * pair_sums.at(std::min(b1,b2)*n_bins + std::max(b1,b2));
+                    DDR.at(index) += weight * (A.at(b1)*std::conj(Q2)).real();
+                    DRR.at(index) += weight * double(sum_d) * QQ;
+                    RRR.at(index) += weight * double(Nres3) * QQ;
+                }
+            }
+        } // endfor m
+        printf("      l=%d done at %s\n", l, currentTimeTaken().c_str());
+    } // endfor l
+
+    // Remove the degenerate triangles from the diagonal
+    for (int l=0; l<=lmax; l++){
+        for (int bin_i=0; bin_i<n_bins; bin_i++){
+            const long int index = l*n_pairs + bin_i*n_bins + bin_i;
+            DDD.at(index) -= DDD_self.at(bin_i);
+            DDR.at(index) -= DDR_self.at(bin_i);
+            DRR.at(index) -= double(sum_d) * shells.at(bin_i).size();
+            RRR.at(index) -= double(Nres3) * shells.at(bin_i).size();
+        }
+    }
+
+    fftwf_destroy_plan(forward);
+    fftwf_destroy_plan(backward);
+    fftwf_free(dhat);
+    for (int held_i=0; held_i<n_held; held_i++) fftwf_free(held.at(held_i));
+    if (streamed) fftwf_free(streamed);
+
+    // Save the multipoles
+    //  zeta_l = (2l+1) (DDD_l - RRR_l) / RRR_0
+    //  is the plain estimator's Legendre coefficient when the triangles
+    //  of a bin pair are spread evenly in cos(theta)
+    ofstream save_file_id(multipolefilename);
+    if (save_file_id){ 
+        save_file_id.fill(' ');
+        save_file_id << setw(22) << left << "# R1_avg";
+        save_file_id << '\t' << setw(23) << left << "R2_avg";
+        save_file_id << '\t' << setw(4) << left << "l";
+        save_file_id << '\t' << setw(23) << left << "zeta_l";
+        save_file_id << '\t' << setw(23) << left << "DDD_l";
+        save_file_id << '\t' << setw(23) << left << "DDR_l";
+        save_file_id << '\t' << setw(23) << left << "DRR_l";
+        save_file_id << '\t' << setw(23) << left << "RRR_l";
+        save_file_id << "\n";
+        save_file_id.precision(16);
+        save_file_id.setf(ios_base::scientific);
+        for (int b1=0; b1<n_bins; b1++){
+            for (int b2=0; b2<n_bins; b2++){
+                const double RRR_0 = RRR.at(b1*n_bins + b2);
+                for (int l=0; l<=lmax; l++){
+                    const long int index = l*n_pairs + b1*n_bins + b2;
+                    double zeta = (2*l+1) * (DDD.at(index) - RRR.at(index)) / RRR_0;
+                    save_file_id << setw(23) << shell_r.at(b1)*cell_size;
+                    save_file_id << '\t' << setw(23) << shell_r.at(b2)*cell_size;
+                    save_file_id << '\t' << setw(4) << l;
+                    save_file_id << '\t' << setw(23) << zeta;
+                    save_file_id << '\t' << setw(23) << DDD.at(index);
+                    save_file_id << '\t' << setw(23) << DDR.at(index);
+                    save_file_id << '\t' << setw(23) << DRR.at(index);
+                    save_file_id << '\t' << setw(23) << RRR.at(index);
+                    save_file_id << '\n';
+                }
+            }
+        }
+        save_file_id.close();
+    } else {
+       printf("Could not open save file '%s'\n",multipolefilename);                
+    }
+
+    // Project onto the triangles of each verts bin, for cross-checking
+    // Offsets at |r1|, |r2| with r3 in [rmin, rmax) fill a cos(theta)
+    // window whose indicator is sum_l c_l P_l, c_l = (2l+1)/2 int P_l dmu
+    // Each pair of sub-shells (exact grid radii) has its own window; with
+    // directions spread evenly in cos(theta), the bin's window is their
+    // mean weighted by pair count. The series stops at lmax, so the sums
+    // are then scaled to the bin's exact RRR (its triangles times Nres^3)
+    vector<statistics_with_jk> *results = new vector<statistics_with_jk>(n_bins);
+    for (int bin_i=0; bin_i<n_bins; bin_i++){
+        if (shells.at(bin_i).size()==0) continue;
+        const double r3min = selectionFunction->at(bin_i).rmin / cell_size;
+        const double r3max = selectionFunction->at(bin_i).rmax / cell_size;
+
+        // Sub-shells: offsets of each |r|^2 (an integer on the grid)
+        std::map<long int, long int> subshells;
+        for (size_t pt_i=0; pt_i<shells.at(bin_i).size(); pt_i++){
+            point& r = shells.at(bin_i).at(pt_i);
+            subshells[long(r.x)*r.x + long(r.y)*r.y + long(r.z)*r.z]++;
+        }
+
+        // Window coefficients summed over the sub-shell pairs (less the
+        // degenerate r1==r2, as the Legendre sums)
+        vector<double> c(lmax+1, 0.0);
+        double n_pairs_bin = 0;
+        std::map<long int, long int>::const_iterator s1, s2;
+        for (s1=subshells.begin(); s1!=subshells.end(); s1++){
+            for (s2=subshells.begin(); s2!=subshells.end(); s2++){
+                const double q1 = s1->first, q2 = s2->first;
+                const double pairs = double(s1->second)*s2->second - ((s1==s2) ? s1->second : 0);
+                n_pairs_bin += pairs;
+                const double mu_a = std::max(-1.0, (q1 + q2 - r3max*r3max)/(2*sqrt(q1*q2)));
+                const double mu_b = std::min( 1.0, (q1 + q2 - r3min*r3min)/(2*sqrt(q1*q2)));
+                if (mu_b<=mu_a) continue;
+                c.at(0) += pairs * 0.5*(mu_b - mu_a);
+                for (int l=1; l<=lmax; l++){
+                    c.at(l) += pairs * 0.5*( (legendre(l+1,mu_b) - legendre(l-1,mu_b))
+                                           - (legendre(l+1,mu_a) - legendre(l-1,mu_a)) );
+                }
+            }
+        }
+
+        statistics& s = results->at(bin_i).stats;
+        for (int l=0; l<=lmax; l++){
+            const double c_l = c.at(l) / std::max(n_pairs_bin, 1.0);
+            const long int index = l*n_pairs + bin_i*n_bins + bin_i;
+            s.DDD += c_l * DDD.at(index);
+            s.DDR += c_l * DDR.at(index);
+            s.DRR += c_l * DRR.at(index);
+            s.RRR += c_l * RRR.at(index);
+        }
+
+        // Triangles of the verts bin (see triangle_configs::triangles)
+        if (s.RRR>0){
+            const double scale = double(Nres3)*selectionFunction->at(bin_i).triangles() / s.RRR;
+            s.DDD *= scale;
+            s.DDR *= scale;
+            s.DRR *= scale;
+            s.RRR *= scale;
+        }
+    }
+
+    return results;
+}
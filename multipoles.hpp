@@ -0,0 +1,44 @@
+/*************************************************************
+  Interface for FFT-based 3PCF multipoles
+*************************************************************/
+
+#ifndef __MULTIPOLES_HPP__
+#define __MULTIPOLES_HPP__
+
+#include "corr3.hpp"
+
+#include <fftw3.h>
+
+// Isotropic 3PCF multipoles on the full grid
+//
+//  For every radial shell b (one per bin in the verts file) and every
+//  spherical harmonic (l,m), the shell-weighted field
+//      a_lm^b(x) = sum_{r in b} d(x+r) Y*_lm(r^)
+//  is one FFT convolution. Summing d(x) a_lm^b1(x) a*_lm^b2(x) over x
+//  and m gives the Legendre-weighted triangle sums
+//      DDD_l(b1,b2) = sum_x sum_{r1 in b1, r2 in b2} d(x)d(x+r1)d(x+r2) P_l(r1^.r2^)
+//  with DDR_l, DRR_l, RRR_l from the same shells against a uniform field.
+//  Degenerate triangles (r1==r2) are removed.
+//
+//  The multipoles are saved to multipolefilename, and the returned
+//  statistics are the same sums projected onto the triangles of each
+//  verts bin (r1, r2 in the bin, r3 in the bin), for save(): a series
+//  truncated at lmax, scaled to the exact RRR of the bin's triangles
+vector<statistics_with_jk>*
+run_multipoles(const float* box,
+               vector< triangle_configs > *selectionFunction,
+               int Nres, float cell_size, int lmax,
+               const char *multipolefilename);
+
+// Shells whose a_lm run_multipoles holds at once (shell_block, or all
+// n_bins if 0); fewer means less memory, and more transforms for the
+// later shells, one at a time
+int multipole_shells_held(int n_bins);
+
+// Normalised associated Legendre function, Y_lm = Plm_norm(l,m,cos(theta)) e^{i m phi}
+double Plm_norm(int l, int m, double x);
+
+// Legendre polynomial P_l(x)
+double legendre(int l, double x);
+
+#endif
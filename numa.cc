@@ -0,0 +1,196 @@
+/*************************************************************
+  NUMA placement: thread pinning and per-node replicas
+*************************************************************/
+
+#include "numa.hpp"
+
+#include <omp.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <string>
+#include <iostream>
+using std::string;
+using std::cout;
+
+// CPUs of a cpulist such as "0-3,8-11"
+static vector<int> parse_cpulist(const string& cpulist){
+    vector<int> cpus;
+    size_t start = 0;
+    while (start<cpulist.length()){
+        size_t end = cpulist.find(',', start);
+        if (end==string::npos) end = cpulist.length();
+        const string range = cpulist.substr(start, end - start);
+        const size_t dash = range.find('-');
+        const int first = atoi(range.c_str());
+        const int last = (dash==string::npos) ? first : atoi(range.c_str() + dash + 1);
+        for (int cpu=first; cpu<=last and range.length()>0; cpu++) cpus.push_back(cpu);
+        start = end + 1;
+    }
+    return cpus;
+}
+
+// Node of every CPU, from /sys (empty if there is no NUMA information)
+static const std::map<int,int>& cpu_nodes(){
+    static std::map<int,int> nodes;
+    static bool loaded = false;
+    #pragma omp critical(numa_cpu_nodes)
+    if (!loaded){
+        const char* node_dir = "/sys/devices/system/node";
+        DIR* dir = opendir(node_dir);
+        struct dirent* entry;
+        while (dir and (entry = readdir(dir))!=NULL){
+            if (strncmp(entry->d_name, "node", 4)!=0) continue;
+            const int node = atoi(entry->d_name + 4);
+            std::ifstream cpulist_file((string(node_dir) + "/" + entry->d_name + "/cpulist").c_str());
+            string cpulist;
+            std::getline(cpulist_file, cpulist);
+            vector<int> cpus = parse_cpulist(cpulist);
+            for (size_t cpu_i=0; cpu_i<cpus.size(); cpu_i++) nodes[cpus[cpu_i]] = node;
+        }
+        if (dir) closedir(dir);
+        loaded = true;
+    }
+    return nodes;
+}
+
+static int node_of_cpu(int cpu){
+    const std::map<int,int>& nodes = cpu_nodes();
+    std::map<int,int>::const_iterator found = nodes.find(cpu);
+    return (found==nodes.end()) ? 0 : found->second;
+}
+
+int numa_node_count(){
+    const std::map<int,int>& nodes = cpu_nodes();
+    vector<int> distinct;
+    for (std::map<int,int>::const_iterator it=nodes.begin(); it!=nodes.end(); ++it){
+        distinct.push_back(it->second);
+    }
+    std::sort(distinct.begin(), distinct.end());
+    return std::max(int(std::unique(distinct.begin(), distinct.end()) - distinct.begin()), 1);
+}
+
+int current_numa_node(){
+    const int cpu = sched_getcpu();
+    return (cpu<0) ? 0 : node_of_cpu(cpu);
+}
+
+// CPUs this process may run on, as when first asked (before any
+// thread, including this one, is pinned)
+static const vector<int>& allowed_cpus(){
+    static vector<int> cpus;
+    static bool loaded = false;
+    if (!loaded){
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set)==0){
+            for (int cpu=0; cpu<CPU_SETSIZE; cpu++){
+                if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+            }
+        }
+        loaded = true;
+    }
+    return cpus;
+}
+
+// Pin thread t to the t-th CPU in order (wrapping if there are more
+// threads than CPUs): node by node, or round-robin over the nodes
+int pin_threads(int pin_mode){
+    if (pin_mode==PIN_OFF) return 0;
+    const vector<int>& cpus = allowed_cpus();
+    if (cpus.empty()) return 0;
+
+    // CPUs of each node, in order
+    std::map< int, vector<int> > node_cpus;
+    for (size_t cpu_i=0; cpu_i<cpus.size(); cpu_i++){
+        node_cpus[node_of_cpu(cpus[cpu_i])].push_back(cpus[cpu_i]);
+    }
+    vector<int> order;
+    if (pin_mode==PIN_COMPACT){
+        for (std::map< int, vector<int> >::iterator it=node_cpus.begin(); it!=node_cpus.end(); ++it){
+            order.insert(order.end(), it->second.begin(), it->second.end());
+        }
+    } else {
+        for (size_t rank=0; order.size()<cpus.size(); rank++){
+            for (std::map< int, vector<int> >::iterator it=node_cpus.begin(); it!=node_cpus.end(); ++it){
+                if (rank<it->second.size()) order.push_back(it->second[rank]);
+            }
+        }
+    }
+
+    const int n_threads = omp_get_max_threads();
+    vector<int> thread_node(n_threads, -1);
+    bool pinned = true;
+    #pragma omp parallel num_threads(n_threads)
+    {
+        const int thread = omp_get_thread_num();
+        const int cpu = order[thread % order.size()];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set)!=0){
+            #pragma omp atomic write
+            pinned = false;
+        }
+        thread_node[thread] = node_of_cpu(cpu);
+    }
+    if (!pinned) return 0;
+    std::sort(thread_node.begin(), thread_node.end());
+    return std::unique(thread_node.begin(), thread_node.end()) - thread_node.begin();
+}
+
+numa_replicas::numa_replicas() : node_count(0), thread_node(omp_get_max_threads(), 0){
+
+    // Node of each thread, numbered densely in order of the node ids
+    vector<int> nodes(thread_node.size(), 0);
+    #pragma omp parallel num_threads(nodes.size())
+    nodes[omp_get_thread_num()] = current_numa_node();
+    vector<int> distinct(nodes);
+    std::sort(distinct.begin(), distinct.end());
+    distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+    for (size_t thread=0; thread<nodes.size(); thread++){
+        thread_node[thread] = std::lower_bound(distinct.begin(), distinct.end(), nodes[thread]) - distinct.begin();
+    }
+    node_count = distinct.size();
+}
+
+numa_replicas::~numa_replicas(){
+    for (size_t copy_i=0; copy_i<copies.size(); copy_i++) free(copies[copy_i]);
+}
+
+int numa_replicas::node() const{
+    return thread_node[omp_get_thread_num()];
+}
+
+// Each node's threads copy an equal share of that node's replica
+vector<const void*> numa_replicas::replicate(const void* data, size_t bytes){
+    vector<void*> replicas(node_count, NULL);
+    for (int node_i=0; node_i<node_count; node_i++){
+        if (posix_memalign(&replicas[node_i], 4096, std::max(bytes, size_t(1)))!=0){
+            cout << "  ERROR: out of memory for a NUMA replica of " << bytes << " bytes\n";
+            exit(1);
+        }
+        copies.push_back(replicas[node_i]);
+    }
+
+    // Rank of each thread among the threads of its node
+    const int n_threads = thread_node.size();
+    vector<int> rank(n_threads), per_node(node_count, 0);
+    for (int thread=0; thread<n_threads; thread++) rank[thread] = per_node[thread_node[thread]]++;
+
+    #pragma omp parallel num_threads(n_threads)
+    {
+        const int thread = omp_get_thread_num();
+        const int node_i = thread_node[thread];
+        const size_t first = bytes * rank[thread] / per_node[node_i];
+        const size_t last = bytes * (rank[thread] + 1) / per_node[node_i];
+        memcpy((char*)replicas[node_i] + first, (const char*)data + first, last - first);
+    }
+    return vector<const void*>(replicas.begin(), replicas.end());
+}
@@ -0,0 +1,64 @@
+/*************************************************************
+  NUMA placement: thread pinning and per-node replicas
+  Pages land on the node of the thread that first touches them,
+  so read-only fields gathered by every thread are copied once
+  per node, each copy touched by that node's (pinned) threads
+*************************************************************/
+
+#ifndef __NUMA_HPP__
+#define __NUMA_HPP__
+
+#include <stddef.h>
+
+#include <vector>
+using std::vector;
+
+// Placement of the kernels' read-only fields
+//   NUMA_OFF:       one copy, wherever it was first touched
+//   NUMA_REPLICATE: one copy per NUMA node the threads run on
+enum numa_modes { NUMA_OFF, NUMA_REPLICATE };
+
+// Pinning of the OpenMP threads to the CPUs this process may use
+//   PIN_OFF:     left to the OS (or OMP_PROC_BIND / OMP_PLACES)
+//   PIN_COMPACT: thread t on the t-th CPU, filling one node first
+//   PIN_SPREAD:  round-robin over the nodes
+enum pin_modes { PIN_OFF, PIN_COMPACT, PIN_SPREAD };
+
+// NUMA nodes of the machine (1 if not known)
+int numa_node_count();
+
+// Node of the CPU the calling thread runs on (0 if not known)
+int current_numa_node();
+
+// Pin each thread of the current team size; returns the number of
+// nodes the threads are spread over (0 if pinning failed)
+int pin_threads(int pin_mode);
+
+// Copies of read-only arrays, one per NUMA node of the OpenMP threads
+// (made outside a parallel region, read inside one); nodes are taken
+// when made, so threads should be pinned
+class numa_replicas{
+public:
+    numa_replicas();
+    ~numa_replicas();
+
+    // Nodes the threads run on
+    int n_nodes() const { return node_count; }
+
+    // Index (0 to n_nodes-1) of the node of the calling thread
+    int node() const;
+
+    // Copy of bytes of data on every node, first touched by that node's
+    // threads (indexed by node(), freed with this object)
+    vector<const void*> replicate(const void* data, size_t bytes);
+
+private:
+    int node_count;
+    vector<int> thread_node;        // node index of each OpenMP thread
+    vector<void*> copies;
+
+    numa_replicas(const numa_replicas&);
+    numa_replicas& operator=(const numa_replicas&);
+};
+
+#endif
@@ -0,0 +1,144 @@
+/*************************************************************
+  Memory planner
+*************************************************************/
+
+#include "planner.hpp"
+#include "globals.hpp"
+#include "jackknife.hpp"
+#include "quantise.hpp"
+#include "numa.hpp"
+#include "multipoles.hpp"
+
+#include <fstream>
+
+// Bytes of the triangle configurations (points and linear offsets)
+static double configs_bytes(vector< triangle_configs > *selectionFunction){
+    double bytes = selectionFunction->capacity() * sizeof(triangle_configs);
+    for (size_t bin_i=0; bin_i<selectionFunction->size(); bin_i++){
+        const vector<triangle_set>& sets = selectionFunction->at(bin_i).sets;
+        bytes += sets.capacity() * sizeof(triangle_set);
+        for (size_t set_i=0; set_i<sets.size(); set_i++){
+            bytes += sets[set_i].ptsC.capacity() * sizeof(point) + sets[set_i].offsC.capacity() * sizeof(int);
+        }
+    }
+    return bytes;
+}
+
+// Distinct k shells over the sides of the bispectrum bins
+static int kshell_count(vector<kbin_triangle> *kbins){
+    vector< pair<float,float> > shells;
+    for (size_t bin_i=0; bin_i<kbins->size(); bin_i++){
+        for (int side=0; side<3; side++){
+            pair<float,float> range(kbins->at(bin_i).kmin[side], kbins->at(bin_i).kmax[side]);
+            if (std::find(shells.begin(), shells.end(), range)==shells.end()) shells.push_back(range);
+        }
+    }
+    return shells.size();
+}
+
+double memory_plan::peak() const {
+    return boxes + configs + samples + std::max(kernel(), fft);
+}
+
+memory_plan plan_memory(vector< triangle_configs > *selectionFunction, int Nres,
+                        int n_fields, int nx, bool multipoles, vector<kbin_triangle> *kbins){
+
+    const double Nres3 = double(Nres)*Nres*Nres;
+    const int n_bins = selectionFunction->size();
+    const bool wrap = (kernel_mode==KERNEL_WRAP);
+    const bool slab = (nx<Nres);
+    const int K = std::max(batch_size, 1);
+    const int halo = wrap ? 0 : max_offset(selectionFunction);
+    const double Npad = Nres + 2*halo;
+    const double n_cells = Npad*Npad*(slab ? nx + 2*halo : Npad);
+
+    memory_plan plan;
+    plan.boxes = slab ? double(nx + 2*halo)*Nres*Nres*sizeof(float) : (K>1 ? K : n_fields)*Nres3*sizeof(float);
+    plan.configs = configs_bytes(selectionFunction);
+    plan.samples = (sample_fraction<1.0) ? sample_fraction*Nres3*sizeof(long int) : 0.0;
+    if (traversal_mode==TRAVERSE_TILES and !wrap and !slab) plan.samples *= 3;     // regrouped by tile
+    plan.padded = plan.jk_map = plan.replicas = plan.accumulators = plan.fft = 0.0;
+
+    // Direct kernel: the fields it reads (padded copies, quantised
+    // once both are held, or the boxes themselves), one map of the
+    // jackknife regions, and per-node copies of both
+    if (!multipoles){
+        double stored = 0.0;
+        if (wrap){
+            stored = n_fields*Nres3*sizeof(float);
+        } else if (K>1){
+            plan.padded = K*(Nres3 + n_cells)*sizeof(float);
+            stored = K*n_cells*sizeof(float);
+        } else if (storage_mode!=STORAGE_FLOAT){
+            stored = n_fields*n_cells*storage_bytes(storage_mode);
+            plan.padded = n_fields*n_cells*sizeof(float) + stored;
+        } else {
+            stored = plan.padded = n_fields*n_cells*sizeof(float);
+        }
+        plan.jk_map = (jackknife_N>1) ? (wrap ? Nres3 : n_cells)*sizeof(jk_region) : 0.0;
+        if (numa_mode==NUMA_REPLICATE and numa_node_count()>1){
+            plan.replicas = numa_node_count()*(stored + plan.jk_map);
+        }
+        plan.accumulators = accumulator_bytes(n_bins*K);
+    }
+
+    // FFT engines: the field's transform, and the held shells and one
+    // streamed shell, or the field and its square and a work grid
+    // (multipoles), or three transforms and a filtered field and
+    // indicator per k shell (bispectrum), single precision complex
+    if (multipoles){
+        const int held = multipole_shells_held(n_bins);
+        plan.fft = (1 + std::max(held + (held<n_bins ? 1 : 0), 2))*Nres3*sizeof(fftwf_complex);
+    }
+    if (kbins){
+        plan.fft = std::max(plan.fft, 3*Nres3*sizeof(fftwf_complex) + 2.0*kshell_count(kbins)*Nres3*sizeof(float));
+    }
+    return plan;
+}
+
+void print_memory_plan(const memory_plan& plan, double limit){
+    const double GB = 1024.0*1024.0*1024.0;
+    printf("  Memory plan (GB): boxes %.3g, bins %.3g, primaries %.3g, padded %.3g, jackknife map %.3g,\n",
+           plan.boxes/GB, plan.configs/GB, plan.samples/GB, plan.padded/GB, plan.jk_map/GB);
+    printf("                    NUMA copies %.3g, sums %.3g, FFT %.3g\n",
+           plan.replicas/GB, plan.accumulators/GB, plan.fft/GB);
+    if (limit>0){
+        printf("  Peak %.3g GB of %.3g GB available\n", plan.peak()/GB, limit/GB);
+    } else {
+        printf("  Peak %.3g GB (memory available unknown)\n", plan.peak()/GB);
+    }
+}
+
+// First number in a file (0 if missing or not a number, e.g. "max")
+static double read_number(const char* filename){
+    std::ifstream in(filename);
+    double value = 0.0;
+    if (!(in >> value)) return 0.0;
+    return value;
+}
+
+double available_memory(){
+
+    // MemAvailable (kB) from /proc/meminfo
+    double available = 0.0;
+    std::ifstream meminfo("/proc/meminfo");
+    string line;
+    while (std::getline(meminfo, line)){
+        if (line.compare(0, 13, "MemAvailable:")==0){
+            available = atof(line.c_str() + 13) * 1024.0;
+        }
+    }
+
+    // Limit of the cgroup (v2, else v1) less what it already uses
+    double limit = read_number("/sys/fs/cgroup/memory.max");
+    double used = read_number("/sys/fs/cgroup/memory.current");
+    if (limit<=0){
+        limit = read_number("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+        used = read_number("/sys/fs/cgroup/memory/memory.usage_in_bytes");
+    }
+    if (limit>0 and limit<1e18){
+        const double cgroup_free = std::max(limit - used, 0.0);
+        available = (available>0) ? std::min(available, cgroup_free) : cgroup_free;
+    }
+    return available;
+}
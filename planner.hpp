@@ -0,0 +1,55 @@
+/*************************************************************
+  Memory planner
+  Expected peak memory of a run, part by part, from the grid,
+  the bins and the settings, checked against a limit before
+  anything large is allocated
+*************************************************************/
+
+#ifndef __PLANNER_HPP__
+#define __PLANNER_HPP__
+
+#include "corr3.hpp"
+#include "bispectrum.hpp"
+
+// What to do when the plan is over the limit
+//   PLAN_ADAPT:  turn off NUMA replication, then batches, then dense
+//                jackknife rows, then halve the multipoles shells held,
+//                then padding (wrap kernel), until it fits
+//   PLAN_REFUSE: stop with the plan
+//   PLAN_OFF:    no check (the plan is still printed)
+enum plan_modes { PLAN_ADAPT, PLAN_REFUSE, PLAN_OFF };
+
+// Bytes held by a run; the kernel and the FFT engines run one after
+// the other, so only the larger of them counts towards the peak
+struct memory_plan{
+    double boxes;           // loaded boxes (a batch, the cross fields, or this rank's slab)
+    double configs;         // triangle configurations of the bins
+    double samples;         // list of sampled primaries
+    double padded;          // padded fields (and their codes), interleaved batch
+    double jk_map;          // jackknife region of every (padded) cell
+    double replicas;        // NUMA copies of the padded fields and map
+    double accumulators;    // every thread's sums, and the results
+    double fft;             // FFT arrays of the multipoles or bispectrum
+
+    double kernel() const { return padded + jk_map + replicas + accumulators; }
+    double peak() const;
+};
+
+// Plan of the direct kernel (kernel_mode, storage_mode, batch_size,
+// jackknife_N, numa_mode and threads from the globals), and of the
+// FFT engines if used (shell_block of the multipoles)
+//   n_fields:   distinct fields correlated (1, or up to 3 cross)
+//   nx:         planes of this rank's slab (Nres without MPI)
+//   multipoles: the FFT multipoles engine replaces the kernel
+//   kbins:      bispectrum bins (NULL for none)
+memory_plan plan_memory(vector< triangle_configs > *selectionFunction, int Nres,
+                        int n_fields, int nx, bool multipoles, vector<kbin_triangle> *kbins);
+
+// Print the parts of the plan and its peak against the limit (bytes)
+void print_memory_plan(const memory_plan& plan, double limit);
+
+// Memory this process may still use: MemAvailable, capped by the
+// cgroup limit (bytes, 0 if neither is known)
+double available_memory();
+
+#endif
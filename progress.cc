@@ -0,0 +1,77 @@
+/*************************************************************
+  Live progress of the correlation kernels
+*************************************************************/
+
+#include "progress.hpp"
+#include "cpp_tools/timer.hpp"
+
+#include <omp.h>
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+
+progress_reporter::progress_reporter(int n_threads, double _expected_primaries,
+                double _triangles_per_primary, double _interval, double _done_before) :
+                slots(_interval>0 ? n_threads : 0),
+                expected_primaries(_expected_primaries),
+                triangles_per_primary(_triangles_per_primary),
+                interval(_interval), done_before(_done_before), last_counts(n_threads, 0), stopping(false){
+    if (interval<=0) return;
+    start = omp_get_wtime();
+    reporter = std::thread(&progress_reporter::run, this);
+}
+
+progress_reporter::~progress_reporter(){
+    if (interval<=0) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    reporter.join();
+    report(true);
+}
+
+// Report every interval until stopped
+void progress_reporter::run(){
+    std::unique_lock<std::mutex> lock(mutex);
+    const std::chrono::duration<double> wait(interval);
+    while (!wake.wait_for(lock, wait, [this]{ return stopping; })){
+        report(false);
+    }
+}
+
+// One line: share of the primaries done, triangles/s, rate of the
+// slowest and fastest thread against the mean (since the last line,
+// or over the whole region for the summary) and the ETA
+void progress_reporter::report(bool final){
+    const double now = omp_get_wtime();
+    const int n_threads = slots.size();
+    uint64_t done = 0;
+    double slowest = 0, fastest = 0, mean = 0;
+    vector<double> thread_counts(n_threads);
+    for (int thread=0; thread<n_threads; thread++){
+        const uint64_t count = slots[thread].primaries.load(std::memory_order_relaxed);
+        done += count;
+        thread_counts[thread] = final ? count : count - last_counts[thread];
+        last_counts[thread] = count;
+    }
+    for (int thread=0; thread<n_threads; thread++) mean += thread_counts[thread] / n_threads;
+    if (mean>0){
+        slowest = *std::min_element(thread_counts.begin(), thread_counts.end()) / mean;
+        fastest = *std::max_element(thread_counts.begin(), thread_counts.end()) / mean;
+    }
+    const double elapsed = std::max(now - start, 1e-9);
+    const double rate = done / elapsed;
+
+    if (final){
+        printf("      [progress] %lu primaries in %.1f s, %.3g triangles/s, threads %.2f-%.2f of mean\n",
+               (unsigned long)done, elapsed, rate*triangles_per_primary, slowest, fastest);
+    } else {
+        const double remaining = std::max(expected_primaries - done_before - done, 0.0);
+        printf("      [progress] %5.1f%%, %.3g triangles/s, threads %.2f-%.2f of mean, ETA %s\n",
+               100.0*(done_before + done)/std::max(expected_primaries, 1.0), rate*triangles_per_primary, slowest, fastest,
+               rate>0 ? pretty_time(remaining/rate).c_str() : "unknown");
+    }
+    fflush(stdout);
+}
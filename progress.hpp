@@ -0,0 +1,61 @@
+/*************************************************************
+  Live progress of the correlation kernels
+  Each thread counts its primaries in its own cache line, and a
+  reporter thread reads the counts every interval to print the
+  rate, the spread across threads and an ETA
+*************************************************************/
+
+#ifndef __PROGRESS_HPP__
+#define __PROGRESS_HPP__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <vector>
+using std::vector;
+
+// Primaries done by one thread (written by that thread only, so a
+// relaxed load and store, no locked add)
+struct alignas(64) progress_slot{
+    std::atomic<uint64_t> primaries;
+    progress_slot() : primaries(0) {}
+    void add(){
+        primaries.store(primaries.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+};
+
+// Reporter for one run of the kernels (one or more parallel regions,
+// e.g. the chunks between checkpoints): made before them, destroyed
+// after them (which prints a summary line); off if interval<=0
+// triangles_per_primary: (ptB, ptC) pairs evaluated for each primary
+// done_before: of the expected primaries, those done by an earlier
+// (resumed) run, counted in the share done but not in the rate
+class progress_reporter{
+public:
+    progress_reporter(int n_threads, double expected_primaries,
+                      double triangles_per_primary, double interval, double done_before = 0.0);
+    ~progress_reporter();
+
+    // Counter of a thread, NULL if off
+    progress_slot* slot(int thread){ return slots.empty() ? NULL : &slots[thread]; }
+
+private:
+    vector<progress_slot> slots;
+    double expected_primaries, triangles_per_primary, interval, done_before;
+    double start;
+    vector<uint64_t> last_counts;
+
+    std::thread reporter;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping;
+
+    void run();
+    void report(bool final);
+};
+
+#endif
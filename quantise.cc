@@ -0,0 +1,76 @@
+/************************************************************
+  Quantised storage of the padded fields
+*************************************************************/
+
+#include "quantise.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// Name of a storage mode, for feedback
+const char* storage_name(int storage){
+    switch (storage){
+        case STORAGE_INT16: return "int16";
+        case STORAGE_INT8:  return "int8";
+        default:            return "float";
+    }
+}
+
+// Bytes per stored value
+int storage_bytes(int storage){
+    switch (storage){
+        case STORAGE_INT16: return 2;
+        case STORAGE_INT8:  return 1;
+        default:            return 4;
+    }
+}
+
+// Codes from -2^(bits-1) (the minimum) to 2^(bits-1)-1 (the maximum)
+template <typename Q>
+static Q* quantise_codes(const float* field, long int n, quantisation& quant){
+    const int bits = 8*sizeof(Q);
+    const long int lowest = -(1L << (bits-1));
+    const long int highest = (1L << (bits-1)) - 1;
+
+    float min = field[0], max = field[0];
+    #pragma omp parallel for reduction(min:min) reduction(max:max)
+    for (long int i=0; i<n; i++){
+        if (field[i]<min) min = field[i];
+        if (field[i]>max) max = field[i];
+    }
+
+    // A constant field is exact with any scale
+    const double scale = (max>min) ? (double(max) - min) / (highest - lowest) : 1.0;
+    quant.scale = (float)scale;
+    quant.offset = (float)(min - scale*lowest);
+
+    Q* codes = (Q*)malloc(n*sizeof(Q) + 4);
+    if (codes==NULL){
+        printf("  ERROR: could not allocate %ld quantised values\n", n);
+        exit(1);
+    }
+    memset(codes + n, 0, 4);
+
+    double max_error = 0;
+    #pragma omp parallel for reduction(max:max_error)
+    for (long int i=0; i<n; i++){
+        long int code = lround((double(field[i]) - min) / scale) + lowest;
+        if (code<lowest) code = lowest;
+        if (code>highest) code = highest;
+        codes[i] = (Q)code;
+
+        // Error of the value the kernel will see
+        const float value = quant.offset + quant.scale * codes[i];
+        const double error = fabs(double(value) - field[i]);
+        if (error>max_error) max_error = error;
+    }
+    quant.max_error = max_error;
+    return codes;
+}
+
+void* quantise_field(const float* field, long int n, int storage, quantisation& quant){
+    if (storage==STORAGE_INT8) return quantise_codes<int8_t>(field, n, quant);
+    return quantise_codes<int16_t>(field, n, quant);
+}
@@ -0,0 +1,37 @@
+/*************************************************************
+  Quantised storage of the padded fields
+  A field is stored as int16 or int8 codes q, with a scale and
+  offset for the whole box: value = offset + scale*q
+*************************************************************/
+
+#ifndef __QUANTISE_HPP__
+#define __QUANTISE_HPP__
+
+#include <stdint.h>
+
+// How the halo kernel stores each padded field
+//   STORAGE_FLOAT: the normalised floats (reference)
+//   STORAGE_INT16: 65536 levels over the field's range
+//   STORAGE_INT8:  256 levels (exact for two-valued maps)
+enum storage_modes { STORAGE_FLOAT, STORAGE_INT16, STORAGE_INT8 };
+
+// Scale and offset of one quantised field
+struct quantisation{
+    float scale, offset;
+    double max_error;       // largest |dequantised - original|
+    quantisation() : scale(1.0f), offset(0.0f), max_error(0.0) {};
+};
+
+// Name of a storage mode, for feedback
+const char* storage_name(int storage);
+
+// Bytes per stored value
+int storage_bytes(int storage);
+
+// Quantise n values to int16 or int8 codes spanning their range,
+// rounding to nearest (so max_error <= scale/2)
+// Allocated with spare bytes at the end, as the SIMD gathers read
+// 32 bits at each code; free() when done
+void* quantise_field(const float* field, long int n, int storage, quantisation& quant);
+
+#endif
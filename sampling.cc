@@ -0,0 +1,121 @@
+/************************************************************
+  Precomputed lists of sampled primary points
+*************************************************************/
+
+#include "sampling.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+
+static const char samples_magic[8] = {'C','3','S','A','M','P','0','1'};
+
+// Sorted list of sampled primaries, built in O(samples)
+vector<long int>* sample_primaries(long int Nres3, double fraction, uint64_t seed){
+    vector<long int>* primaries = new vector<long int>();
+
+    // Every voxel
+    if (fraction>=1.0){
+        primaries->resize(Nres3);
+        for (long int i=0; i<Nres3; i++) (*primaries)[i] = i;
+        return primaries;
+    }
+    primaries->reserve((size_t)(1.1*fraction*Nres3) + 16);
+
+    // Gap to the next accepted voxel is geometric with p = fraction
+    const double log_reject = log1p(-fraction);
+    long int i = -1;
+    for (uint64_t draw=0; ; draw++){
+        const double u = (double)((splitmix64(seed, draw) >> 11) + 1) * (1.0/9007199254740992.0);
+        const double gap = floor(log(u) / log_reject);
+        if (gap >= double(Nres3 - i)) break;
+        i += 1 + (long int)gap;
+        if (i >= Nres3) break;
+        primaries->push_back(i);
+    }
+    return primaries;
+}
+
+// Range of voxel indices of one shard
+void shard_range(long int Nres3, int shard, int n_shards, long int& first, long int& last){
+    first = (shard-1) * Nres3 / n_shards;
+    last = shard * Nres3 / n_shards;
+}
+
+// Primaries of one shard, a contiguous range of voxel indices
+vector<long int>* shard_primaries(const vector<long int>* primaries, long int Nres3, int shard, int n_shards){
+    long int first, last;
+    shard_range(Nres3, shard, n_shards, first, last);
+    return range_primaries(primaries, first, last);
+}
+
+// Range of a sorted list, by binary search
+vector<long int>* range_primaries(const vector<long int>* primaries, long int first, long int last){
+    vector<long int>::const_iterator begin = std::lower_bound(primaries->begin(), primaries->end(), first);
+    vector<long int>::const_iterator end = std::lower_bound(primaries->begin(), primaries->end(), last);
+    return new vector<long int>(begin, end);
+}
+
+// Store a list of primaries
+bool save_primaries(const vector<long int>* primaries, long int Nres3, double fraction, uint64_t seed,
+                    const char *samplesfilename){
+    FILE* file = fopen(samplesfilename, "wb");
+    if (file==NULL){
+        printf("Could not open samples file '%s'\n", samplesfilename);
+        return false;
+    }
+    samples_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, samples_magic, sizeof(samples_magic));
+    header.Nres3 = Nres3;
+    header.fraction = fraction;
+    header.seed = seed;
+    header.n_samples = primaries->size();
+    bool written = (fwrite(&header, sizeof(header), 1, file) == 1);
+    for (size_t sample_i=0; sample_i<primaries->size() and written; sample_i++){
+        int64_t i = primaries->at(sample_i);
+        written = (fwrite(&i, sizeof(int64_t), 1, file) == 1);
+    }
+    written = (fclose(file)==0) and written;
+    if (!written){
+        printf("Could not write samples file '%s'\n", samplesfilename);
+    }
+    return written;
+}
+
+// Header of a samples file
+bool read_samples_header(const char *samplesfilename, samples_header& header){
+    FILE* file = fopen(samplesfilename, "rb");
+    if (file==NULL) return false;
+    const bool read = (fread(&header, sizeof(header), 1, file) == 1);
+    fclose(file);
+    return read and memcmp(header.magic, samples_magic, sizeof(samples_magic))==0 and header.n_samples>=0;
+}
+
+// Load a list of primaries
+vector<long int>* load_primaries(const char *samplesfilename, samples_header& header){
+    if (!read_samples_header(samplesfilename, header)){
+        printf("  '%s' is not a samples file (or one without its fraction and seed)\n", samplesfilename);
+        exit(1);
+    }
+    FILE* file = fopen(samplesfilename, "rb");
+    if (file==NULL or fseek(file, sizeof(header), SEEK_SET)!=0){
+        printf("  Failed to load samples from '%s'\n", samplesfilename);
+        exit(1);
+    }
+    const int64_t n_samples = header.n_samples;
+    vector<long int>* primaries = new vector<long int>(n_samples);
+    for (int64_t sample_i=0; sample_i<n_samples; sample_i++){
+        int64_t i = -1;
+        if (fread(&i, sizeof(int64_t), 1, file) != 1){
+            printf("  Failed to load sample %ld of %ld\n", (long int)(1+sample_i), (long int)n_samples);
+            exit(1);
+        }
+        (*primaries)[sample_i] = i;
+    }
+    fclose(file);
+    return primaries;
+}
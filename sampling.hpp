@@ -0,0 +1,68 @@
+/*************************************************************
+  Counter-based sampling of primary points
+  Accept / reject of voxel i is a pure function of (seed, i),
+  so it is thread safe and the same for every run with a seed
+*************************************************************/
+
+#ifndef __SAMPLING_HPP__
+#define __SAMPLING_HPP__
+
+#include <stdint.h>
+
+#include <vector>
+using std::vector;
+
+// SplitMix64 finaliser of the counter (seed, index)
+inline uint64_t splitmix64(uint64_t seed, uint64_t index){
+    uint64_t z = seed + (index + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Threshold on the 64-bit hash that accepts a given fraction
+inline uint64_t sample_threshold(double fraction){
+    if (fraction >= 1.0) return UINT64_MAX;
+    if (fraction <= 0.0) return 0;
+    return (uint64_t)(fraction * 18446744073709551616.0);
+}
+
+// Whether voxel i is a sampled primary
+inline bool accept_primary(uint64_t seed, uint64_t i, uint64_t threshold){
+    return splitmix64(seed, i) < threshold;
+}
+
+// Sorted list of sampled primaries, built in O(samples)
+// Each voxel is kept with probability fraction (Bernoulli, like the
+// rejection scan), by drawing geometric gaps between accepted indices
+vector<long int>* sample_primaries(long int Nres3, double fraction, uint64_t seed);
+
+// Voxel indices [first, last) of shard k of n (k from 1 to n):
+// [(k-1)*Nres3/n, k*Nres3/n), disjoint and covering every voxel
+void shard_range(long int Nres3, int shard, int n_shards, long int& first, long int& last);
+
+// Primaries of the list in shard k of n (see shard_range)
+vector<long int>* shard_primaries(const vector<long int>* primaries, long int Nres3, int shard, int n_shards);
+
+// Primaries of the list in the voxel indices [first, last)
+vector<long int>* range_primaries(const vector<long int>* primaries, long int first, long int last);
+
+// Header of a samples file: how its primaries were drawn
+struct samples_header{
+    char magic[8];
+    int64_t Nres3;          // voxels of the box
+    double fraction;        // sample_fraction
+    uint64_t seed;          // sample_seed
+    int64_t n_samples;
+};
+
+// Store / load a list of primaries (the header, then int64 indices)
+// save_primaries returns false if the list could not be written;
+// read_samples_header false if the file is not a samples file with
+// its header (e.g. an older list of indices only)
+bool save_primaries(const vector<long int>* primaries, long int Nres3, double fraction, uint64_t seed,
+                    const char *samplesfilename);
+bool read_samples_header(const char *samplesfilename, samples_header& header);
+vector<long int>* load_primaries(const char *samplesfilename, samples_header& header);
+
+#endif